@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures how closely the pitch a synthesizer would play from Midislide's
+// output follows the exact slide curves, and how many messages that takes,
+// for a range of pitch bend rates, sample rates and block sizes.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+#include "core.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_SAMPLE_RATES "44100,48000,96000"
+#define DEFAULT_BLOCK_SIZES "64,256,1024"
+#define DEFAULT_BEND_RATES "50,100,200,500,1000,2000,4000"
+#define DEFAULT_SLIDES 64
+
+#define MAX_LIST_SIZE 32
+#define TEMPO 120
+#define BEAT_DIVISOR 4
+#define FIRST_KEY 60
+
+// Intervals and velocities (lengths) of the generated slides, used in turn.
+// Intervals are limited to the pitch bend semitone distance.
+static const int intervals[] = {7, -5, 12, -12, 3, -10, 5, 2, -7, 9, -4, 1};
+static const uint8_t velocities[] = {1, 4, 2, 8, 3, 6, 1, 5, 2, 7};
+
+typedef struct {
+    // Start of the first note.
+    uint64_t note_on;
+    // Start of the slide (and of the second note).
+    uint64_t start;
+    // Length in samples, which needn't be a whole number.
+    double length;
+    int from;
+    int to;
+} Slide;
+
+// The input for one sample rate.
+typedef struct {
+    uint32_t sample_rate;
+    MidislideEventBuffer events;
+    Slide *slides;
+    size_t n_slides;
+    uint64_t length;
+} Input;
+
+typedef struct {
+    double messages_per_second;
+    double rms_cents;
+    double max_cents;
+    double rms_timing_ms;
+    double max_timing_ms;
+} Result;
+
+// State of the synthesizer receiving the output.
+typedef struct {
+    // The key playing, or -1.
+    int key;
+    // Channel pitch bend and per-note pitch bends, in semitones.
+    double channel_bend;
+    double note_bends[128];
+} Receiver;
+
+static void usage(const char *name) {
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -r <rates>     Sample rates (default: %s)\n"
+        "  -b <frames>    Block sizes (default: %s)\n"
+        "  -p <rates>     Pitch bend rates in Hz (default: %s)\n"
+        "  -s <value>     Pitch bend semitone distance (default: 12)\n"
+        "  -m <mode>      Pitch bend mode: 0 = fixed rate, 1 = on change\n"
+        "                 (default: 0)\n"
+        "  -t <step>      Minimum pitch bend step (default: 1)\n"
+        "  -c <curve>     Slide curve: 0 = linear, 1 = exponential,\n"
+        "                 2 = logarithmic, 3 = S-curve (default: 0)\n"
+        "  -f <format>    Output format: 0 = MIDI 1.0, 1 = MIDI 2.0\n"
+        "                 (default: 0)\n"
+        "  -n <count>     Number of slides (default: %d)\n"
+        "  -j <threads>   Threads (default: one per processor)\n"
+        "\n"
+        "Lists are separated by commas. Every combination of sample rate,\n"
+        "block size and pitch bend rate is run, and printed as a row of\n"
+        "tab-separated values: output messages per second, the RMS and\n"
+        "maximum error of the pitch played (from the note playing and the\n"
+        "last pitch bend) in cents, and the RMS and maximum time in\n"
+        "milliseconds by which each pitch bend lags behind the point where\n"
+        "the exact curve has the same pitch.\n",
+        name, DEFAULT_SAMPLE_RATES, DEFAULT_BLOCK_SIZES, DEFAULT_BEND_RATES,
+        DEFAULT_SLIDES
+    );
+}
+
+static bool parse_list(const char *text, uint32_t *values, size_t *size) {
+    *size = 0;
+    while (*text != '\0') {
+        char *end;
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || value == 0 || *size >= MAX_LIST_SIZE) return false;
+        values[(*size)++] = value;
+        if (*end == ',') end++;
+        else if (*end != '\0') return false;
+        text = end;
+    }
+    return *size > 0;
+}
+
+static bool add_note(
+        Input *input, uint64_t time, uint8_t status, int key,
+        uint8_t velocity) {
+    const uint8_t message[] = {status, key, velocity};
+    return midislide_event_buffer_add_midi(
+        &input->events, time, message, sizeof(message)
+    );
+}
+
+// Generates separate slides: a note starts, slides to the next, and both are
+// released. Returns false if there isn't enough memory.
+static bool generate_input(
+        Input *input, uint32_t sample_rate, size_t n_slides,
+        float semitone_distance) {
+    memset(input, 0, sizeof(*input));
+    input->sample_rate = sample_rate;
+    midislide_event_buffer_init(&input->events);
+    input->slides = calloc(n_slides, sizeof(*input->slides));
+    if (input->slides == NULL) return false;
+    input->n_slides = n_slides;
+
+    int max_interval = semitone_distance >= 1 ? semitone_distance : 1;
+    double samples_per_beat = sample_rate * 60.0 / TEMPO;
+    uint64_t time = 0;
+    bool success = midislide_event_buffer_add_tempo(
+        &input->events, 0, TEMPO
+    );
+
+    size_t n_intervals = sizeof(intervals) / sizeof(*intervals);
+    size_t n_velocities = sizeof(velocities) / sizeof(*velocities);
+    for (size_t i = 0; success && i < n_slides; i++) {
+        int interval = intervals[i % n_intervals];
+        if (interval > max_interval) interval = max_interval;
+        if (interval < -max_interval) interval = -max_interval;
+        uint8_t velocity = velocities[i % n_velocities];
+
+        Slide *slide = &input->slides[i];
+        slide->note_on = time + (uint64_t)(samples_per_beat / 2);
+        slide->start = slide->note_on + (uint64_t)(samples_per_beat / 2);
+        slide->length = velocity * samples_per_beat / BEAT_DIVISOR;
+        slide->from = FIRST_KEY;
+        slide->to = FIRST_KEY + interval;
+
+        // Holding the first note longer would slide back to it.
+        uint64_t end = slide->start + llround(slide->length);
+        time = end + (uint64_t)(samples_per_beat / 4);
+        success = (
+            add_note(input, slide->note_on, LV2_MIDI_MSG_NOTE_ON,
+                     slide->from, 100) &&
+            add_note(input, slide->start, LV2_MIDI_MSG_NOTE_ON, slide->to,
+                     velocity) &&
+            add_note(input, end, LV2_MIDI_MSG_NOTE_OFF, slide->from, 0) &&
+            add_note(input, time, LV2_MIDI_MSG_NOTE_OFF, slide->to, 0)
+        );
+    }
+    input->length = time + (uint64_t)samples_per_beat;
+    return success;
+}
+
+static void free_input(Input *input) {
+    midislide_event_buffer_free(&input->events);
+    free(input->slides);
+}
+
+// Converts a pitch bend value, relative to the center, to semitones.
+static inline double bend_semitones(
+        int64_t value, int64_t range_low, int64_t range_high,
+        float semitone_distance) {
+    int64_t range = value < 0 ? range_low : range_high;
+    return (double)value / range * semitone_distance;
+}
+
+// Updates the receiver with an output event. Returns true if the event was a
+// pitch bend.
+static bool receive(
+        Receiver *receiver, const MidislideEvent *event,
+        float semitone_distance) {
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t word = 0;
+    if (event->ump) {
+        uint32_t words[2] = {0, 0};
+        memcpy(words, event->data, event->size < 8 ? event->size : 8);
+        uint32_t type = words[0] >> 28;
+        status = words[0] >> 16;
+        data1 = words[0] >> 8 & 0x7F;
+        data2 = words[0] & 0x7F;
+        word = words[1];
+        if (type == UMP_TYPE_MIDI2_CHANNEL_VOICE &&
+            (status & 0xF0) == UMP_STATUS_PER_NOTE_BEND) {
+            receiver->note_bends[data1] = bend_semitones(
+                (int64_t)word - INT64_C(0x80000000), INT64_C(0x80000000),
+                INT64_C(0x7FFFFFFF), semitone_distance
+            );
+            return true;
+        }
+        // Velocity 0 is a real velocity in MIDI 2.0.
+        if (type == UMP_TYPE_MIDI2_CHANNEL_VOICE) data2 = 1;
+        else if (type != UMP_TYPE_MIDI1_CHANNEL_VOICE) return false;
+    } else {
+        if (event->size < 3) return false;
+        status = event->data[0];
+        data1 = event->data[1];
+        data2 = event->data[2];
+    }
+
+    switch (status & 0xF0) {
+        case LV2_MIDI_MSG_NOTE_ON:
+            if (data2 > 0) {
+                receiver->key = data1;
+                break;
+            }
+            // Fall through.
+        case LV2_MIDI_MSG_NOTE_OFF:
+            if (receiver->key == data1) receiver->key = -1;
+            break;
+        case LV2_MIDI_MSG_BENDER:
+            receiver->channel_bend = bend_semitones(
+                ((int64_t)data2 << 7 | data1) - 8192, 8192, 8191,
+                semitone_distance
+            );
+            return true;
+    }
+    return false;
+}
+
+// Returns the pitch of the exact curve at `time`, during the notes of
+// `slide`.
+static inline double exact_pitch(
+        const Slide *slide, uint64_t time, SlideCurve curve) {
+    if (time < slide->start) return slide->from;
+    double x = (time - slide->start) / slide->length;
+    if (x >= 1) return slide->to;
+    return slide->from + (slide->to - slide->from) * curve_value(curve, x);
+}
+
+// Returns the time in samples by which `pitch`, played at `time` during
+// `slide`, lags behind the point where the exact curve reaches it.
+static inline double bend_lag(
+        const Slide *slide, uint64_t time, double pitch, SlideCurve curve) {
+    double target = (pitch - slide->from) / (slide->to - slide->from);
+    // Every curve increases, so the point is found by bisection.
+    double low = 0;
+    double high = 1;
+    for (int i = 0; i < 48; i++) {
+        double middle = (low + high) / 2;
+        if (curve_value(curve, middle) < target) low = middle;
+        else high = middle;
+    }
+    return time - (slide->start + low * slide->length);
+}
+
+static void analyze(
+        const Input *input, const MidislideEventBuffer *output,
+        float semitone_distance, SlideCurve curve, Result *result) {
+    Receiver receiver;
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.key = -1;
+
+    double cents_squared = 0;
+    double max_cents = 0;
+    uint64_t n_samples = 0;
+    double lag_squared = 0;
+    double max_lag = 0;
+    uint64_t n_bends = 0;
+
+    size_t next_event = 0;
+    size_t next_slide = 0;
+    const Slide *slide = NULL;
+    for (uint64_t time = 0; time < input->length; time++) {
+        bool bent = false;
+        while (next_event < output->size &&
+               output->events[next_event].time <= time) {
+            bent |= receive(
+                &receiver, &output->events[next_event++], semitone_distance
+            );
+        }
+        while (next_slide < input->n_slides &&
+               input->slides[next_slide].note_on <= time) {
+            slide = &input->slides[next_slide++];
+        }
+        if (receiver.key < 0 || slide == NULL) continue;
+
+        double pitch = (
+            receiver.key + receiver.channel_bend +
+            receiver.note_bends[receiver.key]
+        );
+        double cents = fabs(pitch - exact_pitch(slide, time, curve)) * 100;
+        cents_squared += cents * cents;
+        if (cents > max_cents) max_cents = cents;
+        n_samples++;
+
+        // Only bends sent during a slide are timed.
+        if (!bent || time < slide->start ||
+            time > slide->start + slide->length) {
+            continue;
+        }
+        double lag = fabs(bend_lag(slide, time, pitch, curve));
+        lag_squared += lag * lag;
+        if (lag > max_lag) max_lag = lag;
+        n_bends++;
+    }
+
+    double seconds = (double)input->length / input->sample_rate;
+    double ms_per_sample = 1000.0 / input->sample_rate;
+    result->messages_per_second = output->size / seconds;
+    result->rms_cents = n_samples > 0 ? sqrt(cents_squared / n_samples) : 0;
+    result->max_cents = max_cents;
+    result->rms_timing_ms = 0;
+    if (n_bends > 0) {
+        result->rms_timing_ms = sqrt(lag_squared / n_bends) * ms_per_sample;
+    }
+    result->max_timing_ms = max_lag * ms_per_sample;
+}
+
+int main(int argc, char **argv) {
+    uint32_t sample_rates[MAX_LIST_SIZE];
+    uint32_t block_sizes[MAX_LIST_SIZE];
+    uint32_t bend_rates[MAX_LIST_SIZE];
+    size_t n_sample_rates;
+    size_t n_block_sizes;
+    size_t n_bend_rates;
+    parse_list(DEFAULT_SAMPLE_RATES, sample_rates, &n_sample_rates);
+    parse_list(DEFAULT_BLOCK_SIZES, block_sizes, &n_block_sizes);
+    parse_list(DEFAULT_BEND_RATES, bend_rates, &n_bend_rates);
+    float bend_semitone_distance = 12;
+    float bend_mode = BEND_MODE_FIXED;
+    float min_bend_step = 1;
+    float slide_curve = SLIDE_CURVE_LINEAR;
+    float output_format = OUTPUT_FORMAT_MIDI1;
+    size_t n_slides = DEFAULT_SLIDES;
+    unsigned n_threads = 0;
+
+    bool valid = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:p:s:m:t:c:f:n:j:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                valid &= parse_list(optarg, sample_rates, &n_sample_rates);
+                break;
+            case 'b':
+                valid &= parse_list(optarg, block_sizes, &n_block_sizes);
+                break;
+            case 'p':
+                valid &= parse_list(optarg, bend_rates, &n_bend_rates);
+                break;
+            case 's':
+                bend_semitone_distance = strtof(optarg, NULL);
+                break;
+            case 'm':
+                bend_mode = strtof(optarg, NULL);
+                break;
+            case 't':
+                min_bend_step = strtof(optarg, NULL);
+                break;
+            case 'c':
+                slide_curve = strtof(optarg, NULL);
+                break;
+            case 'f':
+                output_format = strtof(optarg, NULL);
+                break;
+            case 'n':
+                n_slides = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                n_threads = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (
+        !valid || optind != argc || n_slides == 0 ||
+        bend_semitone_distance <= 0 || slide_curve < 0 ||
+        slide_curve >= SLIDE_CURVE_COUNT
+    ) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t n_streams = n_sample_rates * n_block_sizes * n_bend_rates;
+    Input *inputs = calloc(n_sample_rates, sizeof(*inputs));
+    MidislideStream *streams = calloc(n_streams, sizeof(*streams));
+    bool success = inputs != NULL && streams != NULL;
+    for (size_t i = 0; success && i < n_sample_rates; i++) {
+        success = generate_input(
+            &inputs[i], sample_rates[i], n_slides, bend_semitone_distance
+        );
+    }
+    if (!success) fprintf(stderr, "Error: Not enough memory.\n");
+
+    for (size_t i = 0; success && i < n_streams; i++) {
+        const Input *input = &inputs[i / (n_block_sizes * n_bend_rates)];
+        MidislideStream *stream = &streams[i];
+        midislide_stream_init(stream, input->sample_rate);
+        stream->events = input->events.events;
+        stream->n_events = input->events.size;
+        stream->length = input->length;
+        stream->block_size = block_sizes[i / n_bend_rates % n_block_sizes];
+        float *controls = stream->controls;
+        controls[PORT_BEAT_DIVISOR] = BEAT_DIVISOR;
+        controls[PORT_BEND_SEMITONE_DISTANCE] = bend_semitone_distance;
+        controls[PORT_BEND_MODE] = bend_mode;
+        controls[PORT_BEND_RATE] = bend_rates[i % n_bend_rates];
+        controls[PORT_MIN_BEND_STEP] = min_bend_step;
+        controls[PORT_SLIDE_CURVE] = slide_curve;
+        controls[PORT_OUTPUT_FORMAT] = output_format;
+    }
+
+    if (success && !midislide_render_batch(streams, n_streams, n_threads)) {
+        fprintf(stderr, "Error: Could not render the slides.\n");
+        success = false;
+    }
+
+    if (success) {
+        printf(
+            "sample_rate\tblock_size\tbend_rate\tmessages_per_second\t"
+            "rms_cents\tmax_cents\trms_timing_ms\tmax_timing_ms\n"
+        );
+    }
+    for (size_t i = 0; success && i < n_streams; i++) {
+        const Input *input = &inputs[i / (n_block_sizes * n_bend_rates)];
+        Result result;
+        analyze(
+            input, &streams[i].output, bend_semitone_distance,
+            (SlideCurve)slide_curve, &result
+        );
+        printf(
+            "%" PRIu32 "\t%" PRIu32 "\t%" PRIu32 "\t%.1f\t%.3f\t%.3f\t%.3f\t"
+            "%.3f\n", input->sample_rate, streams[i].block_size,
+            bend_rates[i % n_bend_rates], result.messages_per_second,
+            result.rms_cents, result.max_cents, result.rms_timing_ms,
+            result.max_timing_ms
+        );
+    }
+
+    for (size_t i = 0; streams != NULL && i < n_streams; i++) {
+        midislide_event_buffer_free(&streams[i].output);
+    }
+    for (size_t i = 0; inputs != NULL && i < n_sample_rates; i++) {
+        free_input(&inputs[i]);
+    }
+    free(streams);
+    free(inputs);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmarks for the plugin's run() function. Results are printed as
+// tab-separated values.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "host.h"
+#include "midislide.h"
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+#define SAMPLE_RATE 48000
+#define STREAM_LENGTH (1 << 19)
+#define MIN_REPETITIONS 3
+#define MIN_BENCH_NS 100000000
+
+typedef enum {
+    EVENT_MIDI,
+    EVENT_TEMPO,
+} BenchEventType;
+
+typedef struct {
+    uint64_t time;
+    // Insertion order, used to keep sorting stable.
+    size_t index;
+    BenchEventType type;
+    uint8_t message[3];
+    float bpm;
+} BenchEvent;
+
+typedef struct {
+    BenchEvent *events;
+    size_t size;
+    size_t capacity;
+} BenchStream;
+
+typedef struct {
+    const char *name;
+    uint32_t param;
+    void (*generate)(BenchStream *stream, uint32_t param);
+    // Control port overrides (zero for the default).
+    float beat_divisor;
+    float voice_mode;
+} BenchCase;
+
+static const uint32_t block_sizes[] = {16, 64, 256, 1024, 4096, 8192};
+
+static void add_event(
+        BenchStream *stream, uint64_t time, uint8_t status, uint8_t data1,
+        uint8_t data2) {
+    if (stream->size >= stream->capacity) {
+        stream->capacity = stream->capacity * 2 + 1024;
+        stream->events = realloc(
+            stream->events, stream->capacity * sizeof(BenchEvent)
+        );
+        if (stream->events == NULL) {
+            fprintf(stderr, "Error: Not enough memory for events.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stream->events[stream->size] = (BenchEvent){
+        .time = time,
+        .index = stream->size,
+        .type = EVENT_MIDI,
+        .message = {status, data1, data2},
+    };
+    stream->size++;
+}
+
+static void add_tempo(BenchStream *stream, uint64_t time, float bpm) {
+    add_event(stream, time, 0, 0, 0);
+    BenchEvent *event = &stream->events[stream->size - 1];
+    event->type = EVENT_TEMPO;
+    event->bpm = bpm;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const BenchEvent *event_a = a;
+    const BenchEvent *event_b = b;
+    if (event_a->time != event_b->time) {
+        return event_a->time < event_b->time ? -1 : 1;
+    }
+    return event_a->index < event_b->index ? -1 : 1;
+}
+
+// No input events.
+static void generate_idle(BenchStream *stream, uint32_t param) {
+}
+
+// Controller messages every `interval` samples, all forwarded unchanged.
+static void generate_passthrough(BenchStream *stream, uint32_t interval) {
+    for (uint64_t t = 0; t < STREAM_LENGTH; t += interval) {
+        add_event(stream, t, LV2_MIDI_MSG_CONTROLLER, 1, t & 0x7F);
+    }
+}
+
+// `depth` held notes; the top note is released and pressed again every 2048
+// samples, which restarts the slide. The first note and the top two notes
+// are close together so that the slides stay within the bend range.
+static void generate_stack(BenchStream *stream, uint32_t depth) {
+    uint8_t keys[128];
+    keys[0] = 60;
+    uint8_t other_key = 0;
+    for (uint32_t i = 1; i < depth; i++) {
+        if (i + 2 >= depth) {
+            keys[i] = 60 + depth - i;
+            continue;
+        }
+        while (other_key >= 60 && other_key <= 62) other_key++;
+        keys[i] = other_key++;
+    }
+
+    for (uint32_t i = 0; i < depth; i++) {
+        add_event(stream, i, LV2_MIDI_MSG_NOTE_ON, keys[i], 1 + i % 16);
+    }
+
+    uint8_t top = keys[depth - 1];
+    for (uint64_t t = 4096; t < STREAM_LENGTH; t += 2048) {
+        add_event(stream, t, LV2_MIDI_MSG_NOTE_OFF, top, 0);
+        add_event(stream, t + 1, LV2_MIDI_MSG_NOTE_ON, top, 4);
+    }
+}
+
+// Chords of `size` notes starting at the same frame.
+static void generate_chords(BenchStream *stream, uint32_t size) {
+    for (uint64_t t = 0; t < STREAM_LENGTH; t += 4096) {
+        for (uint32_t i = 0; i < size; i++) {
+            add_event(stream, t, LV2_MIDI_MSG_NOTE_ON, 40 + i, 1 + i % 32);
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            add_event(stream, t + 2048, LV2_MIDI_MSG_NOTE_OFF, 40 + i, 0);
+        }
+    }
+}
+
+// `size` held notes, each with a slide note one semitone above it that is
+// pressed every 2048 samples. In MPE mode, every voice slides.
+static void generate_chord_slides(BenchStream *stream, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        add_event(stream, 0, LV2_MIDI_MSG_NOTE_ON, 40 + 2 * i, 64);
+    }
+    for (uint64_t t = 2048; t < STREAM_LENGTH; t += 2048) {
+        for (uint32_t i = 0; i < size; i++) {
+            add_event(stream, t, LV2_MIDI_MSG_NOTE_ON, 41 + 2 * i, 2);
+            add_event(stream, t + 2047, LV2_MIDI_MSG_NOTE_OFF, 41 + 2 * i, 0);
+        }
+    }
+}
+
+// Like generate_chord_slides(), but with each note on its own channel, so
+// that in per-channel mode, every channel slides.
+static void generate_channel_slides(BenchStream *stream, uint32_t size) {
+    for (uint8_t i = 0; i < size; i++) {
+        add_event(stream, 0, LV2_MIDI_MSG_NOTE_ON | i, 40 + 2 * i, 64);
+    }
+    for (uint64_t t = 2048; t < STREAM_LENGTH; t += 2048) {
+        for (uint8_t i = 0; i < size; i++) {
+            uint8_t key = 41 + 2 * i;
+            add_event(stream, t, LV2_MIDI_MSG_NOTE_ON | i, key, 2);
+            add_event(stream, t + 2047, LV2_MIDI_MSG_NOTE_OFF | i, key, 0);
+        }
+    }
+}
+
+// Two notes held for the whole stream, sliding for as long as possible.
+static void generate_long_slide(BenchStream *stream, uint32_t param) {
+    add_event(stream, 0, LV2_MIDI_MSG_NOTE_ON, 60, 64);
+    add_event(stream, 1, LV2_MIDI_MSG_NOTE_ON, 67, 127);
+}
+
+// A new slide every `interval` samples.
+static void generate_reslide(BenchStream *stream, uint32_t interval) {
+    add_event(stream, 0, LV2_MIDI_MSG_NOTE_ON, 60, 64);
+    uint8_t key = 61;
+    for (uint64_t t = interval; t < STREAM_LENGTH; t += interval) {
+        add_event(stream, t, LV2_MIDI_MSG_NOTE_ON, key, 2);
+        add_event(stream, t + interval - 1, LV2_MIDI_MSG_NOTE_OFF, key, 0);
+        key = key == 72 ? 61 : key + 1;
+    }
+}
+
+// A long slide with a tempo change every `interval` samples.
+static void generate_tempo(BenchStream *stream, uint32_t interval) {
+    generate_long_slide(stream, 0);
+    for (uint64_t t = 0; t < STREAM_LENGTH; t += interval) {
+        add_tempo(stream, t, 100 + (t / interval) % 60);
+    }
+}
+
+static const BenchCase cases[] = {
+    {"idle", 0, generate_idle, 0, VOICE_MODE_MONO},
+    {"passthrough", 256, generate_passthrough, 0, VOICE_MODE_MONO},
+    {"passthrough", 32, generate_passthrough, 0, VOICE_MODE_MONO},
+    {"passthrough", 4, generate_passthrough, 0, VOICE_MODE_MONO},
+    {"stack", 1, generate_stack, 0, VOICE_MODE_MONO},
+    {"stack", 16, generate_stack, 0, VOICE_MODE_MONO},
+    {"stack", 128, generate_stack, 0, VOICE_MODE_MONO},
+    {"chord", 2, generate_chords, 0, VOICE_MODE_MONO},
+    {"chord", 8, generate_chords, 0, VOICE_MODE_MONO},
+    {"chord", 32, generate_chords, 0, VOICE_MODE_MONO},
+    {"chord_slide", 4, generate_chord_slides, 0, VOICE_MODE_MONO},
+    {"mpe_slide", 4, generate_chord_slides, 0, VOICE_MODE_MPE},
+    {"mpe_slide", 15, generate_chord_slides, 0, VOICE_MODE_MPE},
+    {"channel_slide", 16, generate_channel_slides, 0, VOICE_MODE_CHANNEL},
+    {"long_slide", 0, generate_long_slide, 0.125, VOICE_MODE_MONO},
+    {"reslide", 1024, generate_reslide, 0, VOICE_MODE_MONO},
+    {"reslide", 64, generate_reslide, 0, VOICE_MODE_MONO},
+    {"tempo", 1024, generate_tempo, 0.125, VOICE_MODE_MONO},
+    {"tempo", 16, generate_tempo, 0.125, VOICE_MODE_MONO},
+};
+
+static inline uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Splits the stream into blocks and stores a copy of each block's input
+// sequence, so that building the input is not included in the timings.
+static LV2_Atom_Sequence **build_blocks(
+        Host *host, const BenchStream *stream, uint32_t block_size,
+        uint32_t n_blocks) {
+    LV2_Atom_Sequence **blocks = calloc(n_blocks, sizeof(*blocks));
+    if (blocks == NULL) return NULL;
+
+    size_t index = 0;
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        uint64_t block_start = (uint64_t)i * block_size;
+        host_begin_block(host);
+        for (; index < stream->size; index++) {
+            const BenchEvent *event = &stream->events[index];
+            if (event->time >= block_start + block_size) break;
+            uint32_t frames = event->time - block_start;
+            if (event->type == EVENT_TEMPO) {
+                host_add_tempo(host, frames, event->bpm);
+            } else {
+                host_add_midi(host, frames, event->message, 3);
+            }
+        }
+
+        uint32_t size = sizeof(LV2_Atom) + host->input->atom.size;
+        blocks[i] = malloc(size);
+        if (blocks[i] == NULL) return NULL;
+        memcpy(blocks[i], host->input, size);
+    }
+    return blocks;
+}
+
+static bool bench_case(const BenchCase *bench, uint32_t block_size) {
+    BenchStream stream = {0};
+    bench->generate(&stream, bench->param);
+    qsort(stream.events, stream.size, sizeof(BenchEvent), compare_events);
+
+    Host host;
+    if (!host_init(&host, SAMPLE_RATE)) {
+        fprintf(stderr, "Error: Could not instantiate plugin.\n");
+        return false;
+    }
+    if (bench->beat_divisor > 0) {
+        host_set_control(&host, PORT_BEAT_DIVISOR, bench->beat_divisor);
+    }
+    host_set_control(&host, PORT_VOICE_MODE, bench->voice_mode);
+
+    uint32_t n_blocks = STREAM_LENGTH / block_size;
+    LV2_Atom_Sequence **blocks = build_blocks(
+        &host, &stream, block_size, n_blocks
+    );
+    if (blocks == NULL) {
+        fprintf(stderr, "Error: Not enough memory for input blocks.\n");
+        return false;
+    }
+
+    // Count the output events once, outside the timed runs. This also makes
+    // the host's output buffer large enough for every block.
+    const LV2_Descriptor *descriptor = host.descriptor;
+    uint64_t events_out = 0;
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        memcpy(host.input, blocks[i], sizeof(LV2_Atom) + blocks[i]->atom.size);
+        host_run(&host, block_size);
+        LV2_ATOM_SEQUENCE_FOREACH(host.output, event) {
+            events_out++;
+        }
+    }
+
+    uint64_t best = UINT64_MAX;
+    uint64_t total = 0;
+    for (int rep = 0; rep < MIN_REPETITIONS || total < MIN_BENCH_NS; rep++) {
+        descriptor->activate(host.instance);
+        uint32_t output_size = host.output_capacity - sizeof(LV2_Atom);
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < n_blocks; i++) {
+            descriptor->connect_port(host.instance, PORT_INPUT, blocks[i]);
+            host.output->atom.size = output_size;
+            descriptor->run(host.instance, block_size);
+        }
+        uint64_t elapsed = now_ns() - start;
+        total += elapsed;
+        if (elapsed < best) best = elapsed;
+    }
+
+    printf(
+        "%s\t%" PRIu32 "\t%" PRIu32 "\t%zu\t%" PRIu64 "\t%.1f\t",
+        bench->name, bench->param, block_size, stream.size, events_out,
+        (double)best / n_blocks
+    );
+    if (stream.size > 0) {
+        printf("%.2f\t", (double)best / stream.size);
+    } else {
+        printf("NA\t");
+    }
+    printf("%.0f\n", events_out * 1e9 / best);
+    fflush(stdout);
+
+    for (uint32_t i = 0; i < n_blocks; i++) free(blocks[i]);
+    free(blocks);
+    free(stream.events);
+    // Restore the host's own input buffer before it is freed.
+    descriptor->connect_port(host.instance, PORT_INPUT, host.input);
+    host_destroy(&host);
+    return true;
+}
+
+int main(void) {
+    printf(
+        "case\tparam\tblock_size\tevents_in\tevents_out\tns_per_block\t"
+        "ns_per_event\tevents_out_per_sec\n"
+    );
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        for (size_t j = 0; j < sizeof(block_sizes) / sizeof(*block_sizes);
+             j++) {
+            if (!bench_case(&cases[i], block_sizes[j])) return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks that the LV2 plugin and the engine (see engine.h) produce the same
+// output for the same input, and that the output doesn't depend on the block
+// size. Run by `make check`; exits with a failure status if a check fails.
+
+#include "engine.h"
+#include "host.h"
+#include "midislide.h"
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLE_RATE 48000
+
+// Length of each input stream, in samples.
+#define STREAM_LENGTH (SAMPLE_RATE * 4)
+
+// Block size the other block sizes are compared against.
+#define REFERENCE_BLOCK_SIZE 1024
+
+// Most notes held at once in the generated input.
+#define MAX_HELD_NOTES 4
+
+typedef struct {
+    const char *name;
+    float voice_mode;
+    float bend_mode;
+    float slide_curve;
+    float lookahead;
+    float output_format;
+    float coalesce;
+} CheckCase;
+
+static const CheckCase cases[] = {
+    {.name = "mono"},
+    {.name = "mono, bends on change", .bend_mode = 1},
+    {.name = "mono, S-curve", .slide_curve = 3},
+    {.name = "mono, lookahead", .lookahead = 150},
+    {.name = "MPE", .voice_mode = 1},
+    {.name = "MPE, lookahead", .voice_mode = 1, .lookahead = 80},
+    {.name = "per channel", .voice_mode = 2},
+    {.name = "MIDI 2.0", .voice_mode = 1, .output_format = 1},
+    {.name = "coalescing", .coalesce = 1},
+};
+
+// Block sizes compared against REFERENCE_BLOCK_SIZE. The plugin is also
+// compared against the engine at each of them.
+static const uint32_t block_sizes[] = {1, 37, 64, 1000, 4096};
+
+// Cases with coalescing are only compared at the reference block size, as
+// values are coalesced within each block.
+static bool depends_on_block_size(const CheckCase *check) {
+    return check->coalesce != 0;
+}
+
+static uint64_t random_state = 0x9e3779b97f4a7c15;
+
+static uint32_t random_below(uint32_t limit) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (random_state >> 32) % limit;
+}
+
+static bool add_midi(
+        MidislideEventBuffer *input, uint64_t time, uint8_t status,
+        uint8_t data1, uint8_t data2) {
+    const uint8_t message[3] = {status, data1, data2};
+    return midislide_event_buffer_add_midi(
+        input, time, message, sizeof(message)
+    );
+}
+
+// Generates notes on four channels with controllers, tempo changes and
+// system exclusive messages in between. Notes are only turned off while
+// held, a key is held on at most one channel, and no note starts and ends at
+// the same time, so the input causes no diagnostics in any voice mode.
+static bool generate_input(MidislideEventBuffer *input) {
+    uint8_t held_keys[MAX_HELD_NOTES];
+    uint8_t held_channels[MAX_HELD_NOTES];
+    uint64_t held_since[MAX_HELD_NOTES];
+    uint32_t n_held = 0;
+    // Time each key was last turned off.
+    uint64_t released[128];
+    for (uint32_t key = 0; key < 128; key++) released[key] = UINT64_MAX;
+
+    bool success = true;
+    for (uint64_t time = 0; success && time < STREAM_LENGTH; ) {
+        uint32_t choice = random_below(100);
+        if (choice < 40 && n_held < MAX_HELD_NOTES) {
+            uint8_t key = 40 + random_below(40);
+            bool held = false;
+            for (uint32_t i = 0; i < n_held; i++) {
+                held = held || held_keys[i] == key;
+            }
+            if (held || released[key] == time) continue;
+            uint8_t channel = random_below(4);
+            held_keys[n_held] = key;
+            held_channels[n_held] = channel;
+            held_since[n_held++] = time;
+            success = add_midi(
+                input, time, LV2_MIDI_MSG_NOTE_ON | channel, key,
+                1 + random_below(127)
+            );
+        } else if (choice < 75 && n_held > 0) {
+            // Half of the "note off" messages are "note on" messages with a
+            // velocity of 0.
+            uint32_t i = random_below(n_held);
+            if (held_since[i] == time) continue;
+            uint8_t key = held_keys[i];
+            uint8_t channel = held_channels[i];
+            released[key] = time;
+            held_keys[i] = held_keys[--n_held];
+            held_channels[i] = held_channels[n_held];
+            held_since[i] = held_since[n_held];
+            uint8_t status = (
+                random_below(2) ? LV2_MIDI_MSG_NOTE_OFF : LV2_MIDI_MSG_NOTE_ON
+            );
+            success = add_midi(input, time, status | channel, key, 0);
+        } else if (choice < 90) {
+            success = add_midi(
+                input, time, LV2_MIDI_MSG_CONTROLLER | random_below(4),
+                LV2_MIDI_CTL_MSB_MODWHEEL, random_below(128)
+            );
+        } else if (choice < 95) {
+            success = midislide_event_buffer_add_tempo(
+                input, time, 60 + random_below(121)
+            );
+        } else {
+            static const uint8_t sysex[] = {0xF0, 0x7E, 0x01, 0x02, 0xF7};
+            success = midislide_event_buffer_add_midi(
+                input, time, sysex, sizeof(sysex)
+            );
+        }
+
+        // Some events are at the same time as the one before.
+        if (random_below(4) > 0) time += random_below(2400);
+    }
+
+    for (uint32_t i = 0; success && i < n_held; i++) {
+        success = add_midi(
+            input, STREAM_LENGTH, LV2_MIDI_MSG_NOTE_OFF | held_channels[i],
+            held_keys[i], 0
+        );
+    }
+    return success;
+}
+
+// The end of the rendered output. Blocks are run until every event delayed
+// by lookahead has been sent.
+static uint64_t output_end(const CheckCase *check) {
+    uint64_t latency = check->lookahead * SAMPLE_RATE / 1000;
+    return STREAM_LENGTH + latency + 1;
+}
+
+static bool render_engine(
+        const CheckCase *check, const MidislideEventBuffer *input,
+        uint32_t block_size, MidislideEventBuffer *output) {
+    MidislideEngine *engine = midislide_engine_new(SAMPLE_RATE);
+    if (engine == NULL) return false;
+    midislide_engine_set_log(engine, NULL, NULL);
+    midislide_engine_set_control(engine, PORT_VOICE_MODE, check->voice_mode);
+    midislide_engine_set_control(engine, PORT_BEND_MODE, check->bend_mode);
+    midislide_engine_set_control(
+        engine, PORT_SLIDE_CURVE, check->slide_curve
+    );
+    midislide_engine_set_control(engine, PORT_LOOKAHEAD, check->lookahead);
+    midislide_engine_set_control(
+        engine, PORT_OUTPUT_FORMAT, check->output_format
+    );
+    midislide_engine_set_control(
+        engine, PORT_COALESCE_CONTROLLERS, check->coalesce
+    );
+
+    bool success = true;
+    size_t next = 0;
+    uint64_t end = output_end(check);
+    for (uint64_t start = 0; success && start < end; start += block_size) {
+        size_t first = next;
+        while (
+            next < input->size && input->events[next].time < start + block_size
+        ) {
+            next++;
+        }
+
+        const MidislideEvent *events;
+        size_t n_events;
+        success = midislide_engine_run(
+            engine, input->events + first, next - first, block_size, &events,
+            &n_events
+        );
+        for (size_t i = 0; success && i < n_events; i++) {
+            success = midislide_event_buffer_add_midi(
+                output, events[i].time, events[i].data, events[i].size
+            );
+        }
+    }
+    midislide_engine_free(engine);
+    return success;
+}
+
+static bool collect_plugin_output(
+        Host *host, uint64_t start, MidislideEventBuffer *output) {
+    LV2_ATOM_SEQUENCE_FOREACH(host->output, event) {
+        if (event->body.type != host->uris.midi_Event &&
+            event->body.type != host->uris.ump_Event) {
+            continue;
+        }
+        if (!midislide_event_buffer_add_midi(
+            output, start + event->time.frames,
+            (const uint8_t *)(event + 1), event->body.size
+        )) return false;
+    }
+    return true;
+}
+
+static bool render_plugin(
+        const CheckCase *check, const MidislideEventBuffer *input,
+        uint32_t block_size, MidislideEventBuffer *output) {
+    Host host;
+    if (!host_init(&host, SAMPLE_RATE)) {
+        host_destroy(&host);
+        return false;
+    }
+    host_set_control(&host, PORT_VOICE_MODE, check->voice_mode);
+    host_set_control(&host, PORT_BEND_MODE, check->bend_mode);
+    host_set_control(&host, PORT_SLIDE_CURVE, check->slide_curve);
+    host_set_control(&host, PORT_LOOKAHEAD, check->lookahead);
+    host_set_control(&host, PORT_OUTPUT_FORMAT, check->output_format);
+    host_set_control(&host, PORT_COALESCE_CONTROLLERS, check->coalesce);
+    // Activation allocates the buffers the controls need, as the engine
+    // does when a control is set.
+    host_reactivate(&host);
+
+    bool success = true;
+    size_t next = 0;
+    uint64_t end = output_end(check);
+    for (uint64_t start = 0; success && start < end; start += block_size) {
+        host_begin_block(&host);
+        for (; success && next < input->size; next++) {
+            const MidislideEvent *event = &input->events[next];
+            if (event->time >= start + block_size) break;
+            uint32_t frames = event->time - start;
+            if (event->size == 0) {
+                success = host_add_tempo(&host, frames, event->bpm);
+            } else {
+                success = host_add_midi(
+                    &host, frames, event->data, event->size
+                );
+            }
+        }
+        success = success && host_run(&host, block_size);
+        success = success && collect_plugin_output(&host, start, output);
+        host_run_worker(&host);
+        host_deliver_responses(&host);
+    }
+    host_destroy(&host);
+    return success;
+}
+
+// Returns the index of the first event that differs between two outputs, or
+// SIZE_MAX if they are identical.
+static size_t find_difference(
+        const MidislideEventBuffer *a, const MidislideEventBuffer *b) {
+    size_t size = a->size < b->size ? a->size : b->size;
+    for (size_t i = 0; i < size; i++) {
+        const MidislideEvent *event_a = &a->events[i];
+        const MidislideEvent *event_b = &b->events[i];
+        if (event_a->time != event_b->time ||
+            event_a->size != event_b->size ||
+            memcmp(event_a->data, event_b->data, event_a->size) != 0) {
+            return i;
+        }
+    }
+    return a->size == b->size ? SIZE_MAX : size;
+}
+
+// Compares two outputs, and prints the result.
+static bool compare(
+        const CheckCase *check, const char *description,
+        const MidislideEventBuffer *expected,
+        const MidislideEventBuffer *actual) {
+    size_t difference = find_difference(expected, actual);
+    if (difference == SIZE_MAX) {
+        printf("ok    %s: %s\n", check->name, description);
+        return true;
+    }
+    printf(
+        "FAIL  %s: %s (event %zu of %zu differs)\n", check->name, description,
+        difference, expected->size
+    );
+    return false;
+}
+
+static bool run_case(
+        const CheckCase *check, const MidislideEventBuffer *input) {
+    MidislideEventBuffer reference;
+    midislide_event_buffer_init(&reference);
+    if (!render_engine(check, input, REFERENCE_BLOCK_SIZE, &reference)) {
+        fprintf(stderr, "Error: Could not render %s.\n", check->name);
+        midislide_event_buffer_free(&reference);
+        return false;
+    }
+
+    bool passed = true;
+    char description[64];
+    for (size_t i = 0; i <= sizeof(block_sizes) / sizeof(*block_sizes); i++) {
+        uint32_t block_size = REFERENCE_BLOCK_SIZE;
+        if (i > 0) block_size = block_sizes[i - 1];
+        bool same_block_size = block_size == REFERENCE_BLOCK_SIZE;
+        if (!same_block_size && depends_on_block_size(check)) continue;
+
+        MidislideEventBuffer output;
+        midislide_event_buffer_init(&output);
+        if (!same_block_size) {
+            snprintf(
+                description, sizeof(description),
+                "engine at block size %" PRIu32, block_size
+            );
+            if (!render_engine(check, input, block_size, &output)) {
+                fprintf(stderr, "Error: Could not render %s.\n", check->name);
+                midislide_event_buffer_free(&output);
+                passed = false;
+                break;
+            }
+            passed = compare(check, description, &reference, &output) &&
+                passed;
+            midislide_event_buffer_free(&output);
+        }
+
+        snprintf(
+            description, sizeof(description),
+            "plugin at block size %" PRIu32, block_size
+        );
+        if (!render_plugin(check, input, block_size, &output)) {
+            fprintf(stderr, "Error: Could not run the plugin.\n");
+            midislide_event_buffer_free(&output);
+            passed = false;
+            break;
+        }
+        passed = compare(check, description, &reference, &output) && passed;
+        midislide_event_buffer_free(&output);
+    }
+    midislide_event_buffer_free(&reference);
+    return passed;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    MidislideEventBuffer input;
+    midislide_event_buffer_init(&input);
+    if (!generate_input(&input)) {
+        fprintf(stderr, "Error: Not enough memory for input events.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t n_failed = 0;
+    size_t n_cases = sizeof(cases) / sizeof(*cases);
+    for (size_t i = 0; i < n_cases; i++) {
+        if (!run_case(&cases[i], &input)) n_failed++;
+    }
+    midislide_event_buffer_free(&input);
+    if (n_failed > 0) {
+        printf("%zu of %zu cases failed.\n", n_failed, n_cases);
+        return EXIT_FAILURE;
+    }
+    printf("All %zu cases passed.\n", n_cases);
+    return EXIT_SUCCESS;
+}
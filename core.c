@@ -0,0 +1,2757 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+// Increments one of the core's Counters.
+#ifdef MIDISLIDE_NO_COUNTERS
+#define COUNT(core, counter) ((void)0)
+#else
+#define COUNT(core, counter) ((void)(core)->counters.counter++)
+#endif
+
+/* Forward declarations */
+
+static inline void update_message_interval(SlideCore *core);
+
+static inline void update_slide_settings(SlideCore *core);
+
+static inline void update_voice_mode(
+    SlideCore *core, uint32_t output_capacity);
+
+static inline void update_output_format(
+    SlideCore *core, uint32_t output_capacity);
+
+static inline void send_mpe_config(
+    SlideCore *core, uint32_t output_capacity);
+
+static inline void invalidate_slides(SlideCore *core);
+
+static inline void begin_event_group(SlideCore *core);
+
+static inline void clear_lookahead_buffer(LookaheadBuffer *buffer);
+
+static inline void handle_event(
+    SlideCore *core, const LV2_Atom_Event *event, uint32_t note_length,
+    uint32_t output_capacity);
+
+static inline bool is_passthrough_event(
+    SlideCore *core, const LV2_Atom_Event *event);
+
+static inline const LV2_Atom_Event *forward_passthrough_run(
+    SlideCore *core, const LV2_Atom_Event *first, uint32_t output_capacity);
+
+static inline void begin_coalescing(
+    SlideCore *core, bool delayed, uint32_t lookahead, uint32_t n_samples);
+
+static inline bool is_superseded(
+    SlideCore *core, const LV2_Atom_Event *event);
+
+static inline void end_event_group(
+    SlideCore *core, uint32_t frames, uint32_t output_capacity);
+
+static inline void end_mono_group(
+    SlideCore *core, uint32_t frames, uint32_t output_capacity);
+
+static inline void handle_atom_object(
+    SlideCore *core, const LV2_Atom_Object *object, uint32_t frames);
+
+static inline void update_samples_per_beat(SlideCore *core);
+
+static inline MidiAction get_midi_action(
+        const uint8_t *message, uint32_t size);
+
+static inline bool handle_midi_message(
+    SlideCore *core, const uint8_t *message, MidiAction action,
+    uint32_t note_length, uint32_t output_capacity);
+
+static inline void send_scheduled_bends(
+    SlideCore *core, uint32_t n_samples, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline void send_scheduled_voice_bends(
+    SlideCore *core, uint32_t n_samples, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline void end_voice_group(
+    SlideCore *core, uint32_t frames, uint32_t output_capacity);
+
+static inline uint8_t note_stack_size(const NoteStack *stack);
+
+static inline uint8_t note_stack_second(const NoteStack *stack);
+
+static inline void note_stack_push(
+    NoteStack *stack, uint8_t key, uint8_t velocity);
+
+static inline void note_stack_insert(
+    NoteStack *stack, uint8_t key, uint8_t next_key);
+
+static inline void note_stack_remove(NoteStack *stack, uint8_t key);
+
+static inline void note_stack_clear(NoteStack *stack);
+
+static inline void move_primary_to_stack_top(
+    NoteStack *stack, uint8_t n_added);
+
+static inline void set_bend(
+    SlideCore *core, int value, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline void setup_slide(SlideCore *core);
+
+static inline void advance_slide(SlideCore *core, uint32_t n_samples);
+
+static inline uint64_t slide_phase_increment(
+    SlideCore *core, const NoteStack *stack, uint32_t *max_advance);
+
+static inline bool set_bend_from_slide(
+    SlideCore *core, uint32_t frames, uint32_t output_capacity);
+
+static inline void set_bend_on_change(
+    SlideCore *core, int value, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline void set_bend_from_key(
+    SlideCore *core, uint8_t key, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline int relative_key_to_bend(
+    SlideCore *core, double relative_key);
+
+static inline void stop_note(
+    SlideCore *core, uint32_t frames, uint32_t output_capacity);
+
+static inline void play_note(
+    SlideCore *core, uint8_t key, uint8_t velocity, uint32_t frames,
+    uint32_t output_capacity);
+
+static inline void send_midi_message(
+    SlideCore *core, MidiEvent *event, MessagePriority priority,
+    uint32_t output_capacity);
+
+static inline void send_pending_messages(
+    SlideCore *core, uint32_t output_capacity);
+
+static inline void forward_event(
+    SlideCore *core, const LV2_Atom_Event *event,
+    uint32_t output_capacity);
+
+static inline void handle_note_on(
+    SlideCore *core, uint8_t channel, uint8_t key, uint8_t velocity,
+    uint32_t length);
+
+static inline void handle_note_off(
+    SlideCore *core, uint8_t channel, uint8_t key);
+
+static inline void handle_all_notes_off(SlideCore *core, uint8_t channel);
+
+static inline void add_to_stack(SlideCore *core, const NoteOn *note);
+
+static inline void remove_from_stack(SlideCore *core, uint8_t key);
+
+static inline void clear_stack(SlideCore *core);
+
+static inline void remove_from_voice(
+    SlideCore *core, uint8_t channel, uint8_t key);
+
+static inline void clear_voices(SlideCore *core, uint8_t channel);
+
+static inline void reset_voices(SlideCore *core);
+
+static inline void report_diagnostic(
+    SlideCore *core, DiagKind kind, uint8_t data);
+
+static inline void send_output_stats(SlideCore *core);
+
+static inline uint64_t read_cycle_counter(void);
+
+static inline void update_stack_high_water(
+    SlideCore *core, const NoteStack *stack);
+
+static inline void update_run_cycles(SlideCore *core, uint64_t start);
+
+static inline void send_counters(SlideCore *core);
+
+static inline void begin_pitch_cv(SlideCore *core, uint32_t n_samples);
+
+static inline void capture_pitch_cv(SlideCore *core);
+
+static inline void render_pitch_cv(SlideCore *core, uint32_t frames);
+
+/* End forward declarations */
+
+// Slide curve tables, shared by all cores in the process. They are built
+// once, by whichever core is initialized first, and then only read.
+static pthread_once_t curve_tables_once = PTHREAD_ONCE_INIT;
+static uint32_t curve_tables[SLIDE_CURVE_COUNT][CURVE_TABLE_SIZE + 1];
+
+static void init_curve_tables(void) {
+    for (int curve = 0; curve < SLIDE_CURVE_COUNT; curve++) {
+        for (int i = 0; i <= CURVE_TABLE_SIZE; i++) {
+            double x = (double)i / CURVE_TABLE_SIZE;
+            double value = curve_value((SlideCurve)curve, x);
+            curve_tables[curve][i] = lrint(value * (1 << CURVE_VALUE_BITS));
+        }
+    }
+}
+
+void slide_core_default_controls(float controls[PORT_COUNT]) {
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        controls[port] = 0;
+    }
+    controls[PORT_BEAT_DIVISOR] = 4;
+    controls[PORT_BEND_SEMITONE_DISTANCE] = 12;
+    controls[PORT_FORCED_VELOCITY] = 0;
+    controls[PORT_BEND_MODE] = BEND_MODE_FIXED;
+    controls[PORT_BEND_RATE] = 500;
+    controls[PORT_MIN_BEND_STEP] = 1;
+    controls[PORT_SLIDE_CURVE] = SLIDE_CURVE_LINEAR;
+    controls[PORT_VOICE_MODE] = VOICE_MODE_MONO;
+    controls[PORT_MPE_CHANNELS] = MAX_MPE_CHANNELS;
+    controls[PORT_LOOKAHEAD] = 0;
+    controls[PORT_OUTPUT_FORMAT] = OUTPUT_FORMAT_MIDI1;
+}
+
+bool slide_core_init(
+        SlideCore *core, double sample_rate, const SlideURIs *uris) {
+    pthread_once(&curve_tables_once, init_curve_tables);
+    core->uris = *uris;
+    core->sample_rate = sample_rate;
+    core->curve_table = curve_tables[SLIDE_CURVE_LINEAR];
+    core->max_lookahead = (uint64_t)sample_rate * MAX_LOOKAHEAD_MS / 1000;
+
+    // Not cleared, as only the entries up to note_ons_size are read.
+    core->group.note_ons = malloc(MAX_VOICES * 128 * sizeof(NoteOn));
+    if (core->group.note_ons == NULL) return false;
+
+    // Until the host sends a position, 120 BPM is assumed. The tempo is kept
+    // when the core is reactivated.
+    core->transport.beats_per_minute = 120;
+    core->transport.speed = 1;
+    update_samples_per_beat(core);
+    return true;
+}
+
+void slide_core_destroy(SlideCore *core) {
+    free(core->group.note_ons);
+    core->group.note_ons = NULL;
+    // The note_ons array is at the start of the lookahead buffer's memory.
+    free(core->lookahead_buffer.note_ons);
+    core->lookahead_buffer.note_ons = NULL;
+    core->lookahead_buffer.data = NULL;
+    free(core->coalescing.slots);
+    core->coalescing.slots = NULL;
+}
+
+// Size of the ring buffer for the maximum lookahead.
+static inline uint32_t lookahead_capacity(uint32_t sample_rate) {
+    uint32_t max_lookahead = (uint64_t)sample_rate * MAX_LOOKAHEAD_MS / 1000;
+    return lv2_atom_pad_size(max_lookahead * LOOKAHEAD_BYTES_PER_SAMPLE);
+}
+
+uint32_t slide_core_missing_buffers(const SlideCore *core) {
+    // The controls may not be connected yet when the core is activated.
+    uint32_t missing = 0;
+    const float *lookahead = core->lookahead;
+    if (
+        lookahead != NULL && *lookahead > 0 &&
+        core->lookahead_buffer.data == NULL
+    ) {
+        missing |= SLIDE_BUFFER_LOOKAHEAD;
+    }
+    const float *coalesce = core->coalesce_controllers;
+    if (
+        coalesce != NULL && *coalesce >= 0.5f &&
+        core->coalescing.slots == NULL
+    ) {
+        missing |= SLIDE_BUFFER_COALESCE;
+    }
+    return missing;
+}
+
+void slide_core_allocate_buffers(SlideCore *core, uint32_t kinds) {
+    uint32_t missing = slide_core_missing_buffers(core) & kinds;
+    for (uint32_t kind = 1; kind <= missing; kind <<= 1) {
+        if (!(missing & kind)) continue;
+        void *buffer = slide_core_new_buffer(kind, core->sample_rate);
+        if (buffer != NULL) slide_core_set_buffer(core, kind, buffer);
+    }
+}
+
+void *slide_core_new_buffer(SlideBufferKind kind, uint32_t sample_rate) {
+    switch (kind) {
+        case SLIDE_BUFFER_LOOKAHEAD: ;
+            // The note_ons array, followed by the ring buffer.
+            uint32_t (*note_ons)[128] = malloc(
+                16 * sizeof(*note_ons) + lookahead_capacity(sample_rate)
+            );
+            if (note_ons == NULL) return NULL;
+            for (int channel = 0; channel < 16; channel++) {
+                for (int key = 0; key < 128; key++) {
+                    note_ons[channel][key] = NO_EVENT;
+                }
+            }
+            return note_ons;
+        case SLIDE_BUFFER_COALESCE:
+            return calloc(16, sizeof(CoalesceSlot[COALESCE_SLOTS]));
+        default:
+            return NULL;
+    }
+}
+
+void slide_core_set_buffer(
+        SlideCore *core, SlideBufferKind kind, void *buffer) {
+    switch (kind) {
+        case SLIDE_BUFFER_LOOKAHEAD: ;
+            // The buffer has been empty since it was missing.
+            LookaheadBuffer *lookahead = &core->lookahead_buffer;
+            lookahead->note_ons = buffer;
+            lookahead->data = (uint8_t *)(lookahead->note_ons + 16);
+            lookahead->capacity = lookahead_capacity(core->sample_rate);
+            break;
+        case SLIDE_BUFFER_COALESCE:
+            core->coalescing.slots = buffer;
+            // The slots are clear, so the count can start over.
+            core->coalescing.block = 0;
+            break;
+        default:
+            break;
+    }
+}
+
+void slide_core_connect_port(SlideCore *core, uint32_t port, void *data) {
+    switch (port) {
+        case PORT_BEAT_DIVISOR:
+            core->beat_divisor = data;
+            break;
+        case PORT_BEND_SEMITONE_DISTANCE:
+            core->bend_semitone_distance = data;
+            break;
+        case PORT_FORCED_VELOCITY:
+            core->forced_velocity = data;
+            break;
+        case PORT_BEND_MODE:
+            core->bend_mode = data;
+            break;
+        case PORT_BEND_RATE:
+            core->bend_rate = data;
+            break;
+        case PORT_MIN_BEND_STEP:
+            core->min_bend_step = data;
+            break;
+        case PORT_BENDS_MERGED:
+            core->bends_merged = data;
+            break;
+        case PORT_BENDS_DROPPED:
+            core->bends_dropped = data;
+            break;
+        case PORT_PASSTHROUGH_DROPPED:
+            core->passthrough_dropped = data;
+            break;
+        case PORT_NOTES_DELAYED:
+            core->notes_delayed = data;
+            break;
+        case PORT_NOTES_DROPPED:
+            core->notes_dropped = data;
+            break;
+        case PORT_SLIDE_CURVE:
+            core->slide_curve = data;
+            break;
+        case PORT_VOICE_MODE:
+            core->voice_mode = data;
+            break;
+        case PORT_MPE_CHANNELS:
+            core->mpe_channels = data;
+            break;
+        case PORT_LOOKAHEAD:
+            core->lookahead = data;
+            break;
+        case PORT_OUTPUT_FORMAT:
+            core->output_format = data;
+            break;
+        case PORT_LATENCY:
+            core->latency = data;
+            break;
+        case PORT_EVENTS_IN:
+            core->events_in = data;
+            break;
+        case PORT_EVENTS_OUT:
+            core->events_out = data;
+            break;
+        case PORT_BENDS_OUT:
+            core->bends_out = data;
+            break;
+        case PORT_EVENTS_DROPPED:
+            core->events_dropped = data;
+            break;
+        case PORT_STACK_HIGH_WATER:
+            core->stack_high_water = data;
+            break;
+        case PORT_SLIDES_OUT_OF_RANGE:
+            core->slides_out_of_range = data;
+            break;
+        case PORT_RUN_CYCLES_MAX:
+            core->run_cycles_max = data;
+            break;
+        case PORT_RUN_CYCLES_AVG:
+            core->run_cycles_avg = data;
+            break;
+        case PORT_PITCH_CV:
+            core->pitch_cv = data;
+            break;
+        case PORT_COALESCE_CONTROLLERS:
+            core->coalesce_controllers = data;
+            break;
+    }
+}
+
+void slide_core_activate(SlideCore *core) {
+    note_stack_clear(&core->note_stack);
+    core->sample_time = 0;
+    core->transport.has_beat = false;
+    core->transport.has_frame = false;
+    clear_lookahead_buffer(&core->lookahead_buffer);
+    core->slide_phase = 0;
+    core->samples_since_sent = 0;
+    core->message_rate = 0;
+    core->format = OUTPUT_FORMAT_MIDI1;
+    core->last_bend = 0;
+    core->pending_bend_channels = 0;
+    core->pending_notes_size = 0;
+    core->is_sliding = false;
+    memset(&core->output_stats, 0, sizeof(core->output_stats));
+    core->slide.valid = false;
+    core->mode = VOICE_MODE_MONO;
+    core->n_voices = 0;
+    core->mpe_config_pending = false;
+    memset(&core->counters, 0, sizeof(core->counters));
+    reset_voices(core);
+    // Not a valid curve, so the table is chosen in the first call to run().
+    core->slide_curve_value = -1;
+}
+
+static inline bool isAtomObject(uint32_t type, SlideURIs *uris) {
+    return (
+        type == uris->atom_Object ||
+        type == uris->atom_Blank ||
+        type == uris->atom_Resource
+    );
+}
+
+static inline const uint8_t *getMidiMessage(
+        const LV2_Atom_Event *event, SlideURIs *uris) {
+    if (event->body.type != uris->midi_Event) return NULL;
+    return (const uint8_t *)(event + 1);
+}
+
+static inline const LV2_Atom_Object *getAtomObject(
+        const LV2_Atom_Event *event, SlideURIs *uris) {
+    if (!isAtomObject(event->body.type, uris)) return NULL;
+    return (const LV2_Atom_Object *)&event->body;
+}
+
+static inline void clear_lookahead_buffer(LookaheadBuffer *buffer) {
+    buffer->read = 0;
+    buffer->write = 0;
+    buffer->count = 0;
+    if (buffer->note_ons == NULL) return;
+    for (int channel = 0; channel < 16; channel++) {
+        for (int key = 0; key < 128; key++) {
+            buffer->note_ons[channel][key] = NO_EVENT;
+        }
+    }
+}
+
+// Reads the "Lookahead" control and reports it as latency. Returns the
+// lookahead in samples, which is 0 until the core has a lookahead buffer.
+static inline uint32_t update_lookahead(SlideCore *core) {
+    double samples = *core->lookahead * core->sample_rate / 1000.0;
+    uint32_t lookahead = samples > 0 ? lrint(samples) : 0;
+    if (lookahead > core->max_lookahead) lookahead = core->max_lookahead;
+    if (core->lookahead_buffer.data == NULL) lookahead = 0;
+    *core->latency = lookahead;
+    return lookahead;
+}
+
+// Reserves room for an entry of `size` bytes at the end of the lookahead
+// buffer. Returns null if the buffer is full.
+static inline DelayedEvent *reserve_delayed_event(
+        LookaheadBuffer *buffer, uint32_t size) {
+    uint32_t write = buffer->write;
+    if (buffer->count == 0) {
+        write = 0;
+        buffer->read = 0;
+        if (size > buffer->capacity) return NULL;
+    } else if (write <= buffer->read) {
+        // The free space is between the end and the start of the entries.
+        if (size > buffer->read - write) return NULL;
+    } else if (size > buffer->capacity - write) {
+        // Doesn't fit at the end, so wrap to the start. If there's room for
+        // a header, a zero-size entry tells the reader to wrap.
+        if (size > buffer->read) return NULL;
+        if (buffer->capacity - write >= sizeof(DelayedEvent)) {
+            ((DelayedEvent *)(buffer->data + write))->size = 0;
+        }
+        write = 0;
+    }
+
+    buffer->write = write + size;
+    buffer->count++;
+    return (DelayedEvent *)(buffer->data + write);
+}
+
+// Adds the input events to the lookahead buffer. When a "note off" arrives
+// while its "note on" is still in the buffer, the note's length is recorded
+// in the "note on" entry, so each event is handled in constant time.
+static inline void delay_input_events(SlideCore *core) {
+    LookaheadBuffer *buffer = &core->lookahead_buffer;
+    const LV2_Atom_Sequence *input = core->input;
+    LV2_ATOM_SEQUENCE_FOREACH(input, event) {
+        uint32_t size = lv2_atom_pad_size(
+            sizeof(DelayedEvent) + event->body.size
+        );
+        DelayedEvent *entry = reserve_delayed_event(buffer, size);
+        const uint8_t *message = getMidiMessage(event, &core->uris);
+        if (entry == NULL) {
+            COUNT(core, events_dropped);
+            report_diagnostic(
+                core, DIAG_LOOKAHEAD_FULL, message == NULL ? 0 : message[0]
+            );
+            continue;
+        }
+
+        uint64_t time = core->sample_time + event->time.frames;
+        entry->time = time;
+        entry->size = size;
+        entry->note_length = 0;
+        memcpy(&entry->event, event, sizeof(*event) + event->body.size);
+        if (message == NULL) continue;
+
+        MidiAction action = get_midi_action(message, event->body.size);
+        if (action != ACTION_NOTE_ON && action != ACTION_NOTE_OFF) continue;
+        uint32_t *note_on = &buffer->note_ons[message[0] & 0x0F][message[1]];
+        if (action == ACTION_NOTE_ON) {
+            *note_on = (uint8_t *)entry - buffer->data;
+        } else {
+            if (*note_on == NO_EVENT) continue;
+            DelayedEvent *start = (DelayedEvent *)(buffer->data + *note_on);
+            start->note_length = time - start->time;
+            *note_on = NO_EVENT;
+        }
+    }
+}
+
+// Removes the next event from the lookahead buffer if it is due in this
+// block, and sets its time to the frame it is due at. The event is valid
+// until more events are added to the buffer.
+static inline const LV2_Atom_Event *next_delayed_event(
+        SlideCore *core, uint32_t lookahead, uint32_t n_samples,
+        uint32_t *note_length) {
+    LookaheadBuffer *buffer = &core->lookahead_buffer;
+    if (buffer->count == 0) return NULL;
+    uint32_t read = buffer->read;
+    if (buffer->capacity - read < sizeof(DelayedEvent) ||
+        ((DelayedEvent *)(buffer->data + read))->size == 0) {
+        read = 0;
+    }
+
+    DelayedEvent *entry = (DelayedEvent *)(buffer->data + read);
+    uint64_t due = entry->time + lookahead;
+    if (due >= core->sample_time + n_samples) return NULL;
+    buffer->read = read + entry->size;
+    buffer->count--;
+
+    // The lookahead may have been reduced, making some events overdue.
+    uint64_t start = core->sample_time;
+    entry->event.time.frames = due > start ? due - start : 0;
+    // A "note off" later than the lookahead is only in the buffer if it
+    // arrived in the same block, so it is ignored. Otherwise, the note's
+    // length would depend on the block size.
+    *note_length = entry->note_length;
+    if (*note_length > lookahead) *note_length = 0;
+    const uint8_t *message = getMidiMessage(&entry->event, &core->uris);
+    if (message != NULL &&
+        get_midi_action(message, entry->event.body.size) == ACTION_NOTE_ON) {
+        uint32_t *note_on = &buffer->note_ons[message[0] & 0x0F][message[1]];
+        if (*note_on == read) *note_on = NO_EVENT;
+    }
+    return &entry->event;
+}
+
+// Returns the event to handle after `event` (or the first event, if `event`
+// is null), or null if there are no more events in this block. If `delayed`
+// is true, events come from the lookahead buffer.
+static inline const LV2_Atom_Event *next_event(
+        SlideCore *core, const LV2_Atom_Event *event, bool delayed,
+        uint32_t lookahead, uint32_t n_samples, uint32_t *note_length) {
+    if (delayed) {
+        return next_delayed_event(core, lookahead, n_samples, note_length);
+    }
+
+    const LV2_Atom_Sequence *input = core->input;
+    if (event == NULL) {
+        event = lv2_atom_sequence_begin(&input->body);
+    } else {
+        event = lv2_atom_sequence_next(event);
+    }
+    if (lv2_atom_sequence_is_end(&input->body, input->atom.size, event)) {
+        return NULL;
+    }
+    *note_length = 0;
+    return event;
+}
+
+void slide_core_run(
+        SlideCore *core, const LV2_Atom_Sequence *input,
+        LV2_Atom_Sequence *output, uint32_t n_samples) {
+    const uint64_t start_cycles = read_cycle_counter();
+    const uint32_t output_capacity = output->atom.size;
+    core->input = input;
+    core->output = output;
+
+    lv2_atom_sequence_clear(core->output);
+    core->output->atom.type = core->input->atom.type;
+    core->last_output_event = NULL;
+    update_message_interval(core);
+    send_pending_messages(core, output_capacity);
+    update_output_format(core, output_capacity);
+    update_slide_settings(core);
+    update_voice_mode(core, output_capacity);
+    if (core->mpe_config_pending) send_mpe_config(core, output_capacity);
+    begin_pitch_cv(core, n_samples);
+
+    // With lookahead, input events are handled once they have been delayed
+    // by the lookahead time.
+    uint32_t lookahead = update_lookahead(core);
+    bool delayed = lookahead > 0 || core->lookahead_buffer.count > 0;
+    if (delayed) delay_input_events(core);
+    begin_coalescing(core, delayed, lookahead, n_samples);
+
+    const LV2_Atom_Event *event = NULL;
+    uint32_t note_length;
+    uint32_t last_frames = 0;
+    bool in_group = false;
+
+    // Events are handled in a single pass. Events with the same timestamp
+    // form a group, which is finished once an event with a later timestamp
+    // (or the end of the sequence) is reached.
+    while ((event = next_event(
+            core, event, delayed, lookahead, n_samples, &note_length))) {
+        uint32_t frames = event->time.frames;
+        if (!in_group || frames != last_frames) {
+            if (in_group) end_event_group(core, last_frames, output_capacity);
+            // Bends that were due before `frames` are sent using the state
+            // from before this group's events.
+            send_scheduled_bends(
+                core, frames - last_frames, frames, output_capacity
+            );
+            begin_event_group(core);
+            in_group = true;
+            last_frames = frames;
+        }
+        // Runs of passthrough events are copied straight from the input.
+        if (!delayed && core->format == OUTPUT_FORMAT_MIDI1 &&
+            is_passthrough_event(core, event)) {
+            event = forward_passthrough_run(core, event, output_capacity);
+            last_frames = event->time.frames;
+            continue;
+        }
+        handle_event(core, event, note_length, output_capacity);
+    }
+
+    if (in_group) end_event_group(core, last_frames, output_capacity);
+    if (last_frames < n_samples) {
+        send_scheduled_bends(
+            core, n_samples - last_frames, n_samples, output_capacity
+        );
+    }
+    render_pitch_cv(core, n_samples);
+    send_output_stats(core);
+    core->sample_time += n_samples;
+    update_run_cycles(core, start_cycles);
+    send_counters(core);
+}
+
+static inline void update_message_interval(SlideCore *core) {
+    float rate = *core->bend_rate;
+    if (rate == core->message_rate) return;
+    core->message_rate = rate;
+    uint32_t interval = rate > 0 ? core->sample_rate / rate : 0;
+    core->message_interval = interval > 0 ? interval : 1;
+}
+
+// Slide parameters depend on the tempo and controls; this makes sure they are
+// recomputed before they are next used.
+static inline void invalidate_slides(SlideCore *core) {
+    core->slide.valid = false;
+    core->voices.params_valid = false;
+}
+
+// Rebuilds the curve table and invalidates the slide parameters when the
+// controls they depend on have changed.
+static inline void update_slide_settings(SlideCore *core) {
+    float beat_divisor = *core->beat_divisor;
+    float semitone_distance = *core->bend_semitone_distance;
+    if (beat_divisor != core->slide_beat_divisor ||
+        semitone_distance != core->slide_semitone_distance ||
+        core->format != core->slide_format) {
+        core->slide_beat_divisor = beat_divisor;
+        core->slide_semitone_distance = semitone_distance;
+        core->slide_format = core->format;
+        core->bend_range_low = 8192;
+        core->bend_range_high = 8191;
+        core->bend_scale_bits = BEND_SCALE_BITS;
+        if (core->format == OUTPUT_FORMAT_UMP) {
+            core->bend_range_low = UINT32_C(0x80000000);
+            core->bend_range_high = UINT32_C(0x7FFFFFFF);
+            core->bend_scale_bits = BEND_SCALE_BITS_32;
+        }
+        // The factors are rounded up, so that a whole number of semitones
+        // isn't truncated to one less than its exact bend (for example,
+        // 16382 instead of 16383 at the top of the range).
+        double scale_unit = (uint64_t)1 << core->bend_scale_bits;
+        core->bend_scale_low = ceil(
+            core->bend_range_low * scale_unit / semitone_distance
+        );
+        core->bend_scale_high = ceil(
+            core->bend_range_high * scale_unit / semitone_distance
+        );
+        invalidate_slides(core);
+        // Member channels are configured with the semitone distance.
+        if (core->mode == VOICE_MODE_MPE) core->mpe_config_pending = true;
+    }
+
+    float curve_port = *core->slide_curve;
+    if (curve_port == core->slide_curve_value) return;
+    core->slide_curve_value = curve_port;
+    bool valid = curve_port >= 0 && curve_port < SLIDE_CURVE_COUNT;
+    int curve = valid ? (int)curve_port : SLIDE_CURVE_LINEAR;
+    core->curve_table = curve_tables[curve];
+}
+
+static inline void begin_event_group(SlideCore *core) {
+    EventGroup *group = &core->group;
+    NoteStack *note_stack = &core->note_stack;
+    uint8_t stack_size = note_stack_size(note_stack);
+    group->old_stack_size = stack_size;
+    group->old_slide_base = 0;
+    group->old_slide_top = 0;
+    if (stack_size >= 2) {
+        group->old_slide_base = note_stack_second(note_stack);
+        group->old_slide_top = note_stack->top;
+    }
+    group->note_ons_size = 0;
+    group->has_actions = false;
+    core->voice_group.touched = 0;
+    core->voice_group.added = 0;
+}
+
+// `note_length` is the length of the note in samples if the event is a "note
+// on" message and the length is known from lookahead, or 0 otherwise.
+static inline void handle_event(
+        SlideCore *core, const LV2_Atom_Event *event, uint32_t note_length,
+        uint32_t output_capacity) {
+    COUNT(core, events_in);
+    const LV2_Atom_Object *object = getAtomObject(event, &core->uris);
+    if (object != NULL) {
+        core->group.has_actions = true;
+        handle_atom_object(core, object, event->time.frames);
+        return;
+    }
+
+    const uint8_t *midi_message = getMidiMessage(event, &core->uris);
+    if (midi_message == NULL) return;
+    MidiAction action = get_midi_action(midi_message, event->body.size);
+    bool handled = handle_midi_message(
+        core, midi_message, action, note_length, output_capacity
+    );
+    if (handled) core->group.has_actions = true;
+    if (!handled && !is_superseded(core, event)) {
+        // Forward unchanged MIDI event.
+        forward_event(core, event, output_capacity);
+    }
+}
+
+static inline void end_event_group(
+        SlideCore *core, uint32_t frames, uint32_t output_capacity) {
+    // The pitch may change from `frames` on.
+    render_pitch_cv(core, frames);
+    if (core->mode == VOICE_MODE_MONO) {
+        end_mono_group(core, frames, output_capacity);
+    } else {
+        end_voice_group(core, frames, output_capacity);
+    }
+    capture_pitch_cv(core);
+}
+
+static inline void end_mono_group(
+        SlideCore *core, uint32_t frames, uint32_t output_capacity) {
+    EventGroup *group = &core->group;
+    NoteStack *note_stack = &core->note_stack;
+    uint8_t old_stack_size = group->old_stack_size;
+
+    // "Note off" messages in this group have already been handled, so the
+    // notes released by them are gone before the group's "note on" messages
+    // are added.
+    uint8_t stack_size = note_stack_size(note_stack);
+    // Whether or not a "note off" message should be sent.
+    bool note_stopped = old_stack_size > 0 && stack_size == 0;
+    bool force_bend_update = note_stopped || (old_stack_size >= 2 && (
+        stack_size < 2 ||
+        group->old_slide_base != note_stack_second(note_stack) ||
+        group->old_slide_top != note_stack->top
+    ));
+
+    if (force_bend_update) core->is_sliding = false;
+    old_stack_size = stack_size;
+
+    for (uint16_t i = 0; i < group->note_ons_size; i++) {
+        NoteOn *note = &group->note_ons[i];
+        group->key_note_on_channels[note->key] = 0;
+        add_to_stack(core, note);
+    }
+
+    stack_size = note_stack_size(note_stack);
+    bool note_started = old_stack_size == 0 && stack_size > 0;
+    if (stack_size > old_stack_size) {
+        // At least one note was added. If multiple notes were added at the
+        // same time, pick the one with the lowest velocity and move it to
+        // the top of the stack.
+        move_primary_to_stack_top(note_stack, stack_size - old_stack_size);
+        core->slide_phase = 0;
+        force_bend_update = true;
+        if (stack_size >= 2) {
+            core->is_sliding = true;
+        }
+    }
+
+    if (!force_bend_update) return;
+    // The periodic bends are scheduled relative to the last bend sent.
+    core->samples_since_sent = 0;
+    // The slide (if any) has different notes or has restarted.
+    core->slide.valid = false;
+
+    if (note_stopped) stop_note(core, frames, output_capacity);
+    if (stack_size == 0) return;
+
+    if (note_started) {
+        uint8_t key = note_stack->top;
+        if (stack_size >= 2) key = note_stack_second(note_stack);
+        uint8_t velocity = note_stack->velocity[key];
+        // The bend is reset for the key about to be played, which per-note
+        // bends apply to.
+        core->key_playing = key;
+        set_bend(core, 0, frames, output_capacity);
+        play_note(core, key, velocity, frames, output_capacity);
+        return;
+    }
+
+    if (!core->is_sliding) {
+        set_bend_from_key(core, note_stack->top, frames, output_capacity);
+        return;
+    }
+
+    bool continue_slide = set_bend_from_slide(core, frames, output_capacity);
+    if (!continue_slide) core->is_sliding = false;
+}
+
+// Sends the periodic slide bends that are due in the `n_samples` samples
+// preceding `frames`, each at the exact frame it is due.
+static inline void send_scheduled_bends(
+        SlideCore *core, uint32_t n_samples, uint32_t frames,
+        uint32_t output_capacity) {
+    if (core->mode != VOICE_MODE_MONO) {
+        send_scheduled_voice_bends(core, n_samples, frames, output_capacity);
+        return;
+    }
+
+    uint32_t interval = core->message_interval;
+    uint32_t position = frames - n_samples;
+
+    while (core->is_sliding) {
+        uint32_t since_sent = core->samples_since_sent;
+        uint32_t until_due = since_sent < interval ? interval - since_sent : 0;
+        if (until_due >= n_samples) {
+            core->samples_since_sent += n_samples;
+            advance_slide(core, n_samples);
+            return;
+        }
+
+        position += until_due;
+        n_samples -= until_due;
+        advance_slide(core, until_due);
+        core->samples_since_sent = 0;
+
+        bool continue_slide = set_bend_from_slide(
+            core, position, output_capacity
+        );
+        if (!continue_slide) core->is_sliding = false;
+    }
+}
+
+// Of the `n_added` most recently pressed notes, swaps the one with the lowest
+// velocity with the top note. Ties go to the most recent note.
+static inline void move_primary_to_stack_top(
+        NoteStack *stack, uint8_t n_added) {
+    uint8_t top = stack->top;
+    uint8_t primary = top;
+    uint8_t key = top;
+    for (uint8_t i = 1; i < n_added; i++) {
+        key = stack->prev[key];
+        if (stack->velocity[key] < stack->velocity[primary]) primary = key;
+    }
+    if (primary == top) return;
+
+    uint8_t next = stack->next[primary];
+    note_stack_remove(stack, primary);
+    if (next != top) {
+        note_stack_remove(stack, top);
+        note_stack_insert(stack, top, next);
+    }
+    note_stack_push(stack, primary, stack->velocity[primary]);
+}
+
+// Computes the parameters of the slide between the top two notes in the
+// stack.
+static inline void setup_slide(SlideCore *core) {
+    SlideParams *slide = &core->slide;
+    NoteStack *note_stack = &core->note_stack;
+    uint8_t key = note_stack->top;
+    uint8_t base_key = note_stack_second(note_stack);
+    float semitone_distance = core->slide_semitone_distance;
+
+    int key_diff = (int)key - base_key;
+    int key_offset = (int)base_key - core->key_playing;
+    slide->in_range = (
+        abs(key_offset) <= semitone_distance &&
+        abs(key_diff + key_offset) <= semitone_distance
+    );
+    slide->key_offset = key_offset;
+    slide->key_diff = key_diff;
+    slide->phase_increment = slide_phase_increment(
+        core, note_stack, &slide->max_advance
+    );
+    slide->valid = true;
+}
+
+// Returns the phase increment for a slide to the top note of `stack`, and
+// stores the number of samples after which it always ends in `max_advance`.
+// The slide lasts as long as the top note if its length is known from
+// lookahead, or otherwise as long as its velocity indicates.
+static inline uint64_t slide_phase_increment(
+        SlideCore *core, const NoteStack *stack, uint32_t *max_advance) {
+    uint8_t key = stack->top;
+    // The duration isn't rounded to whole samples, so long slides end on
+    // time.
+    double duration = (
+        (double)core->samples_per_beat * stack->velocity[key] /
+        core->slide_beat_divisor
+    );
+    if (stack->length[key] > 0) {
+        duration = core->samples_per_beat * stack->length[key];
+    }
+    // Slides shorter than half a sample end after the first sample.
+    uint64_t increment = SLIDE_PHASE_END;
+    if (duration > 0.5) increment = llrint(SLIDE_PHASE_LEG / duration);
+    uint64_t max = 2 * SLIDE_PHASE_LEG / increment + 1;
+    *max_advance = max < UINT32_MAX ? max : UINT32_MAX;
+    return increment;
+}
+
+static inline uint64_t advance_phase(
+        uint64_t phase, uint32_t n_samples, uint64_t increment,
+        uint32_t max_advance) {
+    if (n_samples >= max_advance) return SLIDE_PHASE_END;
+    // Doesn't overflow, because of the check above and because the phase
+    // never exceeds SLIDE_PHASE_END.
+    phase += n_samples * increment;
+    return phase < SLIDE_PHASE_END ? phase : SLIDE_PHASE_END;
+}
+
+static inline void advance_slide(SlideCore *core, uint32_t n_samples) {
+    SlideParams *slide = &core->slide;
+    if (!slide->valid) setup_slide(core);
+    core->slide_phase = advance_phase(
+        core->slide_phase, n_samples, slide->phase_increment,
+        slide->max_advance
+    );
+}
+
+// Converts a semitone offset with CURVE_VALUE_BITS fractional bits to a bend.
+// Like the conversion in relative_key_to_bend(), this rounds toward zero.
+static inline int slide_key_to_bend(SlideCore *core, int64_t relative_key) {
+    const int shift = CURVE_VALUE_BITS + core->bend_scale_bits;
+    if (relative_key < 0) {
+        uint64_t magnitude = -relative_key;
+        return -(int64_t)((magnitude * core->bend_scale_low) >> shift);
+    }
+    return ((uint64_t)relative_key * core->bend_scale_high) >> shift;
+}
+
+// Returns the progress of a slide along the curve at `phase` (which must not
+// be past the end of the slide), with CURVE_VALUE_BITS fractional bits.
+static inline int64_t slide_progress(
+        SlideCore *core, uint64_t phase, uint64_t increment) {
+    if (phase > SLIDE_PHASE_LEG) phase = 2 * SLIDE_PHASE_LEG - phase;
+    // The increment is rounded, so the phase almost never lands exactly on
+    // the top of the slide. The sample nearest to it plays the top note
+    // exactly, as it would with a whole number of samples per leg.
+    if (SLIDE_PHASE_LEG - phase <= increment / 2) {
+        return core->curve_table[CURVE_TABLE_SIZE];
+    }
+
+    // The top bits of the phase select the table entry; the next 16 bits
+    // interpolate between it and the following entry.
+    const int index_shift = SLIDE_LEG_BITS - CURVE_TABLE_BITS;
+    uint32_t index = phase >> index_shift;
+    uint32_t fraction = (phase >> (index_shift - 16)) & 0xFFFF;
+    if (index >= CURVE_TABLE_SIZE) {
+        index = CURVE_TABLE_SIZE - 1;
+        fraction = 0x10000;
+    }
+
+    // The curves never decrease, so the difference is never negative.
+    const uint32_t *table = &core->curve_table[index];
+    uint64_t step = (uint64_t)(table[1] - table[0]) * fraction;
+    return table[0] + (step >> 16);
+}
+
+static inline bool set_bend_from_slide(
+        SlideCore *core, uint32_t frames, uint32_t output_capacity) {
+    SlideParams *slide = &core->slide;
+    if (!slide->valid) setup_slide(core);
+    if (!slide->in_range) {
+        COUNT(core, slides_out_of_range);
+        return false;
+    }
+
+    int64_t key_offset = slide->key_offset * ((int64_t)1 << CURVE_VALUE_BITS);
+    uint64_t phase = core->slide_phase;
+    if (phase > 2 * SLIDE_PHASE_LEG) {
+        // The slide has returned to the base note. The last bend sent may
+        // not be exactly the base note, since intermediate values may have
+        // been skipped and the phase rarely ends exactly on a sample.
+        int bend_value = slide_key_to_bend(core, key_offset);
+        if (bend_value != core->last_bend) {
+            set_bend(core, bend_value, frames, output_capacity);
+        }
+        return false;
+    }
+    int64_t progress = slide_progress(core, phase, slide->phase_increment);
+    int64_t relative_key = key_offset + slide->key_diff * progress;
+    int bend_value = slide_key_to_bend(core, relative_key);
+    set_bend_on_change(core, bend_value, frames, output_capacity);
+    return true;
+}
+
+// Whether a bend differs from the last one sent by less than the minimum
+// step, which is in 14-bit units regardless of the output format.
+static inline bool below_min_bend_step(
+        SlideCore *core, int value, int last_bend) {
+    float step = *core->min_bend_step * (core->bend_range_low / 8192);
+    return llabs((int64_t)value - last_bend) < step;
+}
+
+// In BEND_MODE_CHANGE, only sends the bend if it differs enough from the last
+// one sent.
+static inline void set_bend_on_change(
+        SlideCore *core, int value, uint32_t frames,
+        uint32_t output_capacity) {
+    if ((int)*core->bend_mode == BEND_MODE_CHANGE &&
+        below_min_bend_step(core, value, core->last_bend)) {
+        return;
+    }
+    set_bend(core, value, frames, output_capacity);
+}
+
+static inline void set_bend_from_key(
+        SlideCore *core, uint8_t key, uint32_t frames,
+        uint32_t output_capacity) {
+    int relative_key = (int)key - core->key_playing;
+    if (abs(relative_key) > *core->bend_semitone_distance) return;
+    int bend_value = relative_key_to_bend(core, relative_key);
+    set_bend(core, bend_value, frames, output_capacity);
+}
+
+static inline int relative_key_to_bend(
+        SlideCore *core, double relative_key) {
+    double bend_multiplier = (
+        relative_key < 0 ? core->bend_range_low : core->bend_range_high
+    );
+    return bend_multiplier * relative_key / *core->bend_semitone_distance;
+}
+
+static inline void init_midi_event(
+        SlideCore *core, MidiEvent *event, uint32_t frames) {
+    event->event.time.frames = frames;
+    event->event.body.type = core->uris.midi_Event;
+    event->event.body.size = 3;
+}
+
+// Initializes a MIDI 2.0 channel voice message in group 0. `status` is as in
+// MIDI 1.0, `index` holds the two bytes that follow it (such as the key and
+// an attribute type), and `value` is the second word.
+static inline void init_ump_event(
+        SlideCore *core, MidiEvent *event, uint32_t frames, uint8_t status,
+        uint16_t index, uint32_t value) {
+    event->event.time.frames = frames;
+    event->event.body.type = core->uris.ump_Event;
+    event->event.body.size = 8;
+    event->data.ump[0] = (
+        (uint32_t)UMP_TYPE_MIDI2_CHANNEL_VOICE << 28 |
+        (uint32_t)status << 16 | index
+    );
+    event->data.ump[1] = value;
+}
+
+// Converts a 7-bit velocity to 16 bits as recommended by the MIDI 2.0
+// specification, which keeps the minimum, center and maximum values.
+static inline uint16_t velocity_to_16_bit(uint8_t velocity) {
+    uint16_t value = velocity << 9;
+    if (velocity <= 64) return value;
+    // Above the center, the lower 6 bits are repeated to fill the rest.
+    uint16_t repeat = velocity & 0x3F;
+    return value | repeat << 3 | repeat >> 3;
+}
+
+// In OUTPUT_FORMAT_UMP, the bend only applies to `key`.
+static inline void send_bend(
+        SlideCore *core, uint8_t channel, uint8_t key, int value,
+        uint32_t frames, uint32_t output_capacity) {
+    MidiEvent event;
+    if (core->format == OUTPUT_FORMAT_UMP) {
+        init_ump_event(
+            core, &event, frames, UMP_STATUS_PER_NOTE_BEND | channel,
+            key << 8, (uint32_t)value + UINT32_C(0x80000000)
+        );
+        send_midi_message(core, &event, PRIORITY_BEND, output_capacity);
+        return;
+    }
+
+    uint16_t real_bend = value + 8192;
+    init_midi_event(core, &event, frames);
+    event.data.message[0] = LV2_MIDI_MSG_BENDER | channel;
+    event.data.message[1] = real_bend & 0x7f;
+    event.data.message[2] = (real_bend >> 7) & 0x7f;
+    send_midi_message(core, &event, PRIORITY_BEND, output_capacity);
+}
+
+static inline void send_note(
+        SlideCore *core, uint8_t status, uint8_t key, uint8_t velocity,
+        uint32_t frames, uint32_t output_capacity) {
+    MidiEvent event;
+    if (core->format == OUTPUT_FORMAT_UMP) {
+        init_ump_event(
+            core, &event, frames, status, key << 8,
+            (uint32_t)velocity_to_16_bit(velocity) << 16
+        );
+        send_midi_message(core, &event, PRIORITY_NOTE, output_capacity);
+        return;
+    }
+
+    init_midi_event(core, &event, frames);
+    event.data.message[0] = status;
+    event.data.message[1] = key;
+    event.data.message[2] = velocity;
+    send_midi_message(core, &event, PRIORITY_NOTE, output_capacity);
+}
+
+static inline uint8_t output_velocity(SlideCore *core, uint8_t velocity) {
+    if (*core->forced_velocity > 0) return *core->forced_velocity;
+    return velocity;
+}
+
+static inline void set_bend(
+        SlideCore *core, int value, uint32_t frames,
+        uint32_t output_capacity) {
+    core->last_bend = value;
+    send_bend(core, 0, core->key_playing, value, frames, output_capacity);
+}
+
+static inline void play_note(
+        SlideCore *core, uint8_t key, uint8_t velocity, uint32_t frames,
+        uint32_t output_capacity) {
+    core->key_playing = key;
+    send_note(
+        core, LV2_MIDI_MSG_NOTE_ON, key, output_velocity(core, velocity),
+        frames, output_capacity
+    );
+}
+
+static inline void stop_note(
+        SlideCore *core, uint32_t frames, uint32_t output_capacity) {
+    // For now, zero velocity.
+    send_note(
+        core, LV2_MIDI_MSG_NOTE_OFF, core->key_playing, 0, frames,
+        output_capacity
+    );
+}
+
+// Returns the status byte of an output event, or 0 if it has none. For
+// Universal MIDI Packets, this is the byte after the message type and group,
+// which is the status byte for channel voice and system messages.
+static inline uint8_t output_event_status(
+        SlideCore *core, const LV2_Atom_Event *event) {
+    if (event->body.size == 0) return 0;
+    if (event->body.type == core->uris.midi_Event) {
+        return *(const uint8_t *)(event + 1);
+    }
+    if (event->body.type == core->uris.ump_Event) {
+        return *(const uint32_t *)(event + 1) >> 16 & 0xFF;
+    }
+    return 0;
+}
+
+static inline bool is_bend_output(
+        SlideCore *core, const LV2_Atom_Event *event) {
+    uint8_t status = output_event_status(core, event) & 0xF0;
+    if (event->body.type != core->uris.ump_Event) {
+        return status == LV2_MIDI_MSG_BENDER;
+    }
+    uint32_t type = *(const uint32_t *)(event + 1) >> 28;
+    if (type == UMP_TYPE_MIDI2_CHANNEL_VOICE) {
+        return status == UMP_STATUS_PER_NOTE_BEND;
+    }
+    return (
+        type == UMP_TYPE_MIDI1_CHANNEL_VOICE && status == LV2_MIDI_MSG_BENDER
+    );
+}
+
+static inline bool append_output_event(
+        SlideCore *core, const LV2_Atom_Event *event, uint32_t capacity) {
+    LV2_Atom_Event *result = lv2_atom_sequence_append_event(
+        core->output, capacity, event
+    );
+    if (result == NULL) return false;
+    core->last_output_event = result;
+    COUNT(core, events_out);
+    if (is_bend_output(core, event)) COUNT(core, bends_out);
+    return true;
+}
+
+// The capacity available to messages other than "note on" and "note off".
+static inline uint32_t low_priority_capacity(uint32_t output_capacity) {
+    uint32_t reserve = NOTE_RESERVE_EVENTS * lv2_atom_pad_size(
+        sizeof(LV2_Atom_Event) + 3
+    );
+    return output_capacity > reserve ? output_capacity - reserve : 0;
+}
+
+// Whether `event` is a bend to the same channel (and, for per-note bends,
+// the same key) as the bend `bend`.
+static inline bool is_same_bend(
+        SlideCore *core, LV2_Atom_Event *event, const MidiEvent *bend) {
+    if (event->body.type != bend->event.body.type) return false;
+    if (event->body.size != bend->event.body.size) return false;
+    if (event->body.type == core->uris.ump_Event) {
+        return *(const uint32_t *)(event + 1) == bend->data.ump[0];
+    }
+    return *(const uint8_t *)(event + 1) == bend->data.message[0];
+}
+
+// Handles a bend that does not fit in the output buffer.
+static inline void defer_bend(SlideCore *core, MidiEvent *event) {
+    OutputStats *stats = &core->output_stats;
+    uint8_t channel = output_event_status(core, &event->event) & 0x0F;
+    LV2_Atom_Event *last = core->last_output_event;
+    if (last != NULL && last->time.frames == event->event.time.frames &&
+        is_same_bend(core, last, event)) {
+        // Only the latest value for a given timestamp matters.
+        memcpy(last + 1, &event->data, event->event.body.size);
+        stats->bends_merged++;
+        return;
+    }
+
+    // Send the bend at the start of the next block instead.
+    uint16_t channel_bit = 1 << channel;
+    if (core->pending_bend_channels & channel_bit) {
+        stats->bends_dropped++;
+        COUNT(core, events_dropped);
+    }
+    core->pending_bends[channel] = *event;
+    core->pending_bend_channels |= channel_bit;
+}
+
+// Handles a "note on" or "note off" message that does not fit in the output
+// buffer.
+static inline void defer_note(SlideCore *core, MidiEvent *event) {
+    OutputStats *stats = &core->output_stats;
+    uint8_t status = output_event_status(core, &event->event);
+    // Dropping a "note off" would leave a stuck note, so it is sent at the
+    // start of the next block instead.
+    if ((status & 0xF0) == LV2_MIDI_MSG_NOTE_OFF &&
+        core->pending_notes_size < MAX_PENDING_NOTES) {
+        core->pending_notes[core->pending_notes_size++] = *event;
+        stats->notes_delayed++;
+        return;
+    }
+    stats->notes_dropped++;
+    COUNT(core, events_dropped);
+    report_diagnostic(core, DIAG_OUTPUT_FULL, status);
+}
+
+static inline void send_midi_message(
+        SlideCore *core, MidiEvent *event, MessagePriority priority,
+        uint32_t output_capacity) {
+    uint32_t capacity = output_capacity;
+    if (priority != PRIORITY_NOTE) {
+        capacity = low_priority_capacity(output_capacity);
+    }
+    if (append_output_event(core, &event->event, capacity)) return;
+
+    if (priority == PRIORITY_BEND) {
+        defer_bend(core, event);
+    } else {
+        defer_note(core, event);
+    }
+}
+
+// Sends messages that did not fit in the previous block's output buffer.
+static inline void send_pending_messages(
+        SlideCore *core, uint32_t output_capacity) {
+    uint8_t n_notes = core->pending_notes_size;
+    core->pending_notes_size = 0;
+    for (uint8_t i = 0; i < n_notes; i++) {
+        MidiEvent *event = &core->pending_notes[i];
+        event->event.time.frames = 0;
+        send_midi_message(core, event, PRIORITY_NOTE, output_capacity);
+    }
+
+    uint16_t channels = core->pending_bend_channels;
+    core->pending_bend_channels = 0;
+    for (; channels != 0; channels &= channels - 1) {
+        MidiEvent event = core->pending_bends[__builtin_ctz(channels)];
+        event.event.time.frames = 0;
+        send_midi_message(core, &event, PRIORITY_BEND, output_capacity);
+    }
+}
+
+// Forwards an input MIDI message as Universal MIDI Packets. Channel voice and
+// system messages are sent unchanged in a packet each, and system exclusive
+// messages are split into 64-bit data packets. Returns false, without
+// sending anything, if the packets don't fit.
+static inline bool forward_as_ump(
+        SlideCore *core, const LV2_Atom_Event *event, uint32_t capacity) {
+    const uint8_t *message = (const uint8_t *)(event + 1);
+    uint32_t size = event->body.size;
+    MidiEvent packet;
+    packet.event.time.frames = event->time.frames;
+    packet.event.body.type = core->uris.ump_Event;
+
+    if (message[0] != LV2_MIDI_MSG_SYSTEM_EXCLUSIVE) {
+        uint32_t type = UMP_TYPE_MIDI1_CHANNEL_VOICE;
+        if (message[0] >= LV2_MIDI_MSG_SYSTEM_EXCLUSIVE) {
+            type = UMP_TYPE_SYSTEM;
+        }
+        uint32_t word = type << 28 | (uint32_t)message[0] << 16;
+        if (size > 1) word |= (uint32_t)message[1] << 8;
+        if (size > 2) word |= message[2];
+        packet.event.body.size = 4;
+        packet.data.ump[0] = word;
+        return append_output_event(core, &packet.event, capacity);
+    }
+
+    // The packets hold the bytes between the start and end status bytes.
+    const uint8_t *data = message + 1;
+    uint32_t data_size = size - 1;
+    if (data_size > 0 && data[data_size - 1] == MIDI_SYSEX_END) data_size--;
+    uint32_t n_packets = data_size > 0 ? (data_size + 5) / 6 : 1;
+    uint32_t packet_size = lv2_atom_pad_size(sizeof(LV2_Atom_Event) + 8);
+    uint32_t used = core->output->atom.size;
+    if (used > capacity || n_packets * packet_size > capacity - used) {
+        return false;
+    }
+
+    packet.event.body.size = 8;
+    for (uint32_t i = 0; i < n_packets; i++) {
+        uint32_t offset = i * 6;
+        uint32_t n_bytes = data_size - offset < 6 ? data_size - offset : 6;
+        // 0: complete message; 1: start; 2: continue; 3: end.
+        uint32_t status = n_packets == 1 ? 0 : i == 0 ? 1 : 2;
+        if (n_packets > 1 && i == n_packets - 1) status = 3;
+
+        uint8_t bytes[6] = {0};
+        memcpy(bytes, data + offset, n_bytes);
+        packet.data.ump[0] = (
+            (uint32_t)UMP_TYPE_DATA_64 << 28 | status << 20 | n_bytes << 16 |
+            (uint32_t)bytes[0] << 8 | bytes[1]
+        );
+        packet.data.ump[1] = (
+            (uint32_t)bytes[2] << 24 | (uint32_t)bytes[3] << 16 |
+            (uint32_t)bytes[4] << 8 | bytes[5]
+        );
+        append_output_event(core, &packet.event, capacity);
+    }
+    return true;
+}
+
+// Forwards an unhandled input event, unless there is no room left outside
+// the space reserved for notes.
+static inline void forward_event(
+        SlideCore *core, const LV2_Atom_Event *event,
+        uint32_t output_capacity) {
+    uint32_t capacity = low_priority_capacity(output_capacity);
+    bool forwarded;
+    if (core->format == OUTPUT_FORMAT_UMP) {
+        forwarded = forward_as_ump(core, event, capacity);
+    } else {
+        forwarded = append_output_event(core, event, capacity);
+    }
+    if (forwarded) return;
+    core->output_stats.passthrough_dropped++;
+    COUNT(core, events_dropped);
+    const uint8_t *message = (const uint8_t *)(event + 1);
+    report_diagnostic(core, DIAG_OUTPUT_FULL, message[0]);
+}
+
+// Whether `event` is a MIDI message that handle_event() would forward
+// unchanged.
+static inline bool is_passthrough_event(
+        SlideCore *core, const LV2_Atom_Event *event) {
+    const uint8_t *message = getMidiMessage(event, &core->uris);
+    if (message == NULL || event->body.size == 0) return false;
+    if (get_midi_action(message, event->body.size) != ACTION_UNKNOWN) {
+        return false;
+    }
+    return !is_superseded(core, event);
+}
+
+// Whether a later message for the same controller simply replaces this
+// controller's value. Bank select, parameter number and data entry messages
+// take effect together with the messages around them, and channel mode
+// messages are commands, so none of them are coalesced.
+static inline bool is_value_controller(uint8_t controller) {
+    switch (controller) {
+        case LV2_MIDI_CTL_MSB_BANK:
+        case LV2_MIDI_CTL_LSB_BANK:
+        case LV2_MIDI_CTL_MSB_DATA_ENTRY:
+        case LV2_MIDI_CTL_LSB_DATA_ENTRY:
+        case LV2_MIDI_CTL_DATA_INCREMENT:
+        case LV2_MIDI_CTL_DATA_DECREMENT:
+        case LV2_MIDI_CTL_NRPN_LSB:
+        case LV2_MIDI_CTL_NRPN_MSB:
+        case LV2_MIDI_CTL_RPN_LSB:
+        case LV2_MIDI_CTL_RPN_MSB:
+            return false;
+    }
+    return controller < LV2_MIDI_CTL_ALL_SOUNDS_OFF;
+}
+
+// Returns the slot for the value set by a message, or null if the message is
+// never coalesced.
+static inline CoalesceSlot *coalesce_slot(
+        CoalesceState *state, const uint8_t *message, uint32_t size) {
+    if (size < 2) return NULL;
+    uint8_t channel = message[0] & 0x0F;
+    switch (message[0] & 0xF0) {
+        case LV2_MIDI_MSG_CONTROLLER:
+            if (size < 3 || !is_value_controller(message[1])) return NULL;
+            return &state->slots[channel][message[1]];
+        case LV2_MIDI_MSG_CHANNEL_PRESSURE:
+            return &state->slots[channel][COALESCE_PRESSURE];
+        case LV2_MIDI_MSG_BENDER:
+            if (size < 3) return NULL;
+            return &state->slots[channel][COALESCE_BEND];
+    }
+    return NULL;
+}
+
+static inline void record_latest_value(
+        SlideCore *core, const LV2_Atom_Event *event) {
+    CoalesceState *state = &core->coalescing;
+    const uint8_t *message = getMidiMessage(event, &core->uris);
+    if (message == NULL) return;
+    CoalesceSlot *slot = coalesce_slot(state, message, event->body.size);
+    if (slot == NULL) return;
+    slot->event = event;
+    slot->block = state->block;
+}
+
+// Reads the "Coalesce controllers" control and, if it is on, records the
+// last event of each kind of value among the events handled in this block.
+// The events are those next_event() will return.
+static inline void begin_coalescing(
+        SlideCore *core, bool delayed, uint32_t lookahead,
+        uint32_t n_samples) {
+    CoalesceState *state = &core->coalescing;
+    state->enabled = (
+        *core->coalesce_controllers >= 0.5f && state->slots != NULL
+    );
+    if (!state->enabled) return;
+    if (++state->block == 0) {
+        // Once the counter wraps, slots from long ago would look current.
+        memset(state->slots, 0, 16 * sizeof(*state->slots));
+        state->block = 1;
+    }
+
+    if (!delayed) {
+        LV2_ATOM_SEQUENCE_FOREACH(core->input, event) {
+            record_latest_value(core, event);
+        }
+        return;
+    }
+
+    // Walks the lookahead buffer as next_delayed_event() does, without
+    // removing anything.
+    const LookaheadBuffer *buffer = &core->lookahead_buffer;
+    uint64_t end = core->sample_time + n_samples;
+    uint32_t read = buffer->read;
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        if (buffer->capacity - read < sizeof(DelayedEvent) ||
+            ((DelayedEvent *)(buffer->data + read))->size == 0) {
+            read = 0;
+        }
+        DelayedEvent *entry = (DelayedEvent *)(buffer->data + read);
+        if (entry->time + lookahead >= end) break;
+        record_latest_value(core, &entry->event);
+        read += entry->size;
+    }
+}
+
+// Whether `event` is a controller, channel pressure or pitch bend value that
+// a later event in this block replaces, when "Coalesce controllers" is on.
+// Such events are dropped, and the last one is forwarded at its own time.
+static inline bool is_superseded(
+        SlideCore *core, const LV2_Atom_Event *event) {
+    CoalesceState *state = &core->coalescing;
+    if (!state->enabled) return false;
+    const uint8_t *message = getMidiMessage(event, &core->uris);
+    if (message == NULL) return false;
+    CoalesceSlot *slot = coalesce_slot(state, message, event->body.size);
+    return (
+        slot != NULL && slot->block == state->block && slot->event != event
+    );
+}
+
+// Whether any slide is in progress, in which case bends are scheduled.
+static inline bool slide_in_progress(SlideCore *core) {
+    if (core->mode == VOICE_MODE_MONO) return core->is_sliding;
+    return core->voices.sliding != 0;
+}
+
+// Forwards the passthrough event `first` along with the passthrough events
+// that follow it in the input, as long as no generated event would have to
+// be placed between them, and returns the last event forwarded. The events
+// are copied to the output in one move when they all fit.
+static inline const LV2_Atom_Event *forward_passthrough_run(
+        SlideCore *core, const LV2_Atom_Event *first,
+        uint32_t output_capacity) {
+    const LV2_Atom_Sequence *input = core->input;
+    // Events are only generated at the end of a group and when bends are
+    // scheduled. Neither happens when the group so far has only been
+    // forwarded and nothing is sliding, so the run may then continue into
+    // later groups.
+    bool idle = !core->group.has_actions && !slide_in_progress(core);
+    const LV2_Atom_Event *last = first;
+    COUNT(core, events_in);
+    for (const LV2_Atom_Event *event = lv2_atom_sequence_next(first);
+         !lv2_atom_sequence_is_end(&input->body, input->atom.size, event);
+         event = lv2_atom_sequence_next(event)) {
+        if (!idle && event->time.frames != first->time.frames) break;
+        if (!is_passthrough_event(core, event)) break;
+        COUNT(core, events_in);
+        last = event;
+    }
+    const LV2_Atom_Event *end = lv2_atom_sequence_next(last);
+
+    // As with lv2_atom_sequence_append_event(), which checks each event
+    // before padding it, all the events fit if the last one does.
+    uint32_t capacity = low_priority_capacity(output_capacity);
+    uint32_t used = core->output->atom.size;
+    uint32_t offset = (const uint8_t *)last - (const uint8_t *)first;
+    uint32_t size = offset + sizeof(*last) + last->body.size;
+    if (used > capacity || size > capacity - used) {
+        // Forward the events one at a time, dropping those that don't fit.
+        for (const LV2_Atom_Event *event = first; event != end;
+             event = lv2_atom_sequence_next(event)) {
+            forward_event(core, event, output_capacity);
+        }
+        return last;
+    }
+
+    LV2_Atom_Event *output = lv2_atom_sequence_end(
+        &core->output->body, used
+    );
+    memcpy(output, first, size);
+    core->output->atom.size += offset + lv2_atom_pad_size(
+        sizeof(*last) + last->body.size
+    );
+    core->last_output_event = (LV2_Atom_Event *)((uint8_t *)output + offset);
+    for (const LV2_Atom_Event *event = first; event != end;
+         event = lv2_atom_sequence_next(event)) {
+        COUNT(core, events_out);
+        if (is_bend_output(core, event)) COUNT(core, bends_out);
+    }
+    return last;
+}
+
+static inline bool handle_midi_message(
+        SlideCore *core, const uint8_t *message, MidiAction action,
+        uint32_t note_length, uint32_t output_capacity) {
+    // Only in per-channel mode are notes on different channels kept apart.
+    uint8_t channel = 0;
+    if (core->mode == VOICE_MODE_CHANNEL) channel = message[0] & 0x0F;
+    switch (action) {
+        case ACTION_NOTE_ON:
+            handle_note_on(
+                core, channel, message[1], message[2], note_length
+            );
+            break;
+        case ACTION_NOTE_OFF:
+            handle_note_off(core, channel, message[1]);
+            break;
+        case ACTION_ALL_NOTES_OFF:
+            handle_all_notes_off(core, channel);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Messages that are too short or have out-of-range data bytes are
+// ACTION_UNKNOWN, so they are forwarded unchanged. A "note on" with a
+// velocity of 0 is a "note off".
+static inline MidiAction get_midi_action(
+        const uint8_t *message, uint32_t size) {
+    if (size < 3 || (message[1] | message[2]) & 0x80) return ACTION_UNKNOWN;
+    uint8_t message_type = message[0] & 0xF0;
+    switch (message_type) {
+        case LV2_MIDI_MSG_NOTE_ON:
+            if (message[2] == 0) return ACTION_NOTE_OFF;
+            return ACTION_NOTE_ON;
+        case LV2_MIDI_MSG_NOTE_OFF:
+            return ACTION_NOTE_OFF;
+        case LV2_MIDI_MSG_CONTROLLER: ;
+            uint8_t controller = message[1];
+            if (controller >= LV2_MIDI_CTL_ALL_NOTES_OFF &&
+                controller <= LV2_MIDI_CTL_MONO2) {
+                // All messages in this range turn off notes.
+                return ACTION_ALL_NOTES_OFF;
+            }
+            break;
+    }
+    return ACTION_UNKNOWN;
+}
+
+// "Note on" messages are added to the stack at the end of their group, after
+// any "note off" messages in the same group have been handled.
+static inline void handle_note_on(
+        SlideCore *core, uint8_t channel, uint8_t key, uint8_t velocity,
+        uint32_t length) {
+    EventGroup *group = &core->group;
+    uint16_t channel_bit = 1 << channel;
+    if (group->key_note_on_channels[key] & channel_bit) {
+        // The first "note on" for this key will either be added to the
+        // stack or rejected because the note is already in it.
+        report_diagnostic(core, DIAG_NOTE_IN_STACK, key);
+        return;
+    }
+
+    group->key_note_on_channels[key] |= channel_bit;
+    group->note_ons[group->note_ons_size++] = (NoteOn){
+        .key = key,
+        .velocity = velocity,
+        .channel = channel,
+        .length = length / core->samples_per_beat,
+    };
+}
+
+static inline void handle_note_off(
+        SlideCore *core, uint8_t channel, uint8_t key) {
+    if (core->mode != VOICE_MODE_MONO) {
+        remove_from_voice(core, channel, key);
+        return;
+    }
+    remove_from_stack(core, key);
+}
+
+static inline void handle_all_notes_off(SlideCore *core, uint8_t channel) {
+    if (core->mode != VOICE_MODE_MONO) {
+        clear_voices(core, channel);
+        return;
+    }
+    clear_stack(core);
+}
+
+static inline uint8_t note_stack_size(const NoteStack *stack) {
+    return (
+        __builtin_popcountll(stack->keys[0]) +
+        __builtin_popcountll(stack->keys[1])
+    );
+}
+
+static inline bool note_stack_has(const NoteStack *stack, uint8_t key) {
+    return (stack->keys[key / 64] >> (key % 64)) & 1;
+}
+
+// Returns the note below the top note, or NO_KEY if there isn't one.
+static inline uint8_t note_stack_second(const NoteStack *stack) {
+    return stack->top == NO_KEY ? NO_KEY : stack->prev[stack->top];
+}
+
+static inline void note_stack_push(
+        NoteStack *stack, uint8_t key, uint8_t velocity) {
+    stack->keys[key / 64] |= (uint64_t)1 << (key % 64);
+    stack->velocity[key] = velocity;
+    stack->prev[key] = stack->top;
+    stack->next[key] = NO_KEY;
+    if (stack->top != NO_KEY) stack->next[stack->top] = key;
+    stack->top = key;
+}
+
+// Adds `key` just below `next_key`, keeping its velocity.
+static inline void note_stack_insert(
+        NoteStack *stack, uint8_t key, uint8_t next_key) {
+    uint8_t prev_key = stack->prev[next_key];
+    stack->keys[key / 64] |= (uint64_t)1 << (key % 64);
+    stack->prev[key] = prev_key;
+    stack->next[key] = next_key;
+    stack->prev[next_key] = key;
+    if (prev_key != NO_KEY) stack->next[prev_key] = key;
+}
+
+static inline void note_stack_remove(NoteStack *stack, uint8_t key) {
+    uint8_t prev_key = stack->prev[key];
+    uint8_t next_key = stack->next[key];
+    stack->keys[key / 64] &= ~((uint64_t)1 << (key % 64));
+    if (prev_key != NO_KEY) stack->next[prev_key] = next_key;
+    if (next_key != NO_KEY) {
+        stack->prev[next_key] = prev_key;
+    } else {
+        stack->top = prev_key;
+    }
+}
+
+static inline void note_stack_clear(NoteStack *stack) {
+    stack->keys[0] = 0;
+    stack->keys[1] = 0;
+    stack->top = NO_KEY;
+}
+
+static inline void add_to_stack(SlideCore *core, const NoteOn *note) {
+    NoteStack *stack = &core->note_stack;
+    if (note_stack_has(stack, note->key)) {
+        report_diagnostic(core, DIAG_NOTE_IN_STACK, note->key);
+        return;
+    }
+    note_stack_push(stack, note->key, note->velocity);
+    stack->length[note->key] = note->length;
+    update_stack_high_water(core, stack);
+}
+
+static inline void remove_from_stack(SlideCore *core, uint8_t key) {
+    if (!note_stack_has(&core->note_stack, key)) {
+        report_diagnostic(core, DIAG_NOTE_NOT_IN_STACK, key);
+        return;
+    }
+    note_stack_remove(&core->note_stack, key);
+}
+
+static inline void clear_stack(SlideCore *core) {
+    note_stack_clear(&core->note_stack);
+}
+
+static inline void reset_voices(SlideCore *core) {
+    VoiceState *voices = &core->voices;
+    voices->sliding = 0;
+    voices->params_valid = false;
+    for (uint8_t voice = 0; voice < MAX_VOICES; voice++) {
+        note_stack_clear(&voices->stacks[voice]);
+    }
+    memset(voices->key_to_voice, NO_VOICE, sizeof(voices->key_to_voice));
+}
+
+static inline uint8_t voice_channel(SlideCore *core, uint8_t voice) {
+    // In MPE mode, the first channel is the zone's master channel.
+    return core->mode == VOICE_MODE_MPE ? voice + 1 : voice;
+}
+
+// Stops the notes playing in the current mode and forgets all held notes.
+static inline void stop_all_notes(
+        SlideCore *core, uint32_t output_capacity) {
+    if (core->mode == VOICE_MODE_MONO) {
+        if (core->note_stack.top != NO_KEY) {
+            stop_note(core, 0, output_capacity);
+        }
+        clear_stack(core);
+        core->is_sliding = false;
+        return;
+    }
+
+    VoiceState *voices = &core->voices;
+    for (uint8_t voice = 0; voice < MAX_VOICES; voice++) {
+        if (voices->stacks[voice].top == NO_KEY) continue;
+        send_note(
+            core, LV2_MIDI_MSG_NOTE_OFF | voice_channel(core, voice),
+            voices->key_playing[voice], 0, 0, output_capacity
+        );
+    }
+    reset_voices(core);
+}
+
+static inline void update_voice_mode(
+        SlideCore *core, uint32_t output_capacity) {
+    VoiceMode mode = VOICE_MODE_MONO;
+    int n_voices = *core->mpe_channels;
+    if (n_voices < 1) n_voices = 1;
+    if (n_voices > MAX_MPE_CHANNELS) n_voices = MAX_MPE_CHANNELS;
+    switch ((int)*core->voice_mode) {
+        case VOICE_MODE_MPE:
+            mode = VOICE_MODE_MPE;
+            break;
+        case VOICE_MODE_CHANNEL:
+            mode = VOICE_MODE_CHANNEL;
+            n_voices = MAX_VOICES;
+            break;
+    }
+
+    bool changed = mode != core->mode || (
+        mode == VOICE_MODE_MPE && n_voices != core->n_voices
+    );
+    core->n_voices = n_voices;
+    if (!changed) return;
+
+    // Notes can't be moved to a different set of channels, so they are
+    // stopped, and must be played again to be heard.
+    stop_all_notes(core, output_capacity);
+    core->mode = mode;
+    core->mpe_config_pending = mode == VOICE_MODE_MPE;
+}
+
+static inline void update_output_format(
+        SlideCore *core, uint32_t output_capacity) {
+    OutputFormat format = OUTPUT_FORMAT_MIDI1;
+    if ((int)*core->output_format == OUTPUT_FORMAT_UMP) {
+        format = OUTPUT_FORMAT_UMP;
+    }
+    if (format == core->format) return;
+
+    // Notes are stopped in the format they were started in, and must be
+    // played again to be heard.
+    stop_all_notes(core, output_capacity);
+    core->format = format;
+    core->pending_bend_channels = 0;
+    core->mpe_config_pending = core->mode == VOICE_MODE_MPE;
+}
+
+static inline void send_controller(
+        SlideCore *core, uint8_t channel, uint8_t controller, uint8_t value,
+        uint32_t output_capacity) {
+    MidiEvent event;
+    init_midi_event(core, &event, 0);
+    event.data.message[0] = LV2_MIDI_MSG_CONTROLLER | channel;
+    event.data.message[1] = controller;
+    event.data.message[2] = value;
+    send_midi_message(core, &event, PRIORITY_NOTE, output_capacity);
+}
+
+// Sets a registered parameter number. `lsb_value` is only sent if it isn't
+// negative.
+static inline void send_rpn(
+        SlideCore *core, uint8_t channel, uint8_t rpn, uint8_t msb_value,
+        int lsb_value, uint32_t output_capacity) {
+    if (core->format == OUTPUT_FORMAT_UMP) {
+        // MIDI 2.0 sets the parameter with one message, whose value starts
+        // with the 7-bit data entry MSB and LSB.
+        uint32_t value = (uint32_t)msb_value << 25;
+        if (lsb_value >= 0) value |= (uint32_t)lsb_value << 18;
+        MidiEvent event;
+        init_ump_event(
+            core, &event, 0, UMP_STATUS_REGISTERED_CONTROLLER | channel,
+            rpn, value
+        );
+        send_midi_message(core, &event, PRIORITY_NOTE, output_capacity);
+        return;
+    }
+
+    send_controller(
+        core, channel, LV2_MIDI_CTL_RPN_MSB, 0, output_capacity
+    );
+    send_controller(
+        core, channel, LV2_MIDI_CTL_RPN_LSB, rpn, output_capacity
+    );
+    send_controller(
+        core, channel, LV2_MIDI_CTL_MSB_DATA_ENTRY, msb_value,
+        output_capacity
+    );
+    if (lsb_value >= 0) {
+        send_controller(
+            core, channel, LV2_MIDI_CTL_LSB_DATA_ENTRY, lsb_value,
+            output_capacity
+        );
+    }
+    // Deselect the parameter so later data entry messages don't change it.
+    send_controller(
+        core, channel, LV2_MIDI_CTL_RPN_MSB, 0x7F, output_capacity
+    );
+    send_controller(
+        core, channel, LV2_MIDI_CTL_RPN_LSB, 0x7F, output_capacity
+    );
+}
+
+// Sends the MPE Configuration Message for a lower zone with one member
+// channel per voice, then sets the pitch bend range of each member channel to
+// the semitone distance. If the output buffer doesn't have room for all of
+// it, it is sent in the next block instead.
+static inline void send_mpe_config(
+        SlideCore *core, uint32_t output_capacity) {
+    uint8_t n_voices = core->n_voices;
+    uint32_t n_events = 5 + 6 * n_voices;
+    if (core->format == OUTPUT_FORMAT_UMP) n_events = 1 + n_voices;
+    uint32_t event_size = lv2_atom_pad_size(sizeof(LV2_Atom_Event) + 8);
+    uint32_t used = core->output->atom.size;
+    if (used > output_capacity) return;
+    if (n_events * event_size > output_capacity - used) return;
+    core->mpe_config_pending = false;
+
+    const uint8_t rpn_bend_range = 0;
+    const uint8_t rpn_mpe_config = 6;
+    send_rpn(core, 0, rpn_mpe_config, n_voices, -1, output_capacity);
+
+    float distance = core->slide_semitone_distance;
+    int semitones = distance;
+    int cents = lrintf((distance - semitones) * 100);
+    if (cents >= 100) {
+        semitones++;
+        cents = 0;
+    }
+    if (semitones > 127) semitones = 127;
+    for (uint8_t voice = 0; voice < n_voices; voice++) {
+        send_rpn(
+            core, voice + 1, rpn_bend_range, semitones, cents,
+            output_capacity
+        );
+    }
+}
+
+// Records the state of a voice before it is first changed in the current
+// group.
+static inline void touch_voice(SlideCore *core, uint8_t voice) {
+    VoiceGroup *group = &core->voice_group;
+    uint16_t voice_bit = 1 << voice;
+    if (group->touched & voice_bit) return;
+    group->touched |= voice_bit;
+
+    NoteStack *stack = &core->voices.stacks[voice];
+    uint8_t stack_size = note_stack_size(stack);
+    group->old_stack_size[voice] = stack_size;
+    group->old_slide_base[voice] = 0;
+    group->old_slide_top[voice] = 0;
+    if (stack_size >= 2) {
+        group->old_slide_base[voice] = note_stack_second(stack);
+        group->old_slide_top[voice] = stack->top;
+    }
+}
+
+static inline void remove_from_voice(
+        SlideCore *core, uint8_t channel, uint8_t key) {
+    VoiceState *voices = &core->voices;
+    // In per-channel mode, a key can be held on several channels at once.
+    uint8_t voice = channel;
+    if (core->mode == VOICE_MODE_MPE) voice = voices->key_to_voice[key];
+    if (voice == NO_VOICE || !note_stack_has(&voices->stacks[voice], key)) {
+        report_diagnostic(core, DIAG_NOTE_NOT_IN_STACK, key);
+        return;
+    }
+
+    touch_voice(core, voice);
+    voices->key_to_voice[key] = NO_VOICE;
+    note_stack_remove(&voices->stacks[voice], key);
+}
+
+static inline void clear_voice(SlideCore *core, uint8_t voice) {
+    VoiceState *voices = &core->voices;
+    NoteStack *stack = &voices->stacks[voice];
+    touch_voice(core, voice);
+    for (int i = 0; i < 2; i++) {
+        for (uint64_t keys = stack->keys[i]; keys != 0; keys &= keys - 1) {
+            uint8_t key = i * 64 + __builtin_ctzll(keys);
+            voices->key_to_voice[key] = NO_VOICE;
+        }
+    }
+    note_stack_clear(stack);
+}
+
+static inline void clear_voices(SlideCore *core, uint8_t channel) {
+    NoteStack *stacks = core->voices.stacks;
+    if (core->mode == VOICE_MODE_CHANNEL) {
+        if (stacks[channel].top != NO_KEY) clear_voice(core, channel);
+        return;
+    }
+    for (uint8_t voice = 0; voice < core->n_voices; voice++) {
+        if (stacks[voice].top != NO_KEY) clear_voice(core, voice);
+    }
+}
+
+// Finds the voice a new note should slide on: among the voices that are
+// holding notes, haven't been given a note in this group, and play a note
+// within the pitch bend range of the new note, the one whose top note is
+// closest to the new note.
+static inline uint8_t find_slide_voice(SlideCore *core, uint8_t key) {
+    VoiceState *voices = &core->voices;
+    uint16_t added = core->voice_group.added;
+    float semitone_distance = core->slide_semitone_distance;
+    uint8_t best_voice = NO_VOICE;
+    int best_distance = 128;
+
+    for (uint8_t voice = 0; voice < core->n_voices; voice++) {
+        uint8_t top = voices->stacks[voice].top;
+        if (top == NO_KEY || (added & (1 << voice))) continue;
+        int offset = (int)key - voices->key_playing[voice];
+        if (abs(offset) > semitone_distance) continue;
+        int distance = abs((int)key - top);
+        if (distance < best_distance) {
+            best_voice = voice;
+            best_distance = distance;
+        }
+    }
+    return best_voice;
+}
+
+// Finds a voice for a new note that doesn't slide. Free voices that have been
+// unused the longest are preferred; otherwise, the voice that was given a
+// note the longest ago is stolen.
+static inline uint8_t allocate_voice(SlideCore *core) {
+    VoiceState *voices = &core->voices;
+    uint16_t added = core->voice_group.added;
+    uint8_t best_voice = NO_VOICE;
+    bool best_free = false;
+
+    for (uint8_t voice = 0; voice < core->n_voices; voice++) {
+        if (added & (1 << voice)) continue;
+        bool free = voices->stacks[voice].top == NO_KEY;
+        if (best_voice != NO_VOICE && (
+            best_free > free || (best_free == free &&
+            voices->last_used[voice] >= voices->last_used[best_voice])
+        )) {
+            continue;
+        }
+        best_voice = voice;
+        best_free = free;
+    }
+
+    if (best_voice != NO_VOICE && !best_free) clear_voice(core, best_voice);
+    return best_voice;
+}
+
+// Finds the voice for a new note in MPE mode. Returns NO_VOICE if the note
+// can't be played.
+static inline uint8_t assign_mpe_voice(SlideCore *core, uint8_t key) {
+    if (core->voices.key_to_voice[key] != NO_VOICE) {
+        report_diagnostic(core, DIAG_NOTE_IN_STACK, key);
+        return NO_VOICE;
+    }
+
+    uint8_t voice = find_slide_voice(core, key);
+    if (voice == NO_VOICE) voice = allocate_voice(core);
+    if (voice == NO_VOICE) report_diagnostic(core, DIAG_NO_MPE_VOICE, key);
+    return voice;
+}
+
+static inline void add_to_voice(SlideCore *core, const NoteOn *note) {
+    VoiceState *voices = &core->voices;
+    VoiceGroup *group = &core->voice_group;
+    uint8_t key = note->key;
+    uint8_t voice = note->channel;
+    if (core->mode == VOICE_MODE_MPE) {
+        voice = assign_mpe_voice(core, key);
+        if (voice == NO_VOICE) return;
+    } else if (note_stack_has(&voices->stacks[voice], key)) {
+        report_diagnostic(core, DIAG_NOTE_IN_STACK, key);
+        return;
+    }
+
+    NoteStack *stack = &voices->stacks[voice];
+    touch_voice(core, voice);
+    uint16_t voice_bit = 1 << voice;
+    // In per-channel mode, a voice can be given several notes in one group.
+    if (!(group->added & voice_bit)) {
+        group->released_stack_size[voice] = note_stack_size(stack);
+    }
+    group->added |= voice_bit;
+    note_stack_push(stack, key, note->velocity);
+    stack->length[key] = note->length;
+    update_stack_high_water(core, stack);
+    if (core->mode == VOICE_MODE_MPE) voices->key_to_voice[key] = voice;
+    voices->last_used[voice] = ++voices->use_count;
+}
+
+// Computes the parameters of the slide between the top two notes of a voice.
+// Returns false if the slide is outside the pitch bend range.
+static inline bool setup_voice_slide(SlideCore *core, uint8_t voice) {
+    VoiceState *voices = &core->voices;
+    NoteStack *stack = &voices->stacks[voice];
+    uint8_t key = stack->top;
+    uint8_t base_key = note_stack_second(stack);
+    float semitone_distance = core->slide_semitone_distance;
+
+    int key_diff = (int)key - base_key;
+    int key_offset = (int)base_key - voices->key_playing[voice];
+    if (abs(key_offset) > semitone_distance ||
+        abs(key_diff + key_offset) > semitone_distance) {
+        COUNT(core, slides_out_of_range);
+        return false;
+    }
+
+    voices->key_offset[voice] = key_offset;
+    voices->key_diff[voice] = key_diff;
+    voices->phase_increment[voice] = slide_phase_increment(
+        core, stack, &voices->max_advance[voice]
+    );
+    return true;
+}
+
+// Recomputes the parameters of all sliding voices after a change in tempo or
+// controls.
+static inline void update_voice_slides(SlideCore *core) {
+    VoiceState *voices = &core->voices;
+    voices->params_valid = true;
+    for (uint16_t sliding = voices->sliding; sliding != 0;
+         sliding &= sliding - 1) {
+        uint8_t voice = __builtin_ctz(sliding);
+        if (!setup_voice_slide(core, voice)) {
+            voices->sliding &= ~(1 << voice);
+        }
+    }
+}
+
+static inline void set_voice_bend(
+        SlideCore *core, uint8_t voice, int value, uint32_t frames,
+        uint32_t output_capacity) {
+    core->voices.last_bend[voice] = value;
+    uint8_t key = core->voices.key_playing[voice];
+    send_bend(
+        core, voice_channel(core, voice), key, value, frames,
+        output_capacity
+    );
+}
+
+// Sends the bend for a sliding voice's current phase, or ends the slide if
+// the phase is past the end.
+static inline void set_voice_bend_from_slide(
+        SlideCore *core, uint8_t voice, uint32_t frames,
+        uint32_t output_capacity) {
+    VoiceState *voices = &core->voices;
+    bool change_mode = (int)*core->bend_mode == BEND_MODE_CHANGE;
+    int last_bend = voices->last_bend[voice];
+    int64_t key_offset = (
+        voices->key_offset[voice] * ((int64_t)1 << CURVE_VALUE_BITS)
+    );
+    uint64_t phase = voices->phase[voice];
+
+    if (phase > 2 * SLIDE_PHASE_LEG) {
+        voices->sliding &= ~(1 << voice);
+        // As in set_bend_from_slide(), make sure the base note is reached.
+        int bend_value = slide_key_to_bend(core, key_offset);
+        if (bend_value != last_bend) {
+            set_voice_bend(core, voice, bend_value, frames, output_capacity);
+        }
+        return;
+    }
+
+    int64_t progress = slide_progress(
+        core, phase, voices->phase_increment[voice]
+    );
+    int64_t relative_key = key_offset + voices->key_diff[voice] * progress;
+    int bend_value = slide_key_to_bend(core, relative_key);
+    if (change_mode && below_min_bend_step(core, bend_value, last_bend)) {
+        return;
+    }
+    set_voice_bend(core, voice, bend_value, frames, output_capacity);
+}
+
+// Advances all sliding voices by `n_samples` in a single pass. If `send` is
+// true, each voice's bend is then sent at `frames`.
+static inline void step_voices(
+        SlideCore *core, uint32_t n_samples, bool send, uint32_t frames,
+        uint32_t output_capacity) {
+    VoiceState *voices = &core->voices;
+    for (uint16_t sliding = voices->sliding; sliding != 0;
+         sliding &= sliding - 1) {
+        uint8_t voice = __builtin_ctz(sliding);
+        voices->phase[voice] = advance_phase(
+            voices->phase[voice], n_samples, voices->phase_increment[voice],
+            voices->max_advance[voice]
+        );
+        if (send) {
+            set_voice_bend_from_slide(core, voice, frames, output_capacity);
+        }
+    }
+}
+
+// Like send_scheduled_bends(), but for all sliding voices. The voices share
+// one schedule, so their bends are sent together.
+static inline void send_scheduled_voice_bends(
+        SlideCore *core, uint32_t n_samples, uint32_t frames,
+        uint32_t output_capacity) {
+    VoiceState *voices = &core->voices;
+    if (!voices->params_valid) update_voice_slides(core);
+    uint32_t interval = core->message_interval;
+    uint32_t position = frames - n_samples;
+
+    while (voices->sliding) {
+        uint32_t since_sent = core->samples_since_sent;
+        uint32_t until_due = since_sent < interval ? interval - since_sent : 0;
+        if (until_due >= n_samples) {
+            core->samples_since_sent += n_samples;
+            step_voices(core, n_samples, false, 0, output_capacity);
+            return;
+        }
+
+        position += until_due;
+        n_samples -= until_due;
+        core->samples_since_sent = 0;
+        step_voices(core, until_due, true, position, output_capacity);
+    }
+}
+
+// Like end_mono_group(), but for a single voice.
+static inline void end_voice(
+        SlideCore *core, uint8_t voice, uint32_t frames,
+        uint32_t output_capacity) {
+    VoiceState *voices = &core->voices;
+    VoiceGroup *group = &core->voice_group;
+    uint16_t voice_bit = 1 << voice;
+    NoteStack *stack = &voices->stacks[voice];
+    uint8_t stack_size = note_stack_size(stack);
+    uint8_t old_stack_size = group->old_stack_size[voice];
+    bool added = group->added & voice_bit;
+    uint8_t released_size = stack_size;
+    if (added) released_size = group->released_stack_size[voice];
+
+    // The top note before the new notes were added.
+    uint8_t released_top = stack->top;
+    for (uint8_t i = released_size; i < stack_size; i++) {
+        released_top = stack->prev[released_top];
+    }
+
+    bool note_stopped = old_stack_size > 0 && released_size == 0;
+    bool force_bend_update = note_stopped || (old_stack_size >= 2 && (
+        released_size < 2 ||
+        group->old_slide_base[voice] != stack->prev[released_top] ||
+        group->old_slide_top[voice] != released_top
+    ));
+
+    if (force_bend_update) voices->sliding &= ~voice_bit;
+    bool note_started = released_size == 0 && stack_size > 0;
+    if (added) {
+        move_primary_to_stack_top(stack, stack_size - released_size);
+        voices->phase[voice] = 0;
+        force_bend_update = true;
+        if (stack_size >= 2) voices->sliding |= voice_bit;
+    }
+
+    if (!force_bend_update) return;
+    // Bends are scheduled relative to the last bend sent, unless other voices
+    // are already sliding on the shared schedule.
+    if ((voices->sliding & ~voice_bit) == 0) core->samples_since_sent = 0;
+
+    uint8_t channel = voice_channel(core, voice);
+    if (note_stopped) {
+        uint8_t key = voices->key_playing[voice];
+        send_note(
+            core, LV2_MIDI_MSG_NOTE_OFF | channel, key, 0, frames,
+            output_capacity
+        );
+    }
+    if (stack_size == 0) return;
+
+    if (note_started) {
+        uint8_t key = stack->top;
+        if (stack_size >= 2) key = note_stack_second(stack);
+        uint8_t velocity = output_velocity(core, stack->velocity[key]);
+        voices->key_playing[voice] = key;
+        set_voice_bend(core, voice, 0, frames, output_capacity);
+        send_note(
+            core, LV2_MIDI_MSG_NOTE_ON | channel, key, velocity, frames,
+            output_capacity
+        );
+        // Several notes may have been started at once, in which case the
+        // voice slides from the note played to the primary note.
+        if (!(voices->sliding & voice_bit)) return;
+        if (!setup_voice_slide(core, voice)) voices->sliding &= ~voice_bit;
+        return;
+    }
+
+    if (!(voices->sliding & voice_bit)) {
+        int relative_key = (int)stack->top - voices->key_playing[voice];
+        if (abs(relative_key) > core->slide_semitone_distance) return;
+        int bend_value = relative_key_to_bend(core, relative_key);
+        set_voice_bend(core, voice, bend_value, frames, output_capacity);
+        return;
+    }
+
+    if (!setup_voice_slide(core, voice)) {
+        voices->sliding &= ~voice_bit;
+        return;
+    }
+    set_voice_bend_from_slide(core, voice, frames, output_capacity);
+}
+
+// Like end_mono_group(), for MPE and per-channel mode. In MPE mode, each
+// "note on" message in the group either slides an existing voice or starts a
+// new one; in per-channel mode, it is added to its channel's voice.
+static inline void end_voice_group(
+        SlideCore *core, uint32_t frames, uint32_t output_capacity) {
+    EventGroup *group = &core->group;
+    for (uint16_t i = 0; i < group->note_ons_size; i++) {
+        NoteOn *note = &group->note_ons[i];
+        group->key_note_on_channels[note->key] = 0;
+        add_to_voice(core, note);
+    }
+
+    for (uint16_t touched = core->voice_group.touched; touched != 0;
+         touched &= touched - 1) {
+        end_voice(core, __builtin_ctz(touched), frames, output_capacity);
+    }
+}
+
+// Reads a numeric atom. Returns false if `atom` is null or not a number.
+static inline bool read_number(
+        SlideCore *core, const LV2_Atom *atom, double *value) {
+    if (atom == NULL) return false;
+    SlideURIs *uris = &core->uris;
+    if (atom->type == uris->atom_Float) {
+        *value = ((const LV2_Atom_Float *)atom)->body;
+    } else if (atom->type == uris->atom_Double) {
+        *value = ((const LV2_Atom_Double *)atom)->body;
+    } else if (atom->type == uris->atom_Int) {
+        *value = ((const LV2_Atom_Int *)atom)->body;
+    } else if (atom->type == uris->atom_Long) {
+        *value = ((const LV2_Atom_Long *)atom)->body;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static inline void update_samples_per_beat(SlideCore *core) {
+    TransportState *transport = &core->transport;
+    double speed = transport->speed > 0 ? transport->speed : 1;
+    core->samples_per_beat = (
+        60.0 * core->sample_rate / (transport->beats_per_minute * speed)
+    );
+}
+
+// Scales the part of a slide's phase that was covered in the last `elapsed`
+// samples by `ratio`.
+static inline uint64_t correct_phase(
+        uint64_t phase, uint64_t increment, uint64_t elapsed, double ratio) {
+    if (phase >= SLIDE_PHASE_END) return phase;
+    double covered = (double)increment * elapsed;
+    if (covered > phase) covered = phase;
+    double corrected = phase + (ratio - 1) * covered;
+    if (corrected <= 0) return 0;
+    if (corrected >= SLIDE_PHASE_END) return SLIDE_PHASE_END;
+    return llrint(corrected);
+}
+
+// Slides advance at the tempo from the last position, but the tempo may have
+// changed since then, as in a tempo ramp. Given the number of beats that
+// actually passed in the last `elapsed` samples as a ratio of the number the
+// slides advanced by, this moves the slides to where they should be.
+static inline void correct_slides(
+        SlideCore *core, uint64_t elapsed, double ratio) {
+    if (core->mode == VOICE_MODE_MONO) {
+        if (!core->is_sliding) return;
+        if (!core->slide.valid) setup_slide(core);
+        core->slide_phase = correct_phase(
+            core->slide_phase, core->slide.phase_increment, elapsed, ratio
+        );
+        return;
+    }
+
+    VoiceState *voices = &core->voices;
+    if (!voices->params_valid) update_voice_slides(core);
+    for (uint16_t sliding = voices->sliding; sliding != 0;
+         sliding &= sliding - 1) {
+        uint8_t voice = __builtin_ctz(sliding);
+        voices->phase[voice] = correct_phase(
+            voices->phase[voice], voices->phase_increment[voice], elapsed,
+            ratio
+        );
+    }
+}
+
+// Handles a time:Position object received at `frames`. Properties that are
+// missing keep their previous values.
+static inline void handle_atom_object(
+        SlideCore *core, const LV2_Atom_Object *object, uint32_t frames) {
+    SlideURIs *uris = &core->uris;
+    if (object->body.otype != uris->time_Position) return;
+    const LV2_Atom *bpm_atom = NULL;
+    const LV2_Atom *beat_atom = NULL;
+    const LV2_Atom *frame_atom = NULL;
+    const LV2_Atom *speed_atom = NULL;
+    lv2_atom_object_get(
+        object,
+        uris->time_beatsPerMinute, &bpm_atom,
+        uris->time_beat, &beat_atom,
+        uris->time_frame, &frame_atom,
+        uris->time_speed, &speed_atom,
+        NULL
+    );
+
+    TransportState *transport = &core->transport;
+    uint64_t time = core->sample_time + frames;
+    uint64_t elapsed = time - transport->time;
+    double beat, frame;
+    bool has_beat = read_number(core, beat_atom, &beat);
+    bool has_frame = read_number(core, frame_atom, &frame);
+
+    // If the transport kept playing from the last position, the slides have
+    // advanced by the beats expected at the last tempo. A position that
+    // doesn't follow on from the last one is a relocation (such as a loop or
+    // a seek), which the slides ignore.
+    if (has_beat && transport->has_beat && transport->speed > 0 &&
+        elapsed > 0) {
+        double expected = elapsed * transport->speed;
+        bool relocated = (
+            has_frame && transport->has_frame &&
+            fabs(frame - transport->frame - expected) > 1
+        );
+        double ratio = (
+            (beat - transport->beat) * core->samples_per_beat / elapsed
+        );
+        // Without frames, a large difference is taken to be a relocation.
+        if (!relocated && ratio > 0.5 && ratio < 2) {
+            correct_slides(core, elapsed, ratio);
+        }
+    }
+
+    transport->time = time;
+    transport->has_beat = has_beat;
+    transport->has_frame = has_frame;
+    if (has_beat) transport->beat = beat;
+    if (has_frame) transport->frame = llrint(frame);
+
+    double bpm = transport->beats_per_minute;
+    double speed = transport->speed;
+    double value;
+    if (read_number(core, bpm_atom, &value) && value > 0) bpm = value;
+    if (read_number(core, speed_atom, &value)) speed = value;
+    if (bpm == transport->beats_per_minute && speed == transport->speed) {
+        return;
+    }
+
+    // Slides keep their progress and continue at the new tempo.
+    transport->beats_per_minute = bpm;
+    transport->speed = speed;
+    update_samples_per_beat(core);
+    invalidate_slides(core);
+}
+
+// Records a diagnostic message from the audio thread. Only the first few
+// messages of each kind between reports are kept; the rest are only counted.
+static inline void report_diagnostic(
+        SlideCore *core, DiagKind kind, uint8_t data) {
+    DiagReport *report = &core->diagnostics;
+    if (report->counts[kind]++ >= DIAG_RECORDS_PER_KIND) return;
+    report->records[report->n_records++] = (DiagRecord){
+        .kind = kind,
+        .data = data,
+    };
+}
+
+// Returns the value of the CPU's cycle counter, or 0 if it can't be read.
+static inline uint64_t read_cycle_counter(void) {
+#if defined(MIDISLIDE_NO_COUNTERS)
+    return 0;
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return 0;
+#endif
+}
+
+static inline void update_stack_high_water(
+        SlideCore *core, const NoteStack *stack) {
+#ifndef MIDISLIDE_NO_COUNTERS
+    uint8_t size = note_stack_size(stack);
+    Counters *counters = &core->counters;
+    if (size > counters->stack_high_water) counters->stack_high_water = size;
+#endif
+}
+
+static inline void update_run_cycles(SlideCore *core, uint64_t start) {
+#ifndef MIDISLIDE_NO_COUNTERS
+    uint64_t cycles = read_cycle_counter() - start;
+    Counters *counters = &core->counters;
+    counters->runs++;
+    counters->run_cycles_total += cycles;
+    if (cycles > counters->run_cycles_max) counters->run_cycles_max = cycles;
+#endif
+}
+
+// Writes the counters to the output ports that are connected.
+static inline void send_counters(SlideCore *core) {
+    const Counters *counters = &core->counters;
+    if (core->events_in != NULL) {
+        *core->events_in = counters->events_in;
+    }
+    if (core->events_out != NULL) {
+        *core->events_out = counters->events_out;
+    }
+    if (core->bends_out != NULL) {
+        *core->bends_out = counters->bends_out;
+    }
+    if (core->events_dropped != NULL) {
+        *core->events_dropped = counters->events_dropped;
+    }
+    if (core->stack_high_water != NULL) {
+        *core->stack_high_water = counters->stack_high_water;
+    }
+    if (core->slides_out_of_range != NULL) {
+        *core->slides_out_of_range = counters->slides_out_of_range;
+    }
+    if (core->run_cycles_max != NULL) {
+        *core->run_cycles_max = counters->run_cycles_max;
+    }
+    if (core->run_cycles_avg != NULL) {
+        *core->run_cycles_avg = (
+            counters->runs > 0 ?
+            (double)counters->run_cycles_total / counters->runs : 0
+        );
+    }
+}
+
+// Writes the output statistics to the output ports that are connected.
+static inline void send_output_stats(SlideCore *core) {
+    const OutputStats *stats = &core->output_stats;
+    if (core->bends_merged != NULL) {
+        *core->bends_merged = stats->bends_merged;
+    }
+    if (core->bends_dropped != NULL) {
+        *core->bends_dropped = stats->bends_dropped;
+    }
+    if (core->passthrough_dropped != NULL) {
+        *core->passthrough_dropped = stats->passthrough_dropped;
+    }
+    if (core->notes_delayed != NULL) {
+        *core->notes_delayed = stats->notes_delayed;
+    }
+    if (core->notes_dropped != NULL) {
+        *core->notes_dropped = stats->notes_dropped;
+    }
+}
+
+// Fills `buffer` with `n` samples of a line starting at `start` that changes
+// by `step` each sample. This and fill_constant() are simple enough for the
+// compiler to vectorize.
+static inline void fill_ramp(
+        float *restrict buffer, uint32_t n, float start, float step) {
+    for (uint32_t i = 0; i < n; i++) buffer[i] = start + step * (float)i;
+}
+
+static inline void fill_constant(
+        float *restrict buffer, uint32_t n, float value) {
+    for (uint32_t i = 0; i < n; i++) buffer[i] = value;
+}
+
+// Converts a bend to a pitch CV value.
+static inline float bend_to_cv(SlideCore *core, int64_t bend) {
+    double range = (
+        bend < 0 ? core->bend_range_low : core->bend_range_high
+    );
+    return (
+        bend * core->slide_semitone_distance / range *
+        CV_VOLTS_PER_SEMITONE
+    );
+}
+
+// The voice the pitch CV follows in MPE and per-channel mode: the one that
+// most recently started a note.
+static inline uint8_t pitch_cv_voice(SlideCore *core) {
+    const VoiceState *voices = &core->voices;
+    uint8_t result = 0;
+    for (uint8_t voice = 1; voice < core->n_voices; voice++) {
+        if (voices->last_used[voice] > voices->last_used[result]) {
+            result = voice;
+        }
+    }
+    return result;
+}
+
+static inline void begin_pitch_cv(SlideCore *core, uint32_t n_samples) {
+    core->cv.position = 0;
+    core->cv.n_samples = n_samples;
+    capture_pitch_cv(core);
+}
+
+// Records the current pitch, which the pitch CV follows until the next call.
+// Slides that are in progress are rendered as they continue.
+static inline void capture_pitch_cv(SlideCore *core) {
+    if (core->pitch_cv == NULL) return;
+    PitchCvState *cv = &core->cv;
+    if (core->mode == VOICE_MODE_MONO) {
+        SlideParams *slide = &core->slide;
+        if (core->is_sliding && !slide->valid) setup_slide(core);
+        cv->sliding = core->is_sliding && slide->in_range;
+        cv->offset = bend_to_cv(core, core->last_bend);
+        cv->phase = core->slide_phase;
+        cv->phase_increment = slide->phase_increment;
+        cv->key_offset = slide->key_offset;
+        cv->key_diff = slide->key_diff;
+        return;
+    }
+
+    VoiceState *voices = &core->voices;
+    uint8_t voice = pitch_cv_voice(core);
+    if (!voices->params_valid) update_voice_slides(core);
+    cv->sliding = voices->sliding >> voice & 1;
+    cv->offset = bend_to_cv(core, voices->last_bend[voice]);
+    cv->phase = voices->phase[voice];
+    cv->phase_increment = voices->phase_increment[voice];
+    cv->key_offset = voices->key_offset[voice];
+    cv->key_diff = voices->key_diff[voice];
+}
+
+// Renders `n` samples of the slide in the pitch CV state to `buffer`.
+static inline void render_slide_cv(
+        SlideCore *core, float *buffer, uint32_t n) {
+    PitchCvState *cv = &core->cv;
+    const uint64_t segment = SLIDE_PHASE_LEG >> CURVE_TABLE_BITS;
+    const double scale = CV_VOLTS_PER_SEMITONE / (1 << CURVE_VALUE_BITS);
+    const double key_offset = cv->key_offset * (double)(1 << CURVE_VALUE_BITS);
+
+    while (n > 0) {
+        uint64_t phase = cv->phase;
+        if (phase >= 2 * SLIDE_PHASE_LEG) {
+            // The slide has returned to the base note.
+            fill_constant(buffer, n, cv->key_offset * CV_VOLTS_PER_SEMITONE);
+            return;
+        }
+
+        // Between entries of the curve table, the curve is linear, so each
+        // part of the slide between them is a line.
+        uint64_t next = (phase / segment + 1) * segment;
+        uint64_t increment = cv->phase_increment;
+        uint64_t until_next = (next - phase + increment - 1) / increment;
+        uint32_t count = until_next < n ? until_next : n;
+
+        // On the way back, the curve is followed in reverse.
+        bool rising = phase < SLIDE_PHASE_LEG;
+        uint64_t leg_phase = rising ? phase : 2 * SLIDE_PHASE_LEG - phase;
+        uint64_t segment_start = rising ? phase : 2 * SLIDE_PHASE_LEG - next;
+        uint32_t index = segment_start / segment;
+        const uint32_t *table = &core->curve_table[index];
+        double slope = (double)(table[1] - table[0]) / segment;
+        double progress = table[0] + slope * (leg_phase - index * segment);
+        double step = slope * increment * (rising ? 1 : -1);
+        fill_ramp(
+            buffer, count, (key_offset + cv->key_diff * progress) * scale,
+            cv->key_diff * step * scale
+        );
+
+        buffer += count;
+        n -= count;
+        cv->phase = phase + count * increment;
+    }
+}
+
+// Renders the pitch CV from the last rendered sample up to `frames`.
+static inline void render_pitch_cv(SlideCore *core, uint32_t frames) {
+    PitchCvState *cv = &core->cv;
+    if (core->pitch_cv == NULL) return;
+    if (frames > cv->n_samples) frames = cv->n_samples;
+    if (frames <= cv->position) return;
+    float *buffer = core->pitch_cv + cv->position;
+    uint32_t n = frames - cv->position;
+    cv->position = frames;
+    if (cv->sliding) {
+        render_slide_cv(core, buffer, n);
+    } else {
+        fill_constant(buffer, n, cv->offset);
+    }
+}
+
+void slide_core_report_diagnostic(
+        SlideCore *core, DiagKind kind, uint8_t data) {
+    report_diagnostic(core, kind, data);
+}
+
+void slide_core_log_diagnostics(
+        const DiagReport *report, SlideLogFunction *log, void *handle) {
+    static const char *const messages[DIAG_COUNT] = {
+        [DIAG_NO_MPE_VOICE] = "No free MPE voice for note %u; note ignored.",
+        [DIAG_NOTE_IN_STACK] = "Note %u is already in stack.",
+        [DIAG_NOTE_NOT_IN_STACK] = "Note %u is not in stack.",
+        [DIAG_OUTPUT_FULL] = (
+            "Could not append atom event (status byte 0x%02x)."
+        ),
+        [DIAG_LOOKAHEAD_FULL] = (
+            "Lookahead buffer is full; event dropped (status byte 0x%02x)."
+        ),
+        [DIAG_TRACE_FULL] = "Trace buffer is full; record dropped.",
+    };
+
+    char message[128];
+    char line[160];
+    for (uint32_t i = 0; i < report->n_records; i++) {
+        const DiagRecord *record = &report->records[i];
+        if (record->kind >= DIAG_COUNT) continue;
+        snprintf(
+            message, sizeof(message), messages[record->kind], record->data
+        );
+        snprintf(line, sizeof(line), "Error: %s\n", message);
+        log(handle, false, line);
+    }
+
+    for (int kind = 0; kind < DIAG_COUNT; kind++) {
+        uint32_t count = report->counts[kind];
+        if (count <= DIAG_RECORDS_PER_KIND) continue;
+        snprintf(
+            line, sizeof(line),
+            "Error: %" PRIu32 " similar messages suppressed.\n",
+            count - DIAG_RECORDS_PER_KIND
+        );
+        log(handle, false, line);
+    }
+}
+
+void slide_core_log_output_stats(
+        const OutputStats *stats, SlideLogFunction *log, void *handle) {
+    if (stats->bends_merged == 0 && stats->bends_dropped == 0 &&
+        stats->passthrough_dropped == 0 && stats->notes_delayed == 0 &&
+        stats->notes_dropped == 0) {
+        return;
+    }
+
+    char line[256];
+    snprintf(
+        line, sizeof(line),
+        "Warning: Output buffer was full: %" PRIu32 " bends merged, "
+        "%" PRIu32 " bends dropped, %" PRIu32 " passthrough events dropped, "
+        "%" PRIu32 " notes delayed, %" PRIu32 " notes dropped.\n",
+        stats->bends_merged, stats->bends_dropped,
+        stats->passthrough_dropped, stats->notes_delayed,
+        stats->notes_dropped
+    );
+    log(handle, true, line);
+}
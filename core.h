@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The slide engine itself, independent of any host. It processes one block
+// at a time, reading and writing event sequences in the LV2 atom layout,
+// with URIDs chosen by the caller. The LV2 plugin (midislide.c) and the
+// plain C interface in engine.h are thin wrappers around it.
+
+#ifndef CORE_H
+#define CORE_H
+
+#include "ports.h"
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Event type of the output in OUTPUT_FORMAT_UMP. The body of each event is
+// one Universal MIDI Packet, as 32-bit words in native byte order.
+#define MIDISLIDE_UMP_EVENT_URI \
+    "https://taylor.fish/plugins/midislide#UmpEvent"
+
+// URIDs of the types the core reads and writes. Any distinct nonzero values
+// can be used, as long as the input uses the same ones.
+typedef struct {
+    LV2_URID midi_Event;
+    LV2_URID ump_Event;
+    LV2_URID atom_Float;
+    LV2_URID atom_Double;
+    LV2_URID atom_Int;
+    LV2_URID atom_Long;
+    LV2_URID time_Position;
+    LV2_URID time_beatsPerMinute;
+    LV2_URID time_beat;
+    LV2_URID time_frame;
+    LV2_URID time_speed;
+    LV2_URID atom_Object;
+    LV2_URID atom_Blank;
+    LV2_URID atom_Resource;
+} SlideURIs;
+
+// Value of a NoteStack link that doesn't point to a key.
+#define NO_KEY 0xFF
+
+// Held notes, in the order they were pressed. The notes are linked by key, so
+// notes can be added and removed, and the top two notes found, in constant
+// time. Only the entries for keys in the stack are valid.
+typedef struct {
+    // Bit (key % 64) of keys[key / 64] is set if `key` is in the stack.
+    uint64_t keys[2];
+    // The most recently pressed note, or NO_KEY if the stack is empty.
+    uint8_t top;
+    // The note pressed before and after each note, or NO_KEY.
+    uint8_t prev[128];
+    uint8_t next[128];
+    uint8_t velocity[128];
+    // Length of each note in beats, if known from lookahead; otherwise 0.
+    float length[128];
+} NoteStack;
+
+typedef enum {
+    ACTION_UNKNOWN,
+    ACTION_NOTE_ON,
+    ACTION_NOTE_OFF,
+    ACTION_ALL_NOTES_OFF,
+} MidiAction;
+
+typedef struct {
+    LV2_Atom_Event event;
+    // A MIDI 1.0 message, or a Universal MIDI Packet in OUTPUT_FORMAT_UMP.
+    union {
+        uint8_t message[3];
+        uint32_t ump[2];
+    } data;
+} MidiEvent;
+
+// When the output buffer is nearly full, lower-priority messages are dropped
+// first.
+typedef enum {
+    PRIORITY_PASSTHROUGH,
+    PRIORITY_BEND,
+    PRIORITY_NOTE,
+} MessagePriority;
+
+// Space in the output buffer that only "note on" and "note off" messages may
+// use, in events.
+#define NOTE_RESERVE_EVENTS 2
+
+// Maximum number of "note off" messages that can be delayed until the next
+// block because the output buffer was full.
+#define MAX_PENDING_NOTES 8
+
+// Counts of messages affected by a full output buffer. They are reported
+// through output control ports and reset when the plugin is activated.
+typedef struct {
+    // Bends that replaced the value of a bend with the same timestamp.
+    uint32_t bends_merged;
+    // Bends that were replaced by a later bend before they could be sent.
+    uint32_t bends_dropped;
+    uint32_t passthrough_dropped;
+    // "Note off" messages that were sent at the start of the next block.
+    uint32_t notes_delayed;
+    uint32_t notes_dropped;
+} OutputStats;
+
+// Live statistics, reported through the output control ports at the end of
+// each block and reset when the plugin is activated. They are only updated
+// by the audio thread. If MIDISLIDE_NO_COUNTERS is defined, they are
+// compiled out and always zero.
+typedef struct {
+    uint64_t events_in;
+    uint64_t events_out;
+    uint64_t bends_out;
+    // Events dropped because the output or lookahead buffer was full.
+    uint64_t events_dropped;
+    // Most notes held at once in a single note stack.
+    uint8_t stack_high_water;
+    // Slides not played because their notes are further apart than the
+    // pitch bend range.
+    uint64_t slides_out_of_range;
+    uint64_t runs;
+    // Cycles spent in run(), as counted by the CPU's cycle counter.
+    uint64_t run_cycles_total;
+    uint64_t run_cycles_max;
+} Counters;
+
+typedef enum {
+    // Slide bends are sent at a fixed rate.
+    BEND_MODE_FIXED,
+    // Slide bends are computed at the same rate, but only sent when the
+    // value has changed by at least the minimum step.
+    BEND_MODE_CHANGE,
+} BendMode;
+
+typedef enum {
+    SLIDE_CURVE_LINEAR,
+    // Starts slowly and speeds up.
+    SLIDE_CURVE_EXPONENTIAL,
+    // Starts quickly and slows down.
+    SLIDE_CURVE_LOGARITHMIC,
+    // Starts and ends slowly.
+    SLIDE_CURVE_S,
+    SLIDE_CURVE_COUNT,
+} SlideCurve;
+
+// Returns the value of a slide curve, from 0 to 1, at `x` (also from 0 to 1).
+// midislide-accuracy uses it as the exact curve.
+static inline float curve_value(SlideCurve curve, double x) {
+    // Higher values make the exponential and logarithmic curves steeper.
+    const double steepness = 4;
+    switch (curve) {
+        case SLIDE_CURVE_EXPONENTIAL:
+            return expm1(steepness * x) / expm1(steepness);
+        case SLIDE_CURVE_LOGARITHMIC:
+            return log1p(expm1(steepness) * x) / steepness;
+        case SLIDE_CURVE_S:
+            return x * x * (3 - 2 * x);
+        default:
+            return x;
+    }
+}
+
+// Number of segments in the slide curve table (log 2). Values between entries
+// are linearly interpolated.
+#define CURVE_TABLE_BITS 8
+#define CURVE_TABLE_SIZE (1 << CURVE_TABLE_BITS)
+
+// Fractional bits of curve table values and of semitone offsets computed from
+// them.
+#define CURVE_VALUE_BITS 24
+
+// Fractional bits of the pitch-bend-units-per-semitone factors, for 14-bit
+// and 32-bit bends. 32-bit bends use fewer bits so that the product of a
+// factor and a semitone offset fits in 64 bits.
+#define BEND_SCALE_BITS 16
+#define BEND_SCALE_BITS_32 7
+
+// Slide progress is a fixed-point phase. One leg of a slide (from the base
+// note to the top note, or back) is 1 << SLIDE_LEG_BITS.
+#define SLIDE_LEG_BITS 48
+#define SLIDE_PHASE_LEG ((uint64_t)1 << SLIDE_LEG_BITS)
+// Any phase past both legs; the slide has returned to the base note.
+#define SLIDE_PHASE_END (2 * SLIDE_PHASE_LEG + 1)
+
+// Values that stay the same for the duration of a slide, computed when the
+// slide starts so that each bend only needs a phase step and a table lookup.
+typedef struct {
+    // Whether the fields below match the current slide and control values.
+    bool valid;
+    // Whether both ends of the slide are within the pitch bend range.
+    bool in_range;
+    // Phase added per sample.
+    uint64_t phase_increment;
+    // Advancing by at least this many samples always ends the slide.
+    uint32_t max_advance;
+    // Start and span of the slide, in semitones relative to the note playing.
+    int32_t key_offset;
+    int32_t key_diff;
+} SlideParams;
+
+typedef enum {
+    // One voice, sent on the first MIDI channel.
+    VOICE_MODE_MONO,
+    // One voice per MPE member channel (lower zone).
+    VOICE_MODE_MPE,
+    // One voice per MIDI channel, each playing the notes received on that
+    // channel as in VOICE_MODE_MONO.
+    VOICE_MODE_CHANNEL,
+} VoiceMode;
+
+typedef enum {
+    // MIDI 1.0 messages, with 14-bit channel pitch bends.
+    OUTPUT_FORMAT_MIDI1,
+    // Universal MIDI Packets. Notes, pitch bends and the MPE configuration
+    // are MIDI 2.0 channel voice messages, and pitch bends are 32-bit
+    // per-note pitch bends. Other messages are passed through as MIDI 1.0
+    // messages in Universal MIDI Packets.
+    OUTPUT_FORMAT_UMP,
+} OutputFormat;
+
+// Universal MIDI Packet message types used in OUTPUT_FORMAT_UMP.
+#define UMP_TYPE_SYSTEM 0x1
+#define UMP_TYPE_MIDI1_CHANNEL_VOICE 0x2
+#define UMP_TYPE_DATA_64 0x3
+#define UMP_TYPE_MIDI2_CHANNEL_VOICE 0x4
+
+// Statuses of MIDI 2.0 channel voice messages that MIDI 1.0 doesn't have.
+#define UMP_STATUS_REGISTERED_CONTROLLER 0x20
+#define UMP_STATUS_PER_NOTE_BEND 0x60
+
+// Status byte that ends a system exclusive message.
+#define MIDI_SYSEX_END 0xF7
+
+// Maximum number of voices (one per MIDI channel).
+#define MAX_VOICES 16
+
+// Maximum number of MPE member channels.
+#define MAX_MPE_CHANNELS 15
+
+// Value in VoiceState.key_to_voice for keys not held in any voice.
+#define NO_VOICE 0xFF
+
+// State of the voices in MPE and per-channel modes. Voice i is sent on
+// channel i + 1 (an MPE member channel) or channel i, respectively. This is a
+// structure of arrays so that all sliding voices can be advanced together.
+typedef struct {
+    // Bit i is set if voice i is sliding.
+    uint16_t sliding;
+    // Whether the phase increments match the current tempo and controls.
+    bool params_valid;
+    uint32_t use_count;
+
+    // Slide state, as in SlideCore and SlideParams.
+    uint64_t phase[MAX_VOICES];
+    uint64_t phase_increment[MAX_VOICES];
+    uint32_t max_advance[MAX_VOICES];
+    int32_t key_offset[MAX_VOICES];
+    int32_t key_diff[MAX_VOICES];
+    int32_t last_bend[MAX_VOICES];
+
+    uint8_t key_playing[MAX_VOICES];
+    // Value of use_count when the voice last started a note. Free voices that
+    // have been unused the longest are allocated first.
+    uint32_t last_used[MAX_VOICES];
+    NoteStack stacks[MAX_VOICES];
+    // Only used in MPE mode, where each key is held in at most one voice.
+    uint8_t key_to_voice[128];
+} VoiceState;
+
+// Voice state at the start of the current event group, recorded when a voice
+// is first changed in the group.
+typedef struct {
+    // Bit i is set if voice i has changed in this group.
+    uint16_t touched;
+    // Bit i is set if voice i has been given new notes in this group.
+    uint16_t added;
+    uint8_t old_stack_size[MAX_VOICES];
+    uint8_t old_slide_base[MAX_VOICES];
+    uint8_t old_slide_top[MAX_VOICES];
+    // Stack size after "note off" messages, before new notes were added.
+    uint8_t released_stack_size[MAX_VOICES];
+} VoiceGroup;
+
+// The host's transport, as of the last time:Position object.
+typedef struct {
+    double beats_per_minute;
+    // Transport speed (1 is normal playback, 0 is stopped).
+    double speed;
+    // Whether `beat` and `frame` are known. They are only used to correct
+    // slides for tempo changes between positions, such as tempo ramps.
+    bool has_beat;
+    bool has_frame;
+    double beat;
+    int64_t frame;
+    // Value of SlideCore.sample_time when the position was received.
+    uint64_t time;
+} TransportState;
+
+typedef enum {
+    // Every MPE voice was already given a new note at the same time.
+    DIAG_NO_MPE_VOICE,
+    DIAG_NOTE_IN_STACK,
+    DIAG_NOTE_NOT_IN_STACK,
+    DIAG_OUTPUT_FULL,
+    DIAG_LOOKAHEAD_FULL,
+    DIAG_TRACE_FULL,
+    DIAG_COUNT,
+} DiagKind;
+
+// Maximum number of records of each kind kept between reports.
+#define DIAG_RECORDS_PER_KIND 4
+
+typedef struct {
+    uint8_t kind;
+    // The key for note errors, or the status byte of a dropped message.
+    uint8_t data;
+} DiagRecord;
+
+// Diagnostics collected in the audio thread. The plugin also sends this to
+// its worker (truncated after the last used record), with `kind` set to the
+// kind of worker message.
+typedef struct {
+    uint32_t kind;
+    // Number of occurrences of each kind, including those without a record.
+    uint32_t counts[DIAG_COUNT];
+    uint32_t n_records;
+    DiagRecord records[DIAG_RECORDS_PER_KIND * DIAG_COUNT];
+} DiagReport;
+
+typedef struct {
+    uint8_t key;
+    uint8_t velocity;
+    // Always 0 unless in VOICE_MODE_CHANNEL.
+    uint8_t channel;
+    // Length of the note in beats, or 0 if it isn't known.
+    float length;
+} NoteOn;
+
+// Maximum value of the "Lookahead" control, in milliseconds.
+#define MAX_LOOKAHEAD_MS 2000
+
+// Lookahead buffer bytes per sample of the maximum lookahead, which allows
+// for one MIDI event every 10 samples on average.
+#define LOOKAHEAD_BYTES_PER_SAMPLE 4
+
+// Value in LookaheadBuffer.note_ons for keys without a delayed "note on".
+#define NO_EVENT UINT32_MAX
+
+// An input event held in the lookahead buffer. The event's body follows it.
+typedef struct {
+    // Value of SlideCore.sample_time + frames when the event was received.
+    uint64_t time;
+    // Size of this entry including the body and padding, or 0 if the buffer
+    // wraps to the start here.
+    uint32_t size;
+    // For "note on" messages, the number of samples until the matching "note
+    // off", or 0 if it wasn't received within the lookahead time.
+    uint32_t note_length;
+    LV2_Atom_Event event;
+} DelayedEvent;
+
+// A ring buffer of DelayedEvents. Entries are never split at the end of the
+// buffer, so each event is contiguous. The memory is only allocated once
+// lookahead is turned on (see SLIDE_BUFFER_LOOKAHEAD); until then, `data` is
+// null and lookahead stays off.
+typedef struct {
+    uint8_t *data;
+    uint32_t capacity;
+    uint32_t read;
+    uint32_t write;
+    uint32_t count;
+    // Offset of the delayed "note on" for each channel and key whose "note
+    // off" hasn't been received yet, or NO_EVENT. Allocated with `data`.
+    uint32_t (*note_ons)[128];
+} LookaheadBuffer;
+
+// The pitch CV output is a pitch offset from the note playing, at one volt
+// per octave.
+#define CV_VOLTS_PER_SEMITONE (1.0 / 12)
+
+// State of the pitch CV output. Between the points at which events may change
+// the pitch, the output is rendered from the state recorded at the last one.
+typedef struct {
+    // Number of samples of the current block rendered so far.
+    uint32_t position;
+    uint32_t n_samples;
+    bool sliding;
+    // The offset, in volts, while not sliding.
+    float offset;
+    // Slide state at `position`, as in SlideCore and SlideParams.
+    uint64_t phase;
+    uint64_t phase_increment;
+    int32_t key_offset;
+    int32_t key_diff;
+} PitchCvState;
+
+// State for the group of input events that share the current timestamp.
+typedef struct {
+    uint8_t old_stack_size;
+    uint8_t old_slide_base;
+    uint8_t old_slide_top;
+    // "Note on" messages are deferred until the end of the group. There is at
+    // most one for each key and channel. Allocated in slide_core_init(),
+    // apart from the core, since it is large and only the start is used.
+    NoteOn *note_ons;
+    uint16_t note_ons_size;
+    // Bit i is set if the key has a "note on" on channel i in this group.
+    uint16_t key_note_on_channels[128];
+    // Whether the group has any events that weren't simply forwarded, which
+    // may cause events to be generated at the end of the group.
+    bool has_actions;
+} EventGroup;
+
+// Slots per channel in CoalesceState: one for each controller, then channel
+// pressure and pitch bend.
+#define COALESCE_PRESSURE 128
+#define COALESCE_BEND 129
+#define COALESCE_SLOTS 130
+
+typedef struct {
+    // The last input event in the block with this kind of value.
+    const LV2_Atom_Event *event;
+    // Value of CoalesceState.block when `event` was recorded.
+    uint32_t block;
+} CoalesceSlot;
+
+// State for "Coalesce controllers", which forwards only the last controller,
+// channel pressure and pitch bend value of each kind in a block.
+typedef struct {
+    bool enabled;
+    // Counts blocks, so that slots from earlier blocks are ignored without
+    // clearing them.
+    uint32_t block;
+    // Slots for each channel. Null until coalescing is first turned on (see
+    // SLIDE_BUFFER_COALESCE), and coalescing stays off until then.
+    CoalesceSlot (*slots)[COALESCE_SLOTS];
+} CoalesceState;
+
+typedef struct {
+    // Control ports, connected with slide_core_connect_port().
+    const float *beat_divisor;
+    const float *bend_semitone_distance;
+    const float *forced_velocity;
+    const float *bend_mode;
+    const float *bend_rate;
+    const float *min_bend_step;
+    const float *slide_curve;
+    const float *voice_mode;
+    const float *mpe_channels;
+    const float *lookahead;
+    const float *output_format;
+    const float *coalesce_controllers;
+    float *latency;
+    float *bends_merged;
+    float *bends_dropped;
+    float *passthrough_dropped;
+    float *notes_delayed;
+    float *notes_dropped;
+    float *events_in;
+    float *events_out;
+    float *bends_out;
+    float *events_dropped;
+    float *stack_high_water;
+    float *slides_out_of_range;
+    float *run_cycles_max;
+    float *run_cycles_avg;
+    float *pitch_cv;
+
+    // The sequences of the block being processed.
+    const LV2_Atom_Sequence *input;
+    LV2_Atom_Sequence *output;
+    SlideURIs uris;
+
+    uint32_t sample_rate;
+    // Number of samples processed since the core was activated, counted up
+    // to the current block.
+    uint64_t sample_time;
+    TransportState transport;
+    LookaheadBuffer lookahead_buffer;
+    // Maximum lookahead in samples.
+    uint32_t max_lookahead;
+    // Samples per beat at the current tempo and speed. While the transport is
+    // stopped, slides use the tempo at normal speed.
+    double samples_per_beat;
+    uint32_t samples_since_sent;
+    uint32_t message_interval;
+    float message_rate;
+    OutputFormat format;
+    int last_bend;
+    uint8_t key_playing;
+    bool is_sliding;
+
+    SlideParams slide;
+    uint64_t slide_phase;
+    // Control values the slide parameters and curve table were computed for.
+    float slide_beat_divisor;
+    float slide_semitone_distance;
+    float slide_curve_value;
+    OutputFormat slide_format;
+    // Largest bend below and above the center in the output format.
+    uint32_t bend_range_low;
+    uint32_t bend_range_high;
+    // Pitch bend units per semitone below and above the note playing, with
+    // `bend_scale_bits` fractional bits.
+    uint64_t bend_scale_low;
+    uint64_t bend_scale_high;
+    int bend_scale_bits;
+    // Curve values from 0 to 1, with CURVE_VALUE_BITS fractional bits. Points
+    // into the tables shared by all instances.
+    const uint32_t *curve_table;
+
+    NoteStack note_stack;
+    EventGroup group;
+
+    VoiceMode mode;
+    uint8_t n_voices;
+    VoiceState voices;
+    VoiceGroup voice_group;
+    // Whether the MPE configuration must be sent to the output.
+    bool mpe_config_pending;
+    PitchCvState cv;
+    CoalesceState coalescing;
+
+    // Diagnostics not yet taken by the caller, which should log them and
+    // clear them from time to time (see slide_core_log_diagnostics()).
+    DiagReport diagnostics;
+
+    // The last event appended to the output in this block, if any.
+    LV2_Atom_Event *last_output_event;
+    // Bends that did not fit in the output, by channel.
+    MidiEvent pending_bends[16];
+    // Bit i is set if there is a pending bend for channel i.
+    uint16_t pending_bend_channels;
+    MidiEvent pending_notes[MAX_PENDING_NOTES];
+    uint8_t pending_notes_size;
+    OutputStats output_stats;
+    Counters counters;
+} SlideCore;
+
+// Memory the core only needs once a control turns a feature on. It is not
+// allocated up front, and run() never allocates, so the caller hands it to
+// the core once the control asks for it: directly, with
+// slide_core_allocate_buffers(), where allocating is allowed, or from another
+// thread, with slide_core_new_buffer() and slide_core_set_buffer().
+typedef enum {
+    // The lookahead buffer, needed when the "Lookahead" control is above 0.
+    SLIDE_BUFFER_LOOKAHEAD = 1 << 0,
+    // The slots for "Coalesce controllers".
+    SLIDE_BUFFER_COALESCE = 1 << 1,
+    SLIDE_BUFFER_ALL = SLIDE_BUFFER_LOOKAHEAD | SLIDE_BUFFER_COALESCE,
+} SlideBufferKind;
+
+// Receives one complete line of log output (ending in a newline) from
+// slide_core_log_diagnostics() or slide_core_log_output_stats().
+typedef void SlideLogFunction(void *handle, bool warning, const char *line);
+
+// Sets each control port to its default value.
+void slide_core_default_controls(float controls[PORT_COUNT]);
+
+// Initializes a core that uses the given URIDs. The core must be zeroed
+// beforehand. Returns false if memory can't be allocated.
+bool slide_core_init(
+    SlideCore *core, double sample_rate, const SlideURIs *uris);
+
+// Frees the memory allocated by slide_core_init() and the buffers given to
+// the core.
+void slide_core_destroy(SlideCore *core);
+
+// Returns the SlideBufferKinds (as bits) that the current control values need
+// but the core doesn't have yet. Safe to call from run()'s thread.
+uint32_t slide_core_missing_buffers(const SlideCore *core);
+
+// Allocates each missing buffer among `kinds`. Not real-time safe.
+void slide_core_allocate_buffers(SlideCore *core, uint32_t kinds);
+
+// Allocates a buffer for a core running at `sample_rate`, without touching
+// the core, so it can be done in another thread. Returns null if memory
+// can't be allocated.
+void *slide_core_new_buffer(SlideBufferKind kind, uint32_t sample_rate);
+
+// Gives the core a buffer from slide_core_new_buffer(), which must be missing
+// (so the core never has to free one in run()'s thread). Real-time safe.
+void slide_core_set_buffer(
+    SlideCore *core, SlideBufferKind kind, void *buffer);
+
+// Connects a control or CV port (see ports.h) to `data`. The atom ports are
+// passed to slide_core_run() instead. Every control port must be connected
+// before the core is run; the pitch CV and counter outputs are optional.
+void slide_core_connect_port(SlideCore *core, uint32_t port, void *data);
+
+// Resets the core to its initial state, except for the tempo.
+void slide_core_activate(SlideCore *core);
+
+// Processes one block. The output sequence's atom size is its capacity in
+// bytes, and is set to the size of the output.
+void slide_core_run(
+    SlideCore *core, const LV2_Atom_Sequence *input,
+    LV2_Atom_Sequence *output, uint32_t n_samples);
+
+// Records a diagnostic message, like those the core records itself.
+void slide_core_report_diagnostic(
+    SlideCore *core, DiagKind kind, uint8_t data);
+
+// Logs the diagnostics in `report`.
+void slide_core_log_diagnostics(
+    const DiagReport *report, SlideLogFunction *log, void *handle);
+
+// Logs a summary of the output statistics, if any messages were affected.
+void slide_core_log_output_stats(
+    const OutputStats *stats, SlideLogFunction *log, void *handle);
+
+#endif
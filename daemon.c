@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Applies Midislide to MIDI streamed over a Unix domain socket (see
+// daemon.h for the protocol).
+//
+// All sessions are served by one thread, which waits for input with poll()
+// and never blocks on a socket. Each session runs at most MAX_TURN_BLOCKS
+// blocks before the next session gets a turn, so a client that sends a long
+// batch cannot delay the others by more than that.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "daemon.h"
+#include "engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_BLOCK_SIZE 64
+
+// Blocks a session may run before the other sessions get a turn.
+#define MAX_TURN_BLOCKS 16
+
+// A session is not processed further while this much output is waiting to
+// be sent, so clients that don't read their output cannot use up memory.
+#define MAX_PENDING_OUTPUT (1 << 18)
+
+#define READ_SIZE 65536
+
+typedef struct {
+    int fd;
+    MidislideEngine *engine;
+    uint64_t position;
+
+    // Received records. Records before `next` have been processed, and
+    // records before `scanned` have been checked. While `in_batch` is true,
+    // the records up to the advance record at `batch_end` are processed.
+    uint8_t *input;
+    size_t input_size;
+    size_t input_capacity;
+    size_t scanned;
+    size_t next;
+    bool in_batch;
+    size_t batch_end;
+    uint64_t target;
+
+    // Times that the next records must not be earlier than.
+    uint64_t min_event_time;
+    uint64_t min_advance_time;
+
+    uint8_t *output;
+    size_t output_size;
+    size_t output_sent;
+    size_t output_capacity;
+
+    MidislideEvent *events;
+    size_t events_capacity;
+
+    // Whether the client has closed its end of the connection.
+    bool closed;
+    // Whether the session ran out of blocks in its last turn.
+    bool busy;
+} Session;
+
+typedef struct {
+    double sample_rate;
+    uint32_t block_size;
+    int listener;
+    Session **sessions;
+    size_t n_sessions;
+    size_t sessions_capacity;
+    struct pollfd *fds;
+} Daemon;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void usage(const char *name) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] <socket>\n"
+        "\n"
+        "Options:\n"
+        "  -r <rate>       Sample rate (default: %d)\n"
+        "  -b <frames>     Largest block size (default: %d)\n"
+        "  -R <priority>   Run with this real-time (SCHED_FIFO) priority\n"
+        "\n"
+        "Listens for connections on the Unix domain socket <socket>. Each\n"
+        "connection is a separate session with its own slide state. See\n"
+        "daemon.h for the protocol.\n",
+        name, DEFAULT_SAMPLE_RATE, DEFAULT_BLOCK_SIZE
+    );
+}
+
+static void handle_signal(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool reserve_bytes(uint8_t **buffer, size_t *capacity, size_t size) {
+    if (size <= *capacity) return true;
+    size_t new_capacity = *capacity * 2 + 4096;
+    if (new_capacity < size) new_capacity = size;
+    uint8_t *new_buffer = realloc(*buffer, new_capacity);
+    if (new_buffer == NULL) {
+        fprintf(stderr, "Error: Not enough memory.\n");
+        return false;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool add_session(Daemon *daemon, int fd) {
+    if (daemon->n_sessions >= daemon->sessions_capacity) {
+        size_t capacity = daemon->sessions_capacity * 2 + 8;
+        Session **sessions = realloc(
+            daemon->sessions, capacity * sizeof(*sessions)
+        );
+        struct pollfd *fds = realloc(
+            daemon->fds, (capacity + 1) * sizeof(*fds)
+        );
+        if (sessions != NULL) daemon->sessions = sessions;
+        if (fds != NULL) daemon->fds = fds;
+        if (sessions == NULL || fds == NULL) return false;
+        daemon->sessions_capacity = capacity;
+    }
+
+    Session *session = calloc(1, sizeof(*session));
+    if (session == NULL) return false;
+    session->fd = fd;
+    session->engine = midislide_engine_new(daemon->sample_rate);
+    if (session->engine == NULL) {
+        free(session);
+        return false;
+    }
+    daemon->sessions[daemon->n_sessions++] = session;
+    return true;
+}
+
+static void free_session(Session *session) {
+    close(session->fd);
+    midislide_engine_free(session->engine);
+    free(session->input);
+    free(session->output);
+    free(session->events);
+    free(session);
+}
+
+static void accept_sessions(Daemon *daemon) {
+    while (true) {
+        int fd = accept(daemon->listener, NULL, NULL);
+        if (fd < 0) return;
+        if (!set_nonblocking(fd) || !add_session(daemon, fd)) {
+            fprintf(stderr, "Error: Could not start a session.\n");
+            close(fd);
+        }
+    }
+}
+
+// Reads what the client has sent. Returns false if the session must be
+// closed.
+static bool read_input(Session *session) {
+    size_t space = DAEMON_MAX_BATCH - session->input_size;
+    if (space > READ_SIZE) space = READ_SIZE;
+    if (space == 0) return true;
+    if (!reserve_bytes(
+        &session->input, &session->input_capacity,
+        session->input_size + space
+    )) return false;
+
+    ssize_t size = read(
+        session->fd, session->input + session->input_size, space
+    );
+    if (size < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+    if (size == 0) session->closed = true;
+    session->input_size += size;
+    return true;
+}
+
+// Sends as much pending output as the socket accepts. Returns false if the
+// session must be closed.
+static bool write_output(Session *session) {
+    while (session->output_sent < session->output_size) {
+        ssize_t size = write(
+            session->fd, session->output + session->output_sent,
+            session->output_size - session->output_sent
+        );
+        if (size < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        session->output_sent += size;
+    }
+    session->output_size = 0;
+    session->output_sent = 0;
+    return true;
+}
+
+static bool add_output(
+        Session *session, uint64_t time, DaemonRecordType type,
+        const uint8_t *data, uint32_t size) {
+    // Sent output is dropped once it makes up half the buffer.
+    if (session->output_sent > session->output_capacity / 2) {
+        memmove(
+            session->output, session->output + session->output_sent,
+            session->output_size - session->output_sent
+        );
+        session->output_size -= session->output_sent;
+        session->output_sent = 0;
+    }
+
+    size_t end = session->output_size + sizeof(DaemonRecord) + size;
+    if (!reserve_bytes(&session->output, &session->output_capacity, end)) {
+        return false;
+    }
+    DaemonRecord record = {.time = time, .type = type, .size = size};
+    uint8_t *out = session->output + session->output_size;
+    memcpy(out, &record, sizeof(record));
+    if (size > 0) memcpy(out + sizeof(record), data, size);
+    session->output_size = end;
+    return true;
+}
+
+static inline DaemonRecord read_record(Session *session, size_t offset) {
+    DaemonRecord record;
+    memcpy(&record, session->input + offset, sizeof(record));
+    return record;
+}
+
+static bool check_record(Session *session, const DaemonRecord *record) {
+    bool valid_size;
+    switch (record->type) {
+        case DAEMON_MIDI:
+            valid_size = record->size > 0;
+            break;
+        case DAEMON_TEMPO:
+            valid_size = record->size == sizeof(float);
+            break;
+        case DAEMON_CONTROL:
+            valid_size = record->size == sizeof(uint32_t) + sizeof(float);
+            break;
+        case DAEMON_ADVANCE:
+            valid_size = record->size == 0;
+            break;
+        default:
+            fprintf(stderr, "Error: Unknown record type.\n");
+            return false;
+    }
+    if (!valid_size || record->size > DAEMON_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Invalid record size.\n");
+        return false;
+    }
+
+    uint64_t min_time = session->min_event_time;
+    if (record->type == DAEMON_ADVANCE) min_time = session->min_advance_time;
+    if (record->time < min_time) {
+        fprintf(stderr, "Error: Records are out of order.\n");
+        return false;
+    }
+
+    // Control changes count as events: one at or after the advance time
+    // would never be reached by the batch's blocks.
+    session->min_event_time = record->time;
+    if (record->type == DAEMON_ADVANCE) {
+        session->min_advance_time = record->time;
+    } else {
+        session->min_advance_time = record->time + 1;
+    }
+    return true;
+}
+
+// Looks for the advance record that ends the next batch. Returns false if
+// the session must be closed.
+static bool find_batch(Session *session) {
+    while (!session->in_batch) {
+        size_t offset = session->scanned;
+        if (session->input_size - offset < sizeof(DaemonRecord)) break;
+        DaemonRecord record = read_record(session, offset);
+        size_t end = offset + sizeof(record) + (size_t)record.size;
+        if (record.size > DAEMON_MAX_PAYLOAD || end > DAEMON_MAX_BATCH) {
+            fprintf(stderr, "Error: Record is too large.\n");
+            return false;
+        }
+        if (end > session->input_size) break;
+        if (!check_record(session, &record)) return false;
+        session->scanned = end;
+        if (record.type == DAEMON_ADVANCE) {
+            session->in_batch = true;
+            session->batch_end = offset;
+            session->target = record.time;
+        }
+    }
+    if (!session->in_batch && session->input_size >= DAEMON_MAX_BATCH) {
+        fprintf(stderr, "Error: Batch is too large.\n");
+        return false;
+    }
+    return true;
+}
+
+// Echoes the advance record and drops the finished batch from the input.
+static bool end_batch(Session *session) {
+    if (!add_output(session, session->target, DAEMON_ADVANCE, NULL, 0)) {
+        return false;
+    }
+    size_t consumed = session->batch_end + sizeof(DaemonRecord);
+    memmove(
+        session->input, session->input + consumed,
+        session->input_size - consumed
+    );
+    session->input_size -= consumed;
+    session->scanned -= consumed;
+    session->next = 0;
+    session->in_batch = false;
+    return true;
+}
+
+static bool reserve_events(Session *session, size_t size) {
+    if (size <= session->events_capacity) return true;
+    size_t capacity = session->events_capacity * 2 + 64;
+    MidislideEvent *events = realloc(
+        session->events, capacity * sizeof(*events)
+    );
+    if (events == NULL) {
+        fprintf(stderr, "Error: Not enough memory.\n");
+        return false;
+    }
+    session->events = events;
+    session->events_capacity = capacity;
+    return true;
+}
+
+// Runs the next block of the current batch. The block ends early at control
+// changes. Returns false if the session must be closed.
+static bool run_block(Daemon *daemon, Session *session) {
+    uint64_t start = session->position;
+    uint64_t length = session->target - start;
+    if (length > daemon->block_size) length = daemon->block_size;
+
+    size_t n_events = 0;
+    while (session->next < session->batch_end) {
+        DaemonRecord record = read_record(session, session->next);
+        const uint8_t *payload = (
+            session->input + session->next + sizeof(record)
+        );
+
+        if (record.type == DAEMON_CONTROL) {
+            // The engine reads controls at the start of each block, so the
+            // block ends where the change takes effect. That is after any
+            // events already in this block.
+            uint64_t end = record.time;
+            if (n_events > 0) {
+                uint64_t last = session->events[n_events - 1].time;
+                if (end <= last) end = last + 1;
+            }
+            if (end > start) {
+                if (end - start < length) length = end - start;
+                break;
+            }
+            uint32_t port;
+            float value;
+            memcpy(&port, payload, sizeof(port));
+            memcpy(&value, payload + sizeof(port), sizeof(value));
+            midislide_engine_set_control(session->engine, port, value);
+        } else {
+            if (record.time - start >= length) break;
+            if (!reserve_events(session, n_events + 1)) return false;
+            MidislideEvent *event = &session->events[n_events++];
+            event->time = record.time;
+            event->ump = false;
+            event->bpm = 0;
+            event->size = 0;
+            event->data = NULL;
+            if (record.type == DAEMON_TEMPO) {
+                memcpy(&event->bpm, payload, sizeof(event->bpm));
+            } else {
+                event->size = record.size;
+                event->data = payload;
+            }
+        }
+        session->next += sizeof(record) + record.size;
+    }
+
+    const MidislideEvent *output;
+    size_t n_output;
+    if (!midislide_engine_run(
+        session->engine, session->events, n_events, length, &output,
+        &n_output
+    )) return false;
+    session->position += length;
+
+    for (size_t i = 0; i < n_output; i++) {
+        DaemonRecordType type = output[i].ump ? DAEMON_UMP : DAEMON_MIDI;
+        if (!add_output(
+            session, output[i].time, type, output[i].data, output[i].size
+        )) return false;
+    }
+    return true;
+}
+
+// Gives a session its turn. Returns false if the session must be closed.
+static bool serve_session(Daemon *daemon, Session *session) {
+    session->busy = false;
+    for (uint32_t blocks = 0; ; ) {
+        size_t pending = session->output_size - session->output_sent;
+        if (pending >= MAX_PENDING_OUTPUT) break;
+        if (!find_batch(session)) return false;
+        if (!session->in_batch) break;
+        if (session->position >= session->target) {
+            if (!end_batch(session)) return false;
+            continue;
+        }
+        if (blocks++ == MAX_TURN_BLOCKS) {
+            session->busy = true;
+            break;
+        }
+        if (!run_block(daemon, session)) return false;
+    }
+    if (!write_output(session)) return false;
+
+    // Once the client has closed its end, the session ends after the last
+    // complete batch has been processed and sent.
+    bool done = !session->busy && session->output_size == 0;
+    return !(session->closed && done);
+}
+
+static bool serve(Daemon *daemon) {
+    // The first session served rotates, so no session is always last.
+    size_t first = 0;
+    bool busy = false;
+    while (!stopping) {
+        struct pollfd *fds = daemon->fds;
+        fds[0].fd = daemon->listener;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < daemon->n_sessions; i++) {
+            Session *session = daemon->sessions[i];
+            fds[i + 1].fd = session->fd;
+            fds[i + 1].events = 0;
+            fds[i + 1].revents = 0;
+            if (!session->closed && session->input_size < DAEMON_MAX_BATCH) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (session->output_size > 0) fds[i + 1].events |= POLLOUT;
+        }
+
+        int ready = poll(fds, daemon->n_sessions + 1, busy ? 0 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return false;
+        }
+
+        size_t n_sessions = daemon->n_sessions;
+        busy = false;
+        for (size_t i = 0; i < n_sessions; i++) {
+            size_t index = (first + i) % n_sessions;
+            Session *session = daemon->sessions[index];
+            short revents = fds[index + 1].revents;
+            bool open = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                open = read_input(session);
+            }
+            if (open) open = serve_session(daemon, session);
+            if (!open) {
+                // Marked for removal below.
+                free_session(session);
+                daemon->sessions[index] = NULL;
+                continue;
+            }
+            busy = busy || session->busy;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < n_sessions; i++) {
+            Session *session = daemon->sessions[i];
+            if (session != NULL) daemon->sessions[kept++] = session;
+        }
+        daemon->n_sessions = kept;
+        first = kept > 0 ? (first + 1) % kept : 0;
+
+        if (fds[0].revents & POLLIN) accept_sessions(daemon);
+    }
+    return true;
+}
+
+static int open_listener(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path is too long.\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by an earlier run is replaced.
+    struct stat status;
+    if (lstat(path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, 64) != 0 || !set_nonblocking(fd)
+    ) {
+        fprintf(stderr, "Error: Could not listen on %s.\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    Daemon daemon;
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.sample_rate = DEFAULT_SAMPLE_RATE;
+    daemon.block_size = DEFAULT_BLOCK_SIZE;
+    int priority = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:R:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                daemon.sample_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                daemon.block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                priority = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (
+        optind != argc - 1 || daemon.sample_rate == 0 ||
+        daemon.block_size == 0
+    ) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[optind];
+
+    if (priority > 0) {
+        struct sched_param param = {.sched_priority = priority};
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error != 0) {
+            fprintf(
+                stderr, "Error: Could not set real-time priority: %s\n",
+                strerror(error)
+            );
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    daemon.fds = malloc(sizeof(*daemon.fds));
+    if (daemon.fds == NULL) {
+        fprintf(stderr, "Error: Not enough memory.\n");
+        return EXIT_FAILURE;
+    }
+    daemon.listener = open_listener(path);
+    if (daemon.listener < 0) {
+        free(daemon.fds);
+        return EXIT_FAILURE;
+    }
+
+    bool success = serve(&daemon);
+    for (size_t i = 0; i < daemon.n_sessions; i++) {
+        free_session(daemon.sessions[i]);
+    }
+    free(daemon.sessions);
+    free(daemon.fds);
+    close(daemon.listener);
+    unlink(path);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
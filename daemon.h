@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Protocol spoken by midislide-daemon over a Unix domain (stream) socket.
+// Each connection is an independent session with its own engine, starting at
+// time 0 with the default control values.
+//
+// Both directions are a stream of records: a DaemonRecord followed by `size`
+// bytes of payload, without padding. Values are in the byte order of the
+// machine, since both ends run on it.
+//
+// The client sends events and control changes in time order, then an
+// advance record with time T. The daemon processes everything before T in
+// blocks, sends the output events, and then echoes the advance record, so
+// the client knows all output before T has arrived. Events and control
+// changes must be earlier than the time of the following advance record;
+// a session that breaks this is closed. Output times are not corrected for
+// the latency caused by lookahead.
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <inttypes.h>
+
+typedef enum {
+    // A MIDI message (in both directions).
+    DAEMON_MIDI = 1,
+    // A Universal MIDI Packet as 32-bit words (output only, when
+    // PORT_OUTPUT_FORMAT selects MIDI 2.0).
+    DAEMON_UMP = 2,
+    // A tempo change. The payload is the tempo in beats per minute, as a
+    // float.
+    DAEMON_TEMPO = 3,
+    // A control change. The payload is the port number (see ports.h), as a
+    // uint32_t, followed by the value, as a float. The daemon ends a block at
+    // the record's time so that the change takes effect there.
+    DAEMON_CONTROL = 4,
+    // Processes the session up to `time`. No payload.
+    DAEMON_ADVANCE = 5,
+} DaemonRecordType;
+
+typedef struct {
+    // Time in samples from the start of the session.
+    uint64_t time;
+    uint32_t type;
+    uint32_t size;
+} DaemonRecord;
+
+// Largest payload of a record.
+#define DAEMON_MAX_PAYLOAD 65536
+
+// Most bytes of input the daemon holds for a session. Each batch of records
+// up to and including its advance record must fit.
+#define DAEMON_MAX_BATCH (1 << 20)
+
+#endif
@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+#include "core.h"
+#include "sequence.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Minimum size of each allocation holding the messages in an event buffer.
+#define CHUNK_SIZE 65536
+
+struct MidislideChunk {
+    MidislideChunk *next;
+    size_t size;
+    size_t capacity;
+    uint8_t data[];
+};
+
+// The engine has no URID map, so it gives the core fixed URIDs.
+static const SlideURIs engine_uris = {
+    .midi_Event = 1,
+    .ump_Event = 2,
+    .atom_Float = 3,
+    .atom_Double = 4,
+    .atom_Int = 5,
+    .atom_Long = 6,
+    .time_Position = 7,
+    .time_beatsPerMinute = 8,
+    .time_beat = 9,
+    .time_frame = 10,
+    .time_speed = 11,
+    .atom_Object = 12,
+    .atom_Blank = 13,
+    .atom_Resource = 14,
+};
+
+// Type of the input sequence. The core only copies it to the output.
+#define SEQUENCE_URID 15
+
+struct MidislideEngine {
+    SlideCore core;
+    // Values of the control ports, which are connected to the core.
+    float controls[PORT_COUNT];
+    LV2_Atom_Sequence *input;
+    uint32_t input_capacity;
+    LV2_Atom_Sequence *output;
+    uint32_t output_capacity;
+    // Time of the start of the next block.
+    uint64_t position;
+    MidislideEvent *events;
+    size_t events_capacity;
+    MidislideLogFunction *log;
+    void *log_handle;
+};
+// The streams in the range [begin, end) that have not been started yet.
+// Each thread takes streams from the start of its own queue, and when it is
+// empty, steals the second half of another thread's queue.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+} StreamQueue;
+
+typedef struct {
+    MidislideStream *streams;
+    StreamQueue *queues;
+    unsigned n_queues;
+} Batch;
+
+typedef struct {
+    Batch *batch;
+    unsigned index;
+} BatchWorker;
+
+// The position in the input of a stream being rendered.
+typedef struct {
+    // Index of the next event in `stream->events`.
+    size_t next;
+    // When the input comes from a read function: copies of the events of the
+    // current block, and the first event after the block, if it has already
+    // been read.
+    MidislideEventBuffer block;
+    MidislideEvent pending;
+    bool has_pending;
+    bool ended;
+} StreamInput;
+
+void midislide_event_buffer_init(MidislideEventBuffer *buffer) {
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+void midislide_event_buffer_free(MidislideEventBuffer *buffer) {
+    MidislideChunk *chunk = buffer->chunks;
+    while (chunk != NULL) {
+        MidislideChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(buffer->events);
+    midislide_event_buffer_init(buffer);
+}
+
+static MidislideEvent *append_event(MidislideEventBuffer *buffer) {
+    if (buffer->size >= buffer->capacity) {
+        size_t capacity = buffer->capacity * 2 + 256;
+        MidislideEvent *events = realloc(
+            buffer->events, capacity * sizeof(*events)
+        );
+        if (events == NULL) return NULL;
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+    return &buffer->events[buffer->size++];
+}
+
+// Copies a message into the buffer's chunks. Chunks are never moved, so
+// events can point to their messages directly.
+static const uint8_t *copy_message(
+        MidislideEventBuffer *buffer, const uint8_t *data, uint32_t size) {
+    MidislideChunk *chunk = buffer->chunks;
+    if (chunk == NULL || chunk->capacity - chunk->size < size) {
+        size_t capacity = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        chunk = malloc(sizeof(*chunk) + capacity);
+        if (chunk == NULL) return NULL;
+        chunk->next = buffer->chunks;
+        chunk->size = 0;
+        chunk->capacity = capacity;
+        buffer->chunks = chunk;
+    }
+
+    uint8_t *copy = chunk->data + chunk->size;
+    memcpy(copy, data, size);
+    chunk->size += size;
+    return copy;
+}
+
+static bool add_message(
+        MidislideEventBuffer *buffer, uint64_t time, const uint8_t *data,
+        uint32_t size, bool ump) {
+    const uint8_t *copy = copy_message(buffer, data, size);
+    if (copy == NULL) return false;
+    MidislideEvent *event = append_event(buffer);
+    if (event == NULL) return false;
+    event->time = time;
+    event->size = size;
+    event->bpm = 0;
+    event->ump = ump;
+    event->data = copy;
+    return true;
+}
+
+bool midislide_event_buffer_add_midi(
+        MidislideEventBuffer *buffer, uint64_t time, const uint8_t *data,
+        uint32_t size) {
+    return add_message(buffer, time, data, size, false);
+}
+
+bool midislide_event_buffer_add_tempo(
+        MidislideEventBuffer *buffer, uint64_t time, float bpm) {
+    MidislideEvent *event = append_event(buffer);
+    if (event == NULL) return false;
+    event->time = time;
+    event->size = 0;
+    event->bpm = bpm;
+    event->ump = false;
+    event->data = NULL;
+    return true;
+}
+
+static bool add_input_midi(
+        MidislideEngine *engine, uint32_t frames, const uint8_t *message,
+        uint32_t size) {
+    return sequence_add_midi(
+        &engine->input, &engine->input_capacity, engine_uris.midi_Event,
+        frames, message, size
+    );
+}
+
+static bool add_input_tempo(
+        MidislideEngine *engine, uint32_t frames, float bpm) {
+    const SequenceURIs uris = {
+        .atom_Float = engine_uris.atom_Float,
+        .atom_Object = engine_uris.atom_Object,
+        .time_Position = engine_uris.time_Position,
+        .time_beatsPerMinute = engine_uris.time_beatsPerMinute,
+    };
+    return sequence_add_tempo(
+        &engine->input, &engine->input_capacity, &uris, frames, bpm
+    );
+}
+
+// The default log function.
+static void log_to_stderr(void *handle, bool warning, const char *line) {
+    (void)handle;
+    (void)warning;
+    fputs(line, stderr);
+}
+
+static void log_error(MidislideEngine *engine, const char *line) {
+    if (engine->log != NULL) engine->log(engine->log_handle, false, line);
+}
+
+// Logs and clears the diagnostics, as the plugin does when it is
+// deactivated without a worker.
+static void log_diagnostics(MidislideEngine *engine) {
+    SlideCore *core = &engine->core;
+    if (engine->log != NULL) {
+        slide_core_log_diagnostics(
+            &core->diagnostics, engine->log, engine->log_handle
+        );
+        slide_core_log_output_stats(
+            &core->output_stats, engine->log, engine->log_handle
+        );
+    }
+    memset(&core->diagnostics, 0, sizeof(core->diagnostics));
+}
+
+MidislideEngine *midislide_engine_new(double sample_rate) {
+    MidislideEngine *engine = calloc(1, sizeof(*engine));
+    if (engine == NULL) return NULL;
+    engine->log = log_to_stderr;
+    if (!slide_core_init(&engine->core, sample_rate, &engine_uris)) {
+        free(engine);
+        return NULL;
+    }
+    if (
+        !sequence_reserve(&engine->input, &engine->input_capacity, 0) ||
+        !sequence_reserve(&engine->output, &engine->output_capacity, 0)
+    ) {
+        midislide_engine_free(engine);
+        return NULL;
+    }
+
+    // The pitch CV output is left unconnected.
+    slide_core_default_controls(engine->controls);
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        if (port == PORT_INPUT || port == PORT_OUTPUT) continue;
+        if (port == PORT_PITCH_CV) continue;
+        slide_core_connect_port(
+            &engine->core, port, &engine->controls[port]
+        );
+    }
+    slide_core_activate(&engine->core);
+    return engine;
+}
+
+void midislide_engine_free(MidislideEngine *engine) {
+    if (engine == NULL) return;
+    log_diagnostics(engine);
+    slide_core_destroy(&engine->core);
+    free(engine->input);
+    free(engine->output);
+    free(engine->events);
+    free(engine);
+}
+
+void midislide_engine_set_log(
+        MidislideEngine *engine, MidislideLogFunction *log, void *handle) {
+    engine->log = log;
+    engine->log_handle = handle;
+}
+
+void midislide_engine_set_control(
+        MidislideEngine *engine, uint32_t port, float value) {
+    if (port >= PORT_COUNT) return;
+    engine->controls[port] = value;
+    // The engine isn't run in a real-time thread, so the buffers a control
+    // turns on are allocated straight away.
+    slide_core_allocate_buffers(&engine->core, SLIDE_BUFFER_ALL);
+}
+
+float midislide_engine_get_control(MidislideEngine *engine, uint32_t port) {
+    if (port >= PORT_COUNT) return 0;
+    return engine->controls[port];
+}
+
+void midislide_engine_reset(MidislideEngine *engine) {
+    log_diagnostics(engine);
+    slide_core_activate(&engine->core);
+    engine->position = 0;
+}
+
+static bool reserve_events(MidislideEngine *engine, size_t size) {
+    if (size <= engine->events_capacity) return true;
+    size_t capacity = engine->events_capacity * 2 + 256;
+    if (capacity < size) capacity = size;
+    MidislideEvent *events = realloc(
+        engine->events, capacity * sizeof(*events)
+    );
+    if (events == NULL) return false;
+    engine->events = events;
+    engine->events_capacity = capacity;
+    return true;
+}
+
+bool midislide_engine_run(
+        MidislideEngine *engine, const MidislideEvent *events,
+        size_t n_events, uint32_t n_samples, const MidislideEvent **output,
+        size_t *n_output) {
+    uint64_t start = engine->position;
+    *output = NULL;
+    *n_output = 0;
+
+    engine->input->atom.type = SEQUENCE_URID;
+    lv2_atom_sequence_clear(engine->input);
+    for (size_t i = 0; i < n_events; i++) {
+        const MidislideEvent *event = &events[i];
+        if (event->time < start || event->time - start >= n_samples) {
+            log_error(engine, "Error: Event is outside the block.\n");
+            return false;
+        }
+        if (event->ump) {
+            log_error(
+                engine, "Error: Input events must be MIDI messages.\n"
+            );
+            return false;
+        }
+
+        uint32_t frames = event->time - start;
+        bool added;
+        if (event->size == 0) {
+            added = add_input_tempo(engine, frames, event->bpm);
+        } else {
+            added = add_input_midi(engine, frames, event->data, event->size);
+        }
+        if (!added) return false;
+    }
+
+    if (!sequence_prepare_output(
+        &engine->output, &engine->output_capacity, engine->input, n_samples, 0
+    )) return false;
+    slide_core_run(&engine->core, engine->input, engine->output, n_samples);
+    engine->position += n_samples;
+
+    // The output points directly into the core's output sequence, which is
+    // left alone until the next block.
+    size_t size = 0;
+    LV2_ATOM_SEQUENCE_FOREACH(engine->output, event) {
+        bool ump = event->body.type == engine_uris.ump_Event;
+        if (!ump && event->body.type != engine_uris.midi_Event) continue;
+        if (!reserve_events(engine, size + 1)) return false;
+        MidislideEvent *out = &engine->events[size++];
+        out->time = start + event->time.frames;
+        out->size = event->body.size;
+        out->bpm = 0;
+        out->ump = ump;
+        out->data = (const uint8_t *)(event + 1);
+    }
+
+    *output = engine->events;
+    *n_output = size;
+    return true;
+}
+
+void midislide_stream_init(MidislideStream *stream, double sample_rate) {
+    memset(stream, 0, sizeof(*stream));
+    stream->sample_rate = sample_rate;
+    stream->block_size = 1024;
+    slide_core_default_controls(stream->controls);
+    midislide_event_buffer_init(&stream->output);
+}
+
+// Empties the buffer, keeping the most recent chunk for new messages.
+static void clear_event_buffer(MidislideEventBuffer *buffer) {
+    MidislideChunk *chunk = buffer->chunks;
+    if (chunk != NULL) {
+        MidislideChunk *next = chunk->next;
+        while (next != NULL) {
+            MidislideChunk *after = next->next;
+            free(next);
+            next = after;
+        }
+        chunk->next = NULL;
+        chunk->size = 0;
+    }
+    buffer->size = 0;
+}
+
+static bool copy_event(
+        MidislideEventBuffer *buffer, const MidislideEvent *event) {
+    if (event->size == 0) {
+        return midislide_event_buffer_add_tempo(
+            buffer, event->time, event->bpm
+        );
+    }
+    return add_message(
+        buffer, event->time, event->data, event->size, event->ump
+    );
+}
+
+// Finds the input events before `end`. From a read function, the events are
+// read up to the first one at or after `end`.
+static bool take_input(
+        MidislideStream *stream, StreamInput *input, uint64_t end,
+        const MidislideEvent **events, size_t *n_events) {
+    if (stream->read == NULL) {
+        size_t first = input->next;
+        while (
+            input->next < stream->n_events &&
+            stream->events[input->next].time < end
+        ) {
+            ++input->next;
+        }
+        *events = stream->events + first;
+        *n_events = input->next - first;
+        return true;
+    }
+
+    // The pending event is copied before the next one is read, which may
+    // invalidate its data.
+    clear_event_buffer(&input->block);
+    for (;;) {
+        if (!input->has_pending) {
+            if (input->ended) break;
+            MidislideReadResult result = stream->read(
+                stream->handle, &input->pending
+            );
+            if (result == MIDISLIDE_READ_ERROR) return false;
+            if (result == MIDISLIDE_READ_END) {
+                input->ended = true;
+                break;
+            }
+            input->has_pending = true;
+        }
+        if (input->pending.time >= end) break;
+        if (!copy_event(&input->block, &input->pending)) return false;
+        input->has_pending = false;
+    }
+    *events = input->block.events;
+    *n_events = input->block.size;
+    return true;
+}
+
+// Whether any input events are left after the current block.
+static bool has_input(
+        const MidislideStream *stream, const StreamInput *input) {
+    if (stream->read == NULL) return input->next < stream->n_events;
+    return input->has_pending || !input->ended;
+}
+
+// Runs the next block of a stream.
+static bool render_block(
+        MidislideEngine *engine, MidislideStream *stream, StreamInput *input) {
+    const MidislideEvent *events;
+    size_t n_events;
+    if (!take_input(
+        stream, input, engine->position + stream->block_size, &events,
+        &n_events
+    )) return false;
+
+    const MidislideEvent *output;
+    size_t n_output;
+    if (!midislide_engine_run(
+        engine, events, n_events, stream->block_size, &output, &n_output
+    )) return false;
+
+    // Events are moved earlier by the reported latency. Events the plugin
+    // sends before the latency has passed are moved to the start.
+    uint64_t latency = midislide_engine_get_control(engine, PORT_LATENCY);
+    for (size_t i = 0; i < n_output; i++) {
+        MidislideEvent event = output[i];
+        event.time = event.time > latency ? event.time - latency : 0;
+        bool written;
+        if (stream->write != NULL) {
+            written = stream->write(stream->handle, &event);
+        } else {
+            written = copy_event(&stream->output, &event);
+        }
+        if (!written) return false;
+    }
+    return true;
+}
+
+bool midislide_render(MidislideStream *stream) {
+    stream->success = false;
+    if (stream->block_size == 0) return false;
+    MidislideEngine *engine = midislide_engine_new(stream->sample_rate);
+    if (engine == NULL) return false;
+    if (stream->log != NULL) {
+        midislide_engine_set_log(engine, stream->log, stream->handle);
+    }
+
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        if (!(PORT_CONTROL_INPUTS & (UINT32_C(1) << port))) continue;
+        midislide_engine_set_control(engine, port, stream->controls[port]);
+    }
+
+    // At least one block is run, so that messages the plugin sends when it
+    // starts are included even if the stream is empty. Blocks are run until
+    // the stream's length has been reached and every event has been
+    // processed.
+    StreamInput input = {0};
+    midislide_event_buffer_init(&input.block);
+    bool success = true;
+    do {
+        success = render_block(engine, stream, &input);
+    } while (
+        success &&
+        (engine->position < stream->length || has_input(stream, &input))
+    );
+
+    // Flush the events still delayed by lookahead.
+    uint64_t end = engine->position + (uint64_t)midislide_engine_get_control(
+        engine, PORT_LATENCY
+    );
+    while (success && engine->position < end) {
+        success = render_block(engine, stream, &input);
+    }
+    if (success && stream->write != NULL) {
+        success = stream->write(stream->handle, NULL);
+    }
+
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        stream->controls[port] = midislide_engine_get_control(engine, port);
+    }
+    midislide_event_buffer_free(&input.block);
+    midislide_engine_free(engine);
+    stream->success = success;
+    return success;
+}
+
+// Takes the next stream from a thread's own queue.
+static bool take_stream(StreamQueue *queue, size_t *index) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->begin < queue->end;
+    if (found) *index = queue->begin++;
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Steals half of the remaining streams of another thread into the (empty)
+// queue of `worker`, and takes the first of them.
+static bool steal_streams(BatchWorker *worker, size_t *index) {
+    Batch *batch = worker->batch;
+    for (unsigned i = 1; i < batch->n_queues; i++) {
+        StreamQueue *victim = &batch->queues[
+            (worker->index + i) % batch->n_queues
+        ];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->begin;
+        size_t begin = victim->end - (remaining + 1) / 2;
+        size_t end = victim->end;
+        victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+        if (remaining == 0) continue;
+
+        StreamQueue *queue = &batch->queues[worker->index];
+        pthread_mutex_lock(&queue->lock);
+        queue->begin = begin + 1;
+        queue->end = end;
+        pthread_mutex_unlock(&queue->lock);
+        *index = begin;
+        return true;
+    }
+    return false;
+}
+
+static void *run_batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    Batch *batch = worker->batch;
+    StreamQueue *queue = &batch->queues[worker->index];
+    size_t index;
+    while (take_stream(queue, &index) || steal_streams(worker, &index)) {
+        midislide_render(&batch->streams[index]);
+    }
+    return NULL;
+}
+
+bool midislide_render_batch(
+        MidislideStream *streams, size_t n_streams, unsigned n_threads) {
+    if (n_threads == 0) {
+        long n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_processors > 0 ? n_processors : 1;
+    }
+    if (n_threads > n_streams) n_threads = n_streams;
+    if (n_threads == 0) return true;
+
+    Batch batch = {
+        .streams = streams,
+        .queues = calloc(n_threads, sizeof(StreamQueue)),
+        .n_queues = n_threads,
+    };
+    BatchWorker *workers = calloc(n_threads, sizeof(BatchWorker));
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    bool *started = calloc(n_threads, sizeof(bool));
+    if (
+        batch.queues == NULL || workers == NULL || threads == NULL ||
+        started == NULL
+    ) {
+        free(batch.queues);
+        free(workers);
+        free(threads);
+        free(started);
+        return false;
+    }
+
+    for (unsigned i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].begin = n_streams * i / n_threads;
+        batch.queues[i].end = n_streams * (i + 1) / n_threads;
+        workers[i].batch = &batch;
+        workers[i].index = i;
+    }
+
+    // The calling thread is worker 0. If a thread can't be started, its
+    // streams are stolen by the others.
+    for (unsigned i = 1; i < n_threads; i++) {
+        started[i] = pthread_create(
+            &threads[i], NULL, run_batch_worker, &workers[i]
+        ) == 0;
+    }
+    run_batch_worker(&workers[0]);
+    for (unsigned i = 1; i < n_threads; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    for (unsigned i = 0; i < n_threads; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    free(batch.queues);
+    free(workers);
+    free(threads);
+    free(started);
+
+    bool success = true;
+    for (size_t i = 0; i < n_streams; i++) {
+        success = success && streams[i].success;
+    }
+    return success;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A plain C interface to the slide engine, for programs that process MIDI
+// without an LV2 host. Events are passed in and out as arrays of raw MIDI
+// messages, and the output is identical to the plugin's.
+//
+// Engines share no state, so different engines (and different streams) can
+// be used from different threads at the same time. A single engine must not
+// be used from more than one thread at once.
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "ports.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    // Time in samples from the start of the stream.
+    uint64_t time;
+    // Size of the MIDI message, or 0 for a tempo change.
+    uint32_t size;
+    // Tempo in beats per minute, for tempo changes.
+    float bpm;
+    // Whether `data` is a Universal MIDI Packet (as 32-bit words in native
+    // byte order) rather than a MIDI 1.0 message. Only the output contains
+    // packets, when PORT_OUTPUT_FORMAT selects MIDI 2.0.
+    bool ump;
+    const uint8_t *data;
+} MidislideEvent;
+
+typedef struct MidislideChunk MidislideChunk;
+
+// A growable array of events. The buffer owns a copy of each message, which
+// stays at the same address until the buffer is freed.
+typedef struct {
+    MidislideEvent *events;
+    size_t size;
+    size_t capacity;
+    MidislideChunk *chunks;
+} MidislideEventBuffer;
+
+typedef struct MidislideEngine MidislideEngine;
+
+// Receives a line logged by an engine, such as a diagnostic about its input
+// (e.g., a "note off" for a note that isn't on) or a summary of events that
+// didn't fit in the output. `warning` is false for errors. The line ends
+// with a newline.
+typedef void MidislideLogFunction(
+    void *handle, bool warning, const char *line);
+
+typedef enum {
+    MIDISLIDE_READ_EVENT,
+    MIDISLIDE_READ_END,
+    MIDISLIDE_READ_ERROR,
+} MidislideReadResult;
+
+// Reads the next input event of a stream into `*event`. The event's data
+// only needs to stay valid until the next call.
+typedef MidislideReadResult MidislideReadFunction(
+    void *handle, MidislideEvent *event);
+
+// Receives the next output event of a stream, or null once the stream has
+// been rendered successfully. Returns false on failure, which stops the
+// rendering.
+typedef bool MidislideWriteFunction(
+    void *handle, const MidislideEvent *event);
+
+// A complete stream, rendered by midislide_render().
+typedef struct {
+    // Input events, sorted by time.
+    const MidislideEvent *events;
+    size_t n_events;
+    // If set, input events (still sorted by time) are read from this
+    // function as they are needed instead of from `events`, so the input
+    // doesn't have to be loaded first.
+    MidislideReadFunction *read;
+    // If set, output events are passed to this function as each block is
+    // rendered instead of being collected in `output`.
+    MidislideWriteFunction *write;
+    // If set, the engine's log is passed to this function instead of being
+    // written to standard error.
+    MidislideLogFunction *log;
+    // Passed to `read`, `write` and `log`.
+    void *handle;
+    // The stream is processed up to at least this time, and until after the
+    // last event.
+    uint64_t length;
+    double sample_rate;
+    uint32_t block_size;
+    // Values of the control ports (see ports.h), set to their defaults by
+    // midislide_stream_init().
+    float controls[PORT_COUNT];
+    // The output events, unless `write` is set. Their times are corrected
+    // for the latency caused by lookahead, as a host with latency
+    // compensation would.
+    MidislideEventBuffer output;
+    bool success;
+} MidislideStream;
+
+void midislide_event_buffer_init(MidislideEventBuffer *buffer);
+
+void midislide_event_buffer_free(MidislideEventBuffer *buffer);
+
+// Appends a copy of a MIDI message.
+bool midislide_event_buffer_add_midi(
+    MidislideEventBuffer *buffer, uint64_t time, const uint8_t *data,
+    uint32_t size);
+
+bool midislide_event_buffer_add_tempo(
+    MidislideEventBuffer *buffer, uint64_t time, float bpm);
+
+// Creates an activated engine with every control at its default value.
+// Returns null on failure.
+MidislideEngine *midislide_engine_new(double sample_rate);
+
+// Logs the remaining diagnostics and frees the engine.
+void midislide_engine_free(MidislideEngine *engine);
+
+// Sets the function the engine logs to. Diagnostics are collected while the
+// engine runs and logged when it is reset or freed; errors in the arguments
+// to midislide_engine_run() are logged straight away. By default, the log is
+// written to standard error. If `log` is null, it is discarded. The counters
+// described in ports.h can be read with midislide_engine_get_control().
+void midislide_engine_set_log(
+    MidislideEngine *engine, MidislideLogFunction *log, void *handle);
+
+// Sets an input control port. The value is used from the next block on.
+void midislide_engine_set_control(
+    MidislideEngine *engine, uint32_t port, float value);
+
+// Returns the value of a control port. Output ports are updated by each call
+// to midislide_engine_run().
+float midislide_engine_get_control(MidislideEngine *engine, uint32_t port);
+
+// Logs the diagnostics and reactivates the engine, which resets its time to
+// 0.
+void midislide_engine_reset(MidislideEngine *engine);
+
+// Processes the next block of `n_samples` samples. The times of the input
+// events must be within the block, and are relative to the start of the
+// stream, as are the times of the output. The output is stored in
+// `*output`, and is valid until the next call.
+bool midislide_engine_run(
+    MidislideEngine *engine, const MidislideEvent *events, size_t n_events,
+    uint32_t n_samples, const MidislideEvent **output, size_t *n_output);
+
+// Initializes a stream with no events and default settings.
+void midislide_stream_init(MidislideStream *stream, double sample_rate);
+
+// Renders a stream with its own engine. Sets and returns `stream->success`.
+bool midislide_render(MidislideStream *stream);
+
+// Renders many independent streams on `n_threads` threads (0 for one per
+// processor). The streams are divided among the threads, and threads that
+// finish early take streams from the others. Returns true if every stream
+// succeeded.
+bool midislide_render_batch(
+    MidislideStream *streams, size_t n_streams, unsigned n_threads);
+
+#endif
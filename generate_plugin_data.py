@@ -55,6 +55,9 @@ TTL_HEAD = """
 @prefix urid:  <http://lv2plug.in/ns/ext/urid#> .
 @prefix midi:  <http://lv2plug.in/ns/ext/midi#> .
 @prefix time: <http://lv2plug.in/ns/ext/time#> .
+@prefix log: <http://lv2plug.in/ns/ext/log#> .
+@prefix work: <http://lv2plug.in/ns/ext/worker#> .
+@prefix midislide: <https://taylor.fish/plugins/midislide#> .
 
 <https://taylor.fish/plugins/midislide>
     a lv2:Plugin ;
@@ -71,11 +74,23 @@ TTL_HEAD = """
         foaf:mbox <mailto:contact@taylor.fish> ;
     ] ;
     lv2:optionalFeature lv2:hardRTCapable ;
+    lv2:optionalFeature log:log ;
+    lv2:optionalFeature work:schedule ;
+    lv2:extensionData work:interface ;
     lv2:requiredFeature pprops:supportsStrictBounds ;
     lv2:requiredFeature urid:map ;
     lv2:port [
 """
 
+TTL_TAIL = """
+midislide:UmpEvent
+    a rdfs:Class ;
+    rdfs:subClassOf atom:Atom ;
+    rdfs:label "Universal MIDI Packet" ;
+    rdfs:comment '''One Universal MIDI Packet, as 32-bit words in native byte
+order. Sent instead of midi:MidiEvent when the output format is MIDI 2.0.''' .
+"""
+
 C_HEAD = """
 /*
  * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
@@ -121,6 +136,7 @@ a lv2:OutputPort ,
   atom:AtomPort ;
 atom:bufferType atom:Sequence;
 atom:supports midi:MidiEvent;
+atom:supports midislide:UmpEvent;
 lv2:index {index} ;
 lv2:symbol "out" ;
 lv2:name "Out"
@@ -161,6 +177,329 @@ lv2:portProperty lv2:integer ;
 lv2:default 0 ;
 lv2:minimum 0 ;
 lv2:maximum 127;
+"""),
+
+    ("BEND_MODE", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "bend_mode" ;
+lv2:name "Pitch bend mode" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:portProperty lv2:enumeration ;
+lv2:scalePoint [
+    rdfs:label "Fixed rate" ;
+    rdf:value 0
+] , [
+    rdfs:label "On change" ;
+    rdf:value 1
+] ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 1;
+"""),
+
+    ("BEND_RATE", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "bend_rate" ;
+lv2:name "Pitch bend rate" ;
+lv2:portProperty pprops:hasStrictBounds ;
+units:unit units:hz ;
+lv2:default 500 ;
+lv2:minimum 10 ;
+lv2:maximum 4000;
+"""),
+
+    ("MIN_BEND_STEP", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "min_bend_step" ;
+lv2:name "Minimum pitch bend step" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:default 1 ;
+lv2:minimum 1 ;
+lv2:maximum 1024;
+"""),
+
+    ("BENDS_MERGED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "bends_merged" ;
+lv2:name "Pitch bends merged" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("BENDS_DROPPED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "bends_dropped" ;
+lv2:name "Pitch bends dropped" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("PASSTHROUGH_DROPPED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "passthrough_dropped" ;
+lv2:name "Passthrough events dropped" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("NOTES_DELAYED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "notes_delayed" ;
+lv2:name "Note offs delayed" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("NOTES_DROPPED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "notes_dropped" ;
+lv2:name "Notes dropped" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("SLIDE_CURVE", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "slide_curve" ;
+lv2:name "Slide curve" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:portProperty lv2:enumeration ;
+lv2:scalePoint [
+    rdfs:label "Linear" ;
+    rdf:value 0
+] , [
+    rdfs:label "Exponential" ;
+    rdf:value 1
+] , [
+    rdfs:label "Logarithmic" ;
+    rdf:value 2
+] , [
+    rdfs:label "S-curve" ;
+    rdf:value 3
+] ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 3;
+"""),
+
+    ("VOICE_MODE", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "voice_mode" ;
+lv2:name "Voice mode" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:portProperty lv2:enumeration ;
+lv2:scalePoint [
+    rdfs:label "Monophonic" ;
+    rdf:value 0
+] , [
+    rdfs:label "MPE" ;
+    rdf:value 1
+] , [
+    rdfs:label "Per channel" ;
+    rdf:value 2
+] ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 2;
+"""),
+
+    ("MPE_CHANNELS", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "mpe_channels" ;
+lv2:name "MPE member channels" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:default 15 ;
+lv2:minimum 1 ;
+lv2:maximum 15;
+"""),
+
+    ("LOOKAHEAD", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "lookahead" ;
+lv2:name "Lookahead" ;
+lv2:portProperty pprops:hasStrictBounds ;
+units:unit units:ms ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 2000;
+"""),
+
+    ("LATENCY", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "latency" ;
+lv2:name "Latency" ;
+lv2:designation lv2:latency ;
+lv2:portProperty lv2:reportsLatency ;
+lv2:portProperty lv2:integer ;
+units:unit units:frame ;
+lv2:minimum 0;
+"""),
+
+    ("EVENTS_IN", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "events_in" ;
+lv2:name "Events in" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("EVENTS_OUT", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "events_out" ;
+lv2:name "Events out" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("BENDS_OUT", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "bends_out" ;
+lv2:name "Pitch bends out" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("EVENTS_DROPPED", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "events_dropped" ;
+lv2:name "Events dropped" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("STACK_HIGH_WATER", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "stack_high_water" ;
+lv2:name "Note stack high-water mark" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("SLIDES_OUT_OF_RANGE", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "slides_out_of_range" ;
+lv2:name "Slides out of range" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:portProperty lv2:integer ;
+lv2:minimum 0;
+"""),
+
+    ("RUN_CYCLES_MAX", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "run_cycles_max" ;
+lv2:name "Maximum cycles per block" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:minimum 0;
+"""),
+
+    ("RUN_CYCLES_AVG", """
+a lv2:OutputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "run_cycles_avg" ;
+lv2:name "Average cycles per block" ;
+lv2:portProperty lv2:connectionOptional ;
+lv2:minimum 0;
+"""),
+
+    ("OUTPUT_FORMAT", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "output_format" ;
+lv2:name "Output format" ;
+lv2:portProperty pprops:hasStrictBounds ;
+lv2:portProperty lv2:integer ;
+lv2:portProperty lv2:enumeration ;
+lv2:scalePoint [
+    rdfs:label "MIDI 1.0" ;
+    rdf:value 0
+] , [
+    rdfs:label "MIDI 2.0 (UMP)" ;
+    rdf:value 1
+] ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 1;
+"""),
+
+    ("PITCH_CV", """
+a lv2:OutputPort ,
+  lv2:CVPort ;
+lv2:index {index} ;
+lv2:symbol "pitch_cv" ;
+lv2:name "Pitch CV" ;
+lv2:portProperty lv2:connectionOptional ;
+rdfs:comment "Pitch offset from the note playing, at 1 V per octave." ;
+lv2:minimum -6 ;
+lv2:maximum 6;
+"""),
+
+    ("COALESCE_CONTROLLERS", """
+a lv2:InputPort ,
+  lv2:ControlPort ;
+lv2:index {index} ;
+lv2:symbol "coalesce_controllers" ;
+lv2:name "Coalesce controllers" ;
+lv2:portProperty lv2:toggled ;
+lv2:default 0 ;
+lv2:minimum 0 ;
+lv2:maximum 1;
 """),
 ])
 
@@ -168,6 +507,7 @@ lv2:maximum 127;
 class Writer:
     def __init__(self, ttl_path, c_path):
         self.index = 0
+        self.control_inputs = 0
         self.ttl_file = open(ttl_path, "w")
         self.c_file = open(c_path, "w")
 
@@ -181,6 +521,8 @@ class Writer:
 
         if c_name:
             self.const("PORT_" + c_name, self.index)
+        if "lv2:InputPort" in template and "lv2:ControlPort" in template:
+            self.control_inputs |= 1 << self.index
         self.index += 1
 
     def const(self, c_name, val):
@@ -211,8 +553,14 @@ def generate_files(writer):
         w.port(c_name, template, first=(i == 0))
 
     w.ttl_raw(INDENT + "] .")
+    w.ttl_raw("")
+    w.ttl_raw(TTL_TAIL.strip())
+    w.const("PORT_COUNT", w.index)
     w.c_raw("};")
     w.c_raw("")
+    w.c_raw("// Bit i is set if port i is an input control port.")
+    w.c_raw("#define PORT_CONTROL_INPUTS 0x{:08x}u".format(w.control_inputs))
+    w.c_raw("")
     w.c_raw("#endif")
 
 
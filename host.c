@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "host.h"
+#include "midislide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static LV2_URID map_uri(LV2_URID_Map_Handle handle, const char *uri) {
+    HostURIs *uris = (HostURIs *)handle;
+    for (uint32_t i = 0; i < uris->n_uris; i++) {
+        if (strcmp(uris->uris[i], uri) == 0) return i + 1;
+    }
+
+    if (uris->n_uris >= uris->uris_capacity) {
+        uint32_t capacity = uris->uris_capacity * 2 + 16;
+        char **new_uris = realloc(uris->uris, capacity * sizeof(char *));
+        if (new_uris == NULL) return 0;
+        uris->uris = new_uris;
+        uris->uris_capacity = capacity;
+    }
+
+    char *copy = malloc(strlen(uri) + 1);
+    if (copy == NULL) return 0;
+    strcpy(copy, uri);
+    uris->uris[uris->n_uris++] = copy;
+    return uris->n_uris;
+}
+
+// Adds a message to a queue. Returns false if it doesn't fit.
+static bool queue_push(HostQueue *queue, uint32_t size, const void *data) {
+    uint32_t entry_size = lv2_atom_pad_size(sizeof(uint32_t) + size);
+    if (size > HOST_QUEUE_SIZE || entry_size > HOST_QUEUE_SIZE - queue->size) {
+        return false;
+    }
+    uint8_t *entry = (uint8_t *)queue->data + queue->size;
+    memcpy(entry, &size, sizeof(size));
+    memcpy(entry + sizeof(size), data, size);
+    queue->size += entry_size;
+    return true;
+}
+
+// Calls `handle` for each message in a queue, and empties it. Messages added
+// meanwhile are left for the next call.
+static void queue_drain(
+        HostQueue *queue, Host *host,
+        void (*handle)(Host *, uint32_t, const void *)) {
+    uint32_t end = queue->size;
+    if (end == 0) return;
+    // The messages are copied out, since handling one may add more.
+    uint64_t *messages = malloc(end);
+    if (messages == NULL) return;
+    memcpy(messages, queue->data, end);
+    queue->size = 0;
+
+    for (uint32_t offset = 0; offset < end; ) {
+        const uint8_t *entry = (const uint8_t *)messages + offset;
+        uint32_t size;
+        memcpy(&size, entry, sizeof(size));
+        handle(host, size, entry + sizeof(size));
+        offset += lv2_atom_pad_size(sizeof(size) + size);
+    }
+    free(messages);
+}
+
+static LV2_Worker_Status schedule_work(
+        LV2_Worker_Schedule_Handle handle, uint32_t size, const void *data) {
+    Host *host = handle;
+    if (host->worker == NULL) return LV2_WORKER_ERR_UNKNOWN;
+    if (!queue_push(&host->work, size, data)) return LV2_WORKER_ERR_NO_SPACE;
+    return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status respond(
+        LV2_Worker_Respond_Handle handle, uint32_t size, const void *data) {
+    Host *host = handle;
+    if (!queue_push(&host->responses, size, data)) {
+        return LV2_WORKER_ERR_NO_SPACE;
+    }
+    return LV2_WORKER_SUCCESS;
+}
+
+static void do_work(Host *host, uint32_t size, const void *data) {
+    host->worker->work(host->instance, respond, host, size, data);
+}
+
+static void deliver_response(Host *host, uint32_t size, const void *data) {
+    host->worker->work_response(host->instance, size, data);
+}
+
+static inline void connect_buffers(Host *host) {
+    const LV2_Descriptor *descriptor = host->descriptor;
+    descriptor->connect_port(host->instance, PORT_INPUT, host->input);
+    descriptor->connect_port(host->instance, PORT_OUTPUT, host->output);
+}
+
+bool host_init(Host *host, double sample_rate) {
+    memset(host, 0, sizeof(*host));
+    HostURIs *uris = &host->uris;
+    host->map.handle = uris;
+    host->map.map = map_uri;
+    host->map_feature.URI = LV2_URID__map;
+    host->map_feature.data = &host->map;
+    host->schedule.handle = host;
+    host->schedule.schedule_work = schedule_work;
+    host->schedule_feature.URI = LV2_WORKER__schedule;
+    host->schedule_feature.data = &host->schedule;
+
+    uris->midi_Event = map_uri(uris, LV2_MIDI__MidiEvent);
+    uris->ump_Event = map_uri(uris, MIDISLIDE_UMP_EVENT_URI);
+    uris->atom_Sequence = map_uri(uris, LV2_ATOM__Sequence);
+    SequenceURIs *sequence_uris = &uris->sequence;
+    sequence_uris->atom_Float = map_uri(uris, LV2_ATOM__Float);
+    sequence_uris->atom_Object = map_uri(uris, LV2_ATOM__Object);
+    sequence_uris->time_Position = map_uri(uris, LV2_TIME__Position);
+    sequence_uris->time_beatsPerMinute = map_uri(
+        uris, LV2_TIME__beatsPerMinute
+    );
+
+    if (!sequence_reserve(&host->input, &host->input_capacity, 0)) {
+        return false;
+    }
+    if (!sequence_reserve(&host->output, &host->output_capacity, 0)) {
+        return false;
+    }
+
+    slide_core_default_controls(host->controls);
+
+    const LV2_Feature *features[] = {
+        &host->map_feature, &host->schedule_feature, NULL
+    };
+    host->descriptor = lv2_descriptor(0);
+    host->instance = host->descriptor->instantiate(
+        host->descriptor, sample_rate, "", features
+    );
+    if (host->instance == NULL) return false;
+    host->worker = host->descriptor->extension_data(LV2_WORKER__interface);
+
+    // The pitch CV output is left unconnected.
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        if (port == PORT_INPUT || port == PORT_OUTPUT) continue;
+        if (port == PORT_PITCH_CV) continue;
+        host->descriptor->connect_port(
+            host->instance, port, &host->controls[port]
+        );
+    }
+    connect_buffers(host);
+    host->descriptor->activate(host->instance);
+    host_begin_block(host);
+    return true;
+}
+
+void host_destroy(Host *host) {
+    if (host->instance != NULL) {
+        // Finish the work the plugin scheduled (such as writing its trace),
+        // and hand over any buffers it allocated so they are freed.
+        host_run_worker(host);
+        host_deliver_responses(host);
+        host->descriptor->deactivate(host->instance);
+        host->descriptor->cleanup(host->instance);
+    }
+    for (uint32_t i = 0; i < host->uris.n_uris; i++) {
+        free(host->uris.uris[i]);
+    }
+    free(host->uris.uris);
+    free(host->input);
+    free(host->output);
+}
+
+void host_set_control(Host *host, uint32_t port, float value) {
+    host->controls[port] = value;
+}
+
+void host_begin_block(Host *host) {
+    host->input->atom.type = host->uris.atom_Sequence;
+    host->input->atom.size = sizeof(LV2_Atom_Sequence_Body);
+    host->input->body.unit = 0;
+    host->input->body.pad = 0;
+}
+
+void host_reactivate(Host *host) {
+    host->descriptor->deactivate(host->instance);
+    host->descriptor->activate(host->instance);
+}
+
+bool host_add_event(Host *host, const LV2_Atom_Event *event) {
+    LV2_Atom_Sequence *old_input = host->input;
+    bool result = sequence_add_event(
+        &host->input, &host->input_capacity, event
+    );
+    if (host->input != old_input) connect_buffers(host);
+    return result;
+}
+
+bool host_add_midi(
+        Host *host, uint32_t frames, const uint8_t *message, uint32_t size) {
+    LV2_Atom_Sequence *old_input = host->input;
+    bool result = sequence_add_midi(
+        &host->input, &host->input_capacity, host->uris.midi_Event, frames,
+        message, size
+    );
+    if (host->input != old_input) connect_buffers(host);
+    return result;
+}
+
+bool host_add_tempo(Host *host, uint32_t frames, float bpm) {
+    LV2_Atom_Sequence *old_input = host->input;
+    bool result = sequence_add_tempo(
+        &host->input, &host->input_capacity, &host->uris.sequence, frames,
+        bpm
+    );
+    if (host->input != old_input) connect_buffers(host);
+    return result;
+}
+
+bool host_prepare_output(Host *host, uint32_t n_samples) {
+    LV2_Atom_Sequence *old_output = host->output;
+    bool result = sequence_prepare_output(
+        &host->output, &host->output_capacity, host->input, n_samples,
+        host->output_limit
+    );
+    if (host->output != old_output) connect_buffers(host);
+    return result;
+}
+
+bool host_run(Host *host, uint32_t n_samples) {
+    if (!host_prepare_output(host, n_samples)) return false;
+    host->descriptor->run(host->instance, n_samples);
+    return true;
+}
+
+void host_run_worker(Host *host) {
+    if (host->worker == NULL) return;
+    queue_drain(&host->work, host, do_work);
+}
+
+void host_deliver_responses(Host *host) {
+    if (host->worker == NULL) return;
+    queue_drain(&host->responses, host, deliver_response);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A minimal in-process LV2 host, used by the benchmark, replay and WCET tools
+// to drive the plugin itself through its descriptor.
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "ports.h"
+#include "sequence.h"
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    char **uris;
+    uint32_t n_uris;
+    uint32_t uris_capacity;
+
+    LV2_URID midi_Event;
+    LV2_URID ump_Event;
+    LV2_URID atom_Sequence;
+    SequenceURIs sequence;
+} HostURIs;
+
+// Bytes of messages each of the host's worker queues can hold.
+#define HOST_QUEUE_SIZE 16384
+
+// Messages waiting for the worker or for the plugin. Each is a uint32_t
+// size followed by the message, padded to 8 bytes.
+typedef struct {
+    uint64_t data[HOST_QUEUE_SIZE / sizeof(uint64_t)];
+    uint32_t size;
+} HostQueue;
+
+typedef struct {
+    const LV2_Descriptor *descriptor;
+    LV2_Handle instance;
+    LV2_URID_Map map;
+    LV2_Feature map_feature;
+    LV2_Worker_Schedule schedule;
+    LV2_Feature schedule_feature;
+    HostURIs uris;
+
+    // The plugin's worker interface. Work is only done when the tool calls
+    // host_run_worker(), and responses are only delivered when it calls
+    // host_deliver_responses().
+    const LV2_Worker_Interface *worker;
+    HostQueue work;
+    HostQueue responses;
+
+    float controls[PORT_COUNT];
+    LV2_Atom_Sequence *input;
+    uint32_t input_capacity;
+    LV2_Atom_Sequence *output;
+    uint32_t output_capacity;
+    // If nonzero, the capacity of the output sequence given to the plugin,
+    // in bytes. Otherwise, the output always has room for every event.
+    uint32_t output_limit;
+} Host;
+
+// Instantiates and activates the plugin. Control ports are set to their
+// default values.
+bool host_init(Host *host, double sample_rate);
+
+void host_destroy(Host *host);
+
+void host_set_control(Host *host, uint32_t port, float value);
+
+// Deactivates and reactivates the plugin.
+void host_reactivate(Host *host);
+
+// Clears the input sequence for the next block.
+void host_begin_block(Host *host);
+
+// Appends an event to the input sequence. Events must be added in order.
+bool host_add_midi(
+    Host *host, uint32_t frames, const uint8_t *message, uint32_t size);
+
+// Appends a copy of an event. URIDs in the event must come from `host->map`.
+bool host_add_event(Host *host, const LV2_Atom_Event *event);
+
+// Appends a time:Position object containing only time:beatsPerMinute.
+bool host_add_tempo(Host *host, uint32_t frames, float bpm);
+
+// Prepares the output sequence for a block of `n_samples` samples. After
+// this, the plugin can be run with `host->descriptor->run()`.
+bool host_prepare_output(Host *host, uint32_t n_samples);
+
+// Runs the plugin for one block. The output can then be read from
+// `host->output`.
+bool host_run(Host *host, uint32_t n_samples);
+
+// Does the work the plugin has scheduled since the last call, in the calling
+// thread. Responses are kept until host_deliver_responses().
+void host_run_worker(Host *host);
+
+// Passes the worker's responses to the plugin.
+void host_deliver_responses(Host *host);
+
+#endif
@@ -18,7 +18,9 @@
  */
 
 #include "midislide.h"
-#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -26,87 +28,148 @@
 
 #define PLUGIN_URI "https://taylor.fish/plugins/midislide"
 
-/* Forward declarations */
-
-static const LV2_Atom_Event *run_body(
-    MidiSlide *plugin, uint32_t n_samples,
-    const LV2_Atom_Event *start_event, uint32_t frames,
-    uint32_t output_capacity);
-
-static inline void handle_atom_object(
-    MidiSlide *plugin, const LV2_Atom_Object *object);
-
-static inline MidiAction get_midi_action(const uint8_t *message);
-
-static inline bool handle_midi_message(
-    MidiSlide *plugin, const uint8_t *message, MidiAction action,
-    uint32_t output_capacity);
+// Diagnostics are sent to the worker at most this many times per second.
+#define DIAG_REPORTS_PER_SECOND 4
 
-static inline void compact_stack(MidiSlide *plugin);
-
-static inline void move_primary_to_stack_top(
-    MidiSlide *plugin, uint8_t start_at);
-
-static inline void set_bend(
-    MidiSlide *plugin, int value, uint32_t frames,
-    uint32_t output_capacity);
+/* Forward declarations */
 
-static inline bool set_bend_from_slide(
-    MidiSlide *plugin, uint8_t key, uint8_t velocity, uint8_t base_key,
-    uint32_t frames, uint32_t output_capacity);
+static inline void send_diagnostics(MidiSlide *plugin, uint32_t n_samples);
 
-static inline void set_bend_from_key(
-    MidiSlide *plugin, uint8_t key, uint32_t frames,
-    uint32_t output_capacity);
+static inline void request_buffers(MidiSlide *plugin);
 
-static inline int relative_key_to_bend(
-    MidiSlide *plugin, double relative_key);
+static void log_diagnostics(MidiSlide *plugin, const DiagReport *report);
 
-static inline void stop_note(
-    MidiSlide *plugin, uint32_t frames, uint32_t output_capacity);
+static void open_trace(MidiSlide *plugin);
 
-static inline void play_note(
-    MidiSlide *plugin, uint8_t key, uint8_t velocity, uint32_t frames,
-    uint32_t output_capacity);
+static inline void record_trace(
+    MidiSlide *plugin, TraceRecordType type, uint32_t n_samples,
+    uint32_t output_capacity, uint32_t buffer_kind);
 
-static inline void send_midi_message(
-    MidiSlide *plugin, MidiEvent *event, uint32_t output_capacity);
+static inline void send_trace(MidiSlide *plugin);
 
-static inline void handle_note_on(
-    MidiSlide *plugin, uint8_t key, uint8_t velocity);
+static void close_trace(MidiSlide *plugin);
 
-static inline void handle_note_off(MidiSlide *plugin, uint8_t key);
+/* End forward declarations */
 
-static inline void handle_all_notes_off(MidiSlide *plugin);
+#define URI_ENTRY(field, uri) {offsetof(MidiSlideURIs, field), uri}
+
+// The URIs in MidiSlideURIs. Traces include this table, so URIDs in the
+// recorded events can be mapped again when they are replayed.
+static const struct {
+    size_t offset;
+    const char *uri;
+} uri_table[] = {
+    URI_ENTRY(core.midi_Event, LV2_MIDI__MidiEvent),
+    URI_ENTRY(core.ump_Event, MIDISLIDE_UMP_EVENT_URI),
+    URI_ENTRY(core.atom_Float, LV2_ATOM__Float),
+    URI_ENTRY(core.atom_Double, LV2_ATOM__Double),
+    URI_ENTRY(core.atom_Int, LV2_ATOM__Int),
+    URI_ENTRY(core.atom_Long, LV2_ATOM__Long),
+    URI_ENTRY(core.time_Position, LV2_TIME__Position),
+    URI_ENTRY(core.time_beatsPerMinute, LV2_TIME__beatsPerMinute),
+    URI_ENTRY(core.time_beat, LV2_TIME__beat),
+    URI_ENTRY(core.time_frame, LV2_TIME__frame),
+    URI_ENTRY(core.time_speed, LV2_TIME__speed),
+    URI_ENTRY(core.atom_Object, LV2_ATOM__Object),
+    URI_ENTRY(core.atom_Blank, LV2_ATOM__Blank),
+    URI_ENTRY(core.atom_Resource, LV2_ATOM__Resource),
+    URI_ENTRY(log_Error, LV2_LOG__Error),
+    URI_ENTRY(log_Warning, LV2_LOG__Warning),
+};
 
-static inline void add_to_stack(
-    MidiSlide *plugin, uint8_t key, uint8_t velocity);
+#define URI_TABLE_SIZE (sizeof(uri_table) / sizeof(*uri_table))
 
-static inline void remove_from_stack(MidiSlide *plugin, uint8_t key);
+static inline LV2_URID *uri_table_urid(MidiSlideURIs *uris, size_t i) {
+    return (LV2_URID *)((char *)uris + uri_table[i].offset);
+}
 
-static inline void clear_stack(MidiSlide *plugin);
+static inline void map_uris(LV2_URID_Map *map, MidiSlideURIs *uris) {
+    for (size_t i = 0; i < URI_TABLE_SIZE; i++) {
+        *uri_table_urid(uris, i) = map->map(map->handle, uri_table[i].uri);
+    }
+}
 
-/* End forward declarations */
+// URIDs shared by all instances in the process. Hosts may instantiate plugins
+// from several threads, so the list is only used while holding
+// `shared_lock`.
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static SharedURIs *shared_uris_list = NULL;
 
-static inline void map_uris(LV2_URID_Map *map, MidiSlideURIs *uris) {
-    uris->midi_Event = map->map(map->handle, LV2_MIDI__MidiEvent);
-    uris->atom_Float = map->map(map->handle, LV2_ATOM__Float);
-    uris->time_Position = map->map(map->handle, LV2_TIME__Position);
-    uris->time_beatsPerMinute = map->map(
-        map->handle, LV2_TIME__beatsPerMinute
-    );
-    uris->atom_Object = map->map(map->handle, LV2_ATOM__Object);
-    uris->atom_Blank = map->map(map->handle, LV2_ATOM__Blank);
-    uris->atom_Resource = map->map(map->handle, LV2_ATOM__Resource);
+// Must be called while holding `shared_lock`.
+static SharedURIs *find_shared_uris(LV2_URID_Map *map) {
+    SharedURIs *entry = shared_uris_list;
+    while (entry != NULL) {
+        if (entry->handle == map->handle && entry->map == map->map) break;
+        entry = entry->next;
+    }
+    return entry;
+}
+
+// Returns the URIDs mapped by `map`, mapping them if no other instance using
+// the same map exists. Entries are released with release_shared_uris(), and
+// freed when the last instance using them is cleaned up, since the host may
+// then free the map and allocate a new one at the same address. Returns NULL
+// if memory can't be allocated.
+static SharedURIs *acquire_shared_uris(LV2_URID_Map *map) {
+    pthread_mutex_lock(&shared_lock);
+    SharedURIs *entry = find_shared_uris(map);
+    if (entry != NULL) {
+        entry->references++;
+        pthread_mutex_unlock(&shared_lock);
+        return entry;
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    // The host's map() may take its own locks, or call back into the plugin
+    // from another thread, so it isn't called while holding `shared_lock`.
+    SharedURIs *new_entry = malloc(sizeof(*new_entry));
+    if (new_entry == NULL) return NULL;
+    new_entry->handle = map->handle;
+    new_entry->map = map->map;
+    new_entry->references = 1;
+    map_uris(map, &new_entry->uris);
+
+    // Another instance may have added an entry for the same map meanwhile;
+    // if so, that one is used and the new one discarded.
+    pthread_mutex_lock(&shared_lock);
+    entry = find_shared_uris(map);
+    if (entry != NULL) {
+        entry->references++;
+    } else {
+        entry = new_entry;
+        new_entry = NULL;
+        entry->next = shared_uris_list;
+        shared_uris_list = entry;
+    }
+    pthread_mutex_unlock(&shared_lock);
+    free(new_entry);
+    return entry;
+}
+
+static void release_shared_uris(SharedURIs *entry) {
+    pthread_mutex_lock(&shared_lock);
+    if (--entry->references == 0) {
+        SharedURIs **link = &shared_uris_list;
+        while (*link != entry) link = &(*link)->next;
+        *link = entry->next;
+        free(entry);
+    }
+    pthread_mutex_unlock(&shared_lock);
 }
 
 static LV2_Handle instantiate(
         const LV2_Descriptor *descriptor, double rate, const char *bundle_path,
         const LV2_Feature * const *features) {
     LV2_URID_Map *map = NULL;
+    LV2_Log_Log *log = NULL;
+    LV2_Worker_Schedule *schedule = NULL;
     for (size_t i = 0; features[i] != NULL; i++) {
         if (strcmp(features[i]->URI, LV2_URID_URI "#map") == 0) {
             map = (LV2_URID_Map *)features[i]->data;
+        } else if (strcmp(features[i]->URI, LV2_LOG__log) == 0) {
+            log = (LV2_Log_Log *)features[i]->data;
+        } else if (strcmp(features[i]->URI, LV2_WORKER__schedule) == 0) {
+            schedule = (LV2_Worker_Schedule *)features[i]->data;
         }
     }
 
@@ -122,13 +185,33 @@ static LV2_Handle instantiate(
     }
 
     plugin->map = map;
-    plugin->sample_rate = rate;
-    map_uris(map, &plugin->uris);
+    plugin->log = log;
+    plugin->schedule = schedule;
+    plugin->shared_uris = acquire_shared_uris(map);
+    if (plugin->shared_uris == NULL) {
+        fprintf(stderr, "Not enough memory to allocate URID cache.\n");
+        free(plugin);
+        return NULL;
+    }
+    // Copied so that run() doesn't need to follow another pointer.
+    plugin->uris = plugin->shared_uris->uris;
+    if (!slide_core_init(&plugin->core, rate, &plugin->uris.core)) {
+        fprintf(stderr, "Not enough memory to allocate note buffer.\n");
+        release_shared_uris(plugin->shared_uris);
+        free(plugin);
+        return NULL;
+    }
+
+    open_trace(plugin);
     return (LV2_Handle)plugin;
 }
 
 static void connect_port(LV2_Handle instance, uint32_t port, void *data) {
     MidiSlide *plugin = (MidiSlide *)instance;
+    if (port < PORT_COUNT && (PORT_CONTROL_INPUTS >> port & 1)) {
+        plugin->trace.controls[port] = data;
+    }
+
     switch (port) {
         case PORT_INPUT:
             plugin->input = data;
@@ -136,471 +219,443 @@ static void connect_port(LV2_Handle instance, uint32_t port, void *data) {
         case PORT_OUTPUT:
             plugin->output = data;
             break;
-        case PORT_BEAT_DIVISOR:
-            plugin->beat_divisor = data;
-            break;
-        case PORT_BEND_SEMITONE_DISTANCE:
-            plugin->bend_semitone_distance = data;
-            break;
-        case PORT_FORCED_VELOCITY:
-            plugin->forced_velocity = data;
+        default:
+            slide_core_connect_port(&plugin->core, port, data);
             break;
     }
 }
 
 static void activate(LV2_Handle instance) {
     MidiSlide *plugin = (MidiSlide *)instance;
-    plugin->note_stack_size = 0;
-    plugin->samples_per_beat = plugin->sample_rate / 2;
-    plugin->samples_passed = 0;
-    plugin->samples_since_sent = 0;
-    plugin->message_interval = plugin->sample_rate / 500;
-    plugin->is_sliding = false;
-}
-
-static inline bool isAtomObject(uint32_t type, MidiSlideURIs *uris) {
-    return (
-        type == uris->atom_Object ||
-        type == uris->atom_Blank ||
-        type == uris->atom_Resource
+    // Buffers the controls already need are allocated here, where it is
+    // allowed, except those the worker is still allocating.
+    plugin->buffers_failed = 0;
+    slide_core_allocate_buffers(
+        &plugin->core, SLIDE_BUFFER_ALL & ~plugin->buffers_pending
     );
-}
-
-static inline const uint8_t *getMidiMessage(
-        const LV2_Atom_Event *event, MidiSlideURIs *uris) {
-    if (event->body.type != uris->midi_Event) return NULL;
-    return (const uint8_t *)(event + 1);
-}
-
-static inline const LV2_Atom_Object *getAtomObject(
-        const LV2_Atom_Event *event, MidiSlideURIs *uris) {
-    if (!isAtomObject(event->body.type, uris)) return NULL;
-    return (const LV2_Atom_Object *)&event->body;
+    slide_core_activate(&plugin->core);
+    record_trace(plugin, TRACE_ACTIVATE, 0, 0, 0);
 }
 
 static void run(LV2_Handle instance, uint32_t n_samples) {
     MidiSlide *plugin = (MidiSlide *)instance;
-    const uint32_t output_capacity = plugin->output[0].atom.size;
-
-    lv2_atom_sequence_clear(plugin->output);
-    plugin->output->atom.type = plugin->input->atom.type;
-
-    const LV2_Atom_Sequence *input = plugin->input;
-    const LV2_Atom_Event *event = lv2_atom_sequence_begin(&input->body);
-    uint32_t last_frames = 0;
-
-    while (!lv2_atom_sequence_is_end(&input->body, input->atom.size, event)) {
-        uint32_t frames = event->time.frames;
-        uint32_t frame_diff = frames - last_frames;
-        last_frames = frames;
-        event = run_body(plugin, frame_diff, event, frames, output_capacity);
-    }
-
-    if (last_frames < n_samples) {
-        run_body(
-            plugin, n_samples - last_frames, event, last_frames,
-            output_capacity
+    // The trace records the input before the core reads it.
+    record_trace(plugin, TRACE_RUN, n_samples, plugin->output->atom.size, 0);
+    slide_core_run(&plugin->core, plugin->input, plugin->output, n_samples);
+    request_buffers(plugin);
+    send_diagnostics(plugin, n_samples);
+    send_trace(plugin);
+}
+
+// Asks the worker to allocate the buffers that controls turned on since the
+// plugin was activated need. The features stay off until the buffers arrive.
+// Without a worker, they are allocated when the plugin is next activated.
+static inline void request_buffers(MidiSlide *plugin) {
+    if (plugin->schedule == NULL) return;
+    uint32_t missing = slide_core_missing_buffers(&plugin->core) & ~(
+        plugin->buffers_pending | plugin->buffers_failed
+    );
+    for (uint32_t kind = 1; kind <= missing; kind <<= 1) {
+        if (!(missing & kind)) continue;
+        BufferMessage message = {
+            .kind = WORK_BUFFER,
+            .buffer_kind = kind,
+        };
+        LV2_Worker_Status status = plugin->schedule->schedule_work(
+            plugin->schedule->handle, sizeof(message), &message
         );
+        // If the worker's queue is full, try again after the next block.
+        if (status == LV2_WORKER_SUCCESS) plugin->buffers_pending |= kind;
     }
 }
 
-static const LV2_Atom_Event *run_body(
-        MidiSlide *plugin, uint32_t n_samples,
-        const LV2_Atom_Event *start_event, uint32_t frames,
-        uint32_t output_capacity) {
-    const LV2_Atom_Sequence *input = plugin->input;
-    MidiNote *note_stack = plugin->note_stack;
-    uint8_t old_stack_size = plugin->note_stack_size;
-    uint8_t old_slide_base, old_slide_top = 0;
-    if (old_stack_size >= 2) {
-        old_slide_base = note_stack[old_stack_size - 2].key;
-        old_slide_top = note_stack[old_stack_size - 1].key;
-    }
-
-    const LV2_Atom_Event *event;
-    // Loop through events and handle atom objects and all MIDI messages except
-    // "note on" messages.
-    for (event = start_event;
-         !lv2_atom_sequence_is_end(&input->body, input->atom.size, event) && (
-             event->time.frames <= frames
-         ); event = lv2_atom_sequence_next(event)) {
-
-        const LV2_Atom_Object *object = getAtomObject(event, &plugin->uris);
-        if (object != NULL) {
-            handle_atom_object(plugin, object);
-            continue;
-        }
-
-        const uint8_t *midi_message = getMidiMessage(event, &plugin->uris);
-        if (midi_message != NULL) {
-            MidiAction action = get_midi_action(midi_message);
-            if (action == ACTION_NOTE_ON) continue;
-            bool handled = handle_midi_message(
-                plugin, midi_message, action, output_capacity
-            );
-            if (!handled) {
-                // Forward unchanged MIDI event.
-                lv2_atom_sequence_append_event(
-                    plugin->output, output_capacity, event
-                );
-            }
-            continue;
-        }
-    }
-
-    compact_stack(plugin);
-    // Whether or not a "note off" message should be sent.
-    bool note_stopped = old_stack_size > 0 && plugin->note_stack_size == 0;
-    bool force_bend_update = note_stopped || (old_stack_size >= 2 && (
-        plugin->note_stack_size < 2 ||
-        old_slide_base != note_stack[plugin->note_stack_size - 2].key ||
-        old_slide_top != note_stack[plugin->note_stack_size - 1].key
-    ));
-
-    if (force_bend_update) plugin->is_sliding = false;
-    old_stack_size = plugin->note_stack_size;
-
-    // Loop through events and handle MIDI "note on" messages.
-    for (event = start_event;
-         !lv2_atom_sequence_is_end(&input->body, input->atom.size, event) && (
-             event->time.frames <= frames
-         ); event = lv2_atom_sequence_next(event)) {
-
-        const uint8_t *midi_message = getMidiMessage(event, &plugin->uris);
-        if (midi_message == NULL) continue;
-        if (get_midi_action(midi_message) != ACTION_NOTE_ON) continue;
-        handle_midi_message(
-            plugin, midi_message, ACTION_NOTE_ON, output_capacity
-        );
-    }
-
-    bool note_started = old_stack_size == 0 && plugin->note_stack_size > 0;
-    // If multiple notes were added at the same time, pick the one with the
-    // lowest velocity and move it to the top (end) of the stack.
-    move_primary_to_stack_top(plugin, old_stack_size);
-    if (plugin->note_stack_size > old_stack_size) {
-        // At least one note was added.
-        plugin->samples_passed = 0;
-        force_bend_update = true;
-        if (plugin->note_stack_size >= 2) {
-            plugin->is_sliding = true;
-        }
-    }
-
-    plugin->samples_since_sent += n_samples;
-    while (force_bend_update ||
-           plugin->samples_since_sent >= plugin->message_interval) {
-
-        bool old_force_update = force_bend_update;
-        force_bend_update = false;
-        if (!old_force_update) {
-            plugin->samples_since_sent -= plugin->message_interval;
-        }
-
-        if (old_force_update && note_stopped) {
-            stop_note(plugin, frames, output_capacity);
-        }
-        if (plugin->note_stack_size == 0) continue;
-
-        if (old_force_update && note_started) {
-            MidiNote *note;
-            if (plugin->note_stack_size >= 2) {
-                note = &note_stack[plugin->note_stack_size - 2];
-            } else {
-                note = &note_stack[0];
-            }
-
-            uint8_t key = note->key;
-            uint8_t velocity = note->velocity;
-            set_bend(plugin, 0, frames, output_capacity);
-            play_note(plugin, key, velocity, frames, output_capacity);
-            continue;
-        }
-
-        if (old_force_update && !plugin->is_sliding) {
-            uint8_t key = note_stack[plugin->note_stack_size - 1].key;
-            set_bend_from_key(plugin, key, frames, output_capacity);
-            continue;
-        }
-        if (!plugin->is_sliding) continue;
-
-        MidiNote *note = &note_stack[plugin->note_stack_size - 1];
-        bool continue_slide = set_bend_from_slide(
-            plugin, note->key, note->velocity, (note - 1)->key, frames,
-            output_capacity
-        );
-        if (!continue_slide) plugin->is_sliding = false;
-
-        if (old_force_update) {
-        } else {
-            if (plugin->is_sliding) {
-                plugin->samples_passed += plugin->message_interval;
-            }
-        }
-    }
-
-    return event;
-}
-
-static inline void move_primary_to_stack_top(
-        MidiSlide *plugin, uint8_t start_at) {
-    uint8_t note_stack_size = plugin->note_stack_size;
-    #pragma GCC diagnostic push
-    #pragma GCC diagnostic ignored "-Wstrict-overflow"
-        if (note_stack_size <= 1) return;
-        if (start_at > note_stack_size - 2) return;
-    #pragma GCC diagnostic pop
-    MidiNote *note_stack = plugin->note_stack;
-
-    uint8_t min_vel_index = note_stack_size - 1;
-    uint8_t min_vel = note_stack[min_vel_index].velocity;
-    for (int i = min_vel_index; i >= start_at; i--) {
-        uint8_t velocity = note_stack[i].velocity;
-        if (velocity < min_vel) {
-            min_vel = velocity;
-            min_vel_index = (uint8_t)i;
-        }
+// Hands pending diagnostics to the host's worker thread, which logs them.
+// Without a worker, they are logged when the plugin is deactivated.
+static inline void send_diagnostics(MidiSlide *plugin, uint32_t n_samples) {
+    uint32_t report_interval = (
+        plugin->core.sample_rate / DIAG_REPORTS_PER_SECOND
+    );
+    if (plugin->samples_since_report < report_interval) {
+        plugin->samples_since_report += n_samples;
     }
 
-    if (min_vel_index < note_stack_size - 1) {
-        MidiNote temp = note_stack[note_stack_size - 1];
-        note_stack[note_stack_size - 1] = note_stack[min_vel_index];
-        note_stack[min_vel_index] = temp;
+    DiagReport *report = &plugin->core.diagnostics;
+    if (report->n_records == 0 || plugin->schedule == NULL) return;
+    if (plugin->samples_since_report < report_interval) return;
 
-        uint8_t *key_to_pos = plugin->key_to_stack_pos;
-        key_to_pos[note_stack[note_stack_size - 1].key] = note_stack_size - 1;
-        key_to_pos[note_stack[min_vel_index].key] = min_vel_index;
+    report->kind = WORK_DIAGNOSTICS;
+    uint32_t size = (
+        offsetof(DiagReport, records) +
+        report->n_records * sizeof(DiagRecord)
+    );
+    LV2_Worker_Status status = plugin->schedule->schedule_work(
+        plugin->schedule->handle, size, report
+    );
+    // If the worker's queue is full, try again after the next block.
+    if (status != LV2_WORKER_SUCCESS) return;
+    memset(report, 0, sizeof(*report));
+    plugin->samples_since_report = 0;
+}
+
+static void log_message(
+        MidiSlide *plugin, LV2_URID type, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (plugin->log != NULL) {
+        plugin->log->vprintf(plugin->log->handle, type, format, args);
+    } else {
+        vfprintf(stderr, format, args);
     }
+    va_end(args);
 }
 
-static inline bool set_bend_from_slide(
-        MidiSlide *plugin, uint8_t key, uint8_t velocity, uint8_t base_key,
-        uint32_t frames, uint32_t output_capacity) {
-    float beat_divisor = *plugin->beat_divisor;
-    uint32_t samples_per_beat = plugin->samples_per_beat;
-    uint32_t slide_duration = (samples_per_beat * velocity) / beat_divisor;
-    uint32_t samples_passed = plugin->samples_passed;
-    if (samples_passed > slide_duration * 2) return false;
-    if (samples_passed > slide_duration) {
-        samples_passed = 2 * slide_duration - samples_passed;
-    }
-
-    int key_diff = (int)key - base_key;
-    int key_offset = (int)base_key - plugin->key_playing;
-    if (abs(key_offset) > *plugin->bend_semitone_distance) return false;
-    if (abs(key_diff + key_offset) > *plugin->bend_semitone_distance) {
-        return false;
-    }
-
-    double relative_key = (
-        ((double)samples_passed / slide_duration) * key_diff + key_offset
+// Logs a line from the core.
+static void log_line(void *handle, bool warning, const char *line) {
+    MidiSlide *plugin = handle;
+    LV2_URID type = (
+        warning ? plugin->uris.log_Warning : plugin->uris.log_Error
     );
-    int bend_value = relative_key_to_bend(plugin, relative_key);
-    set_bend(plugin, bend_value, frames, output_capacity);
-    return true;
+    log_message(plugin, type, "%s", line);
 }
 
-static inline void set_bend_from_key(
-        MidiSlide *plugin, uint8_t key, uint32_t frames,
-        uint32_t output_capacity) {
-    int relative_key = (int)key - plugin->key_playing;
-    if (abs(relative_key) > *plugin->bend_semitone_distance) return;
-    int bend_value = relative_key_to_bend(plugin, relative_key);
-    set_bend(plugin, bend_value, frames, output_capacity);
+static void log_diagnostics(MidiSlide *plugin, const DiagReport *report) {
+    slide_core_log_diagnostics(report, log_line, plugin);
 }
 
-static inline int relative_key_to_bend(
-        MidiSlide *plugin, double relative_key) {
-    int bend_multiplier = relative_key < 0 ? 8192 : 8191;
-    return bend_multiplier * relative_key / *plugin->bend_semitone_distance;
-}
+// The value of TRACE_ENV_VAR, read once for all instances, or null if no
+// trace is recorded.
+static pthread_once_t trace_prefix_once = PTHREAD_ONCE_INIT;
+static const char *trace_prefix = NULL;
 
-static inline void init_midi_event(
-        MidiSlide *plugin, MidiEvent *event, uint32_t frames) {
-    event->event.time.frames = frames;
-    event->event.body.type = plugin->uris.midi_Event;
-    event->event.body.size = 3;
+static void read_trace_prefix(void) {
+    const char *prefix = getenv(TRACE_ENV_VAR);
+    if (prefix != NULL && prefix[0] != '\0') trace_prefix = prefix;
 }
 
-static inline void set_bend(
-        MidiSlide *plugin, int value, uint32_t frames,
-        uint32_t output_capacity) {
-    uint16_t real_bend = value + 8192;
-    MidiEvent event;
-    init_midi_event(plugin, &event, frames);
-    event.message[0] = LV2_MIDI_MSG_BENDER;
-    event.message[1] = real_bend & 0x7f;
-    event.message[2] = (real_bend >> 7) & 0x7f;
-    send_midi_message(plugin, &event, output_capacity);
-}
-
-static inline void play_note(
-        MidiSlide *plugin, uint8_t key, uint8_t velocity, uint32_t frames,
-        uint32_t output_capacity) {
-    MidiEvent event;
-    init_midi_event(plugin, &event, frames);
-    plugin->key_playing = key;
-    if (*plugin->forced_velocity > 0) velocity = *plugin->forced_velocity;
-    event.message[0] = LV2_MIDI_MSG_NOTE_ON;
-    event.message[1] = key;
-    event.message[2] = velocity;
-    send_midi_message(plugin, &event, output_capacity);
-}
-
-static inline void stop_note(
-        MidiSlide *plugin, uint32_t frames, uint32_t output_capacity) {
-    MidiEvent event;
-    init_midi_event(plugin, &event, frames);
-    event.message[0] = LV2_MIDI_MSG_NOTE_OFF;
-    event.message[1] = plugin->key_playing;
-    event.message[2] = 0;  // For now, zero velocity.
-    send_midi_message(plugin, &event, output_capacity);
-}
+// Opens the trace file if recording was requested with TRACE_ENV_VAR. A trace
+// is only recorded if the host provides a worker, so the audio thread never
+// writes to the file itself.
+static void open_trace(MidiSlide *plugin) {
+    static uint32_t instance_count = 0;
+    pthread_once(&trace_prefix_once, read_trace_prefix);
+    const char *prefix = trace_prefix;
+    if (prefix == NULL) return;
+    if (plugin->schedule == NULL) {
+        log_message(
+            plugin, plugin->uris.log_Warning, "Warning: Host does not "
+            "support the worker extension; not recording a trace.\n"
+        );
+        return;
+    }
 
-static inline void send_midi_message(
-        MidiSlide *plugin, MidiEvent *event, uint32_t output_capacity) {
-    LV2_Atom_Event *result = lv2_atom_sequence_append_event(
-        plugin->output, output_capacity, &event->event
+    char path[4096];
+    snprintf(
+        path, sizeof(path), "%s.%" PRIu32 ".trace", prefix,
+        __sync_add_and_fetch(&instance_count, 1)
     );
-    if (result == NULL) {
-        fprintf(stderr, "Error: Could not append atom event.\n");
+    TraceState *trace = &plugin->trace;
+    trace->data = malloc(TRACE_BUFFER_SIZE);
+    FILE *file = trace->data != NULL ? fopen(path, "wb") : NULL;
+    if (file == NULL) {
+        log_message(
+            plugin, plugin->uris.log_Error,
+            "Error: Could not open trace file %s.\n", path
+        );
+        free(trace->data);
+        trace->data = NULL;
+        return;
     }
-}
 
-static inline bool handle_midi_message(
-        MidiSlide *plugin, const uint8_t *message, MidiAction action,
-        uint32_t output_capacity) {
-    switch (action) {
-        case ACTION_NOTE_ON:
-            handle_note_on(plugin, message[1], message[2]);
-            break;
-        case ACTION_NOTE_OFF:
-            handle_note_off(plugin, message[1]);
-            break;
-        case ACTION_ALL_NOTES_OFF:
-            handle_all_notes_off(plugin);
-            break;
-        default:
-            return false;
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .port_count = PORT_COUNT,
+        .sample_rate = plugin->core.sample_rate,
+        .n_uris = URI_TABLE_SIZE,
+    };
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; success && i < URI_TABLE_SIZE; i++) {
+        static const uint8_t padding[8];
+        TraceURI uri = {
+            .urid = *uri_table_urid(&plugin->uris, i),
+            .size = strlen(uri_table[i].uri),
+        };
+        size_t padding_size = TRACE_PAD_SIZE(uri.size) - uri.size;
+        success = (
+            fwrite(&uri, sizeof(uri), 1, file) == 1 &&
+            fwrite(uri_table[i].uri, 1, uri.size, file) == uri.size &&
+            fwrite(padding, 1, padding_size, file) == padding_size
+        );
     }
-    return true;
-}
 
-static inline MidiAction get_midi_action(const uint8_t *message) {
-    uint8_t message_type = message[0] & 0xF0;
-    switch (message_type) {
-        case LV2_MIDI_MSG_NOTE_ON:
-            return ACTION_NOTE_ON;
-        case LV2_MIDI_MSG_NOTE_OFF:
-            return ACTION_NOTE_OFF;
-        case LV2_MIDI_MSG_CONTROLLER: ;
-            uint8_t controller = message[1];
-            if (controller >= LV2_MIDI_CTL_ALL_NOTES_OFF &&
-                controller <= LV2_MIDI_CTL_MONO2) {
-                // All messages in this range turn off notes.
-                return ACTION_ALL_NOTES_OFF;
-            }
-            break;
+    if (!success) {
+        log_message(
+            plugin, plugin->uris.log_Error,
+            "Error: Could not write trace file %s.\n", path
+        );
+        fclose(file);
+        free(trace->data);
+        trace->data = NULL;
+        return;
     }
-    return ACTION_UNKNOWN;
-}
-
-static inline void handle_note_on(
-        MidiSlide *plugin, uint8_t key, uint8_t velocity) {
-    add_to_stack(plugin, key, velocity);
-}
-
-static inline void handle_note_off(MidiSlide *plugin, uint8_t key) {
-    remove_from_stack(plugin, key);
-}
-
-static inline void handle_all_notes_off(MidiSlide *plugin) {
-    clear_stack(plugin);
-}
-
-static inline void add_to_stack(
-        MidiSlide *plugin, uint8_t key, uint8_t velocity) {
+    trace->file = file;
+    trace->all_controls = true;
+}
+
+// Adds `size` bytes to the trace buffer, wrapping around at its end. The
+// caller must have checked that there is room.
+static inline void append_trace(
+        TraceState *trace, const void *data, uint32_t size) {
+    uint32_t offset = trace->write % TRACE_BUFFER_SIZE;
+    uint32_t first = TRACE_BUFFER_SIZE - offset;
+    if (first > size) first = size;
+    memcpy(trace->data + offset, data, first);
+    memcpy(trace->data, (const uint8_t *)data + first, size - first);
+    trace->write += size;
+}
+
+// Adds a record to the trace, if one is being recorded. For TRACE_RUN
+// records, this must be called before run() reads any input.
+static inline void record_trace(
+        MidiSlide *plugin, TraceRecordType type, uint32_t n_samples,
+        uint32_t output_capacity, uint32_t buffer_kind) {
+    TraceState *trace = &plugin->trace;
+    if (trace->file == NULL) return;
+    TraceRecord record = {
+        .type = type,
+        .n_samples = n_samples,
+        .output_capacity = output_capacity,
+        .buffer_kind = buffer_kind,
+    };
 
-    uint8_t stack_size = plugin->note_stack_size;
-    if (stack_size >= 128) {
-        fprintf(stderr, "Error: Note stack is full.\n");
-        return;
+    // One extra value, for padding.
+    float values[PORT_COUNT + 1] = {0};
+    uint32_t n_values = 0;
+    if (type != TRACE_BUFFER) {
+        // Activation records include every control that is connected, as
+        // activate() allocates the buffers the controls need.
+        bool all_controls = trace->all_controls || type == TRACE_ACTIVATE;
+        for (uint32_t port = 0; port < PORT_COUNT; port++) {
+            if (!(PORT_CONTROL_INPUTS >> port & 1)) continue;
+            if (trace->controls[port] == NULL) continue;
+            // Compared bitwise, so the replayed values are identical.
+            float value = *trace->controls[port];
+            if (!all_controls && memcmp(
+                    &value, &trace->values[port], sizeof(value)) == 0) {
+                continue;
+            }
+            record.changed_controls |= (uint32_t)1 << port;
+            values[n_values++] = value;
+        }
+    }
+    if (type == TRACE_RUN) {
+        record.events_size = (
+            plugin->input->atom.size - sizeof(LV2_Atom_Sequence_Body)
+        );
     }
 
-    uint8_t old_stack_pos = plugin->key_to_stack_pos[key];
-    if (old_stack_pos < plugin->note_stack_size &&
-        plugin->note_stack[old_stack_pos].key == key) {
-        // Note is already in the stack.
-        fprintf(stderr, "Error: Note is already in stack.\n");
+    uint32_t values_size = TRACE_PAD_SIZE(n_values * sizeof(float));
+    uint32_t events_size = TRACE_PAD_SIZE(record.events_size);
+    uint64_t size = sizeof(record) + values_size + events_size;
+    if (trace->gap) size += sizeof(TraceRecord);
+    if (size > TRACE_BUFFER_SIZE - (trace->write - trace->read)) {
+        // Only this record is dropped. The controls it changed are still
+        // included in the next record, as `values` isn't updated.
+        trace->gap = true;
+        if (type == TRACE_RUN) {
+            uint32_t room = UINT32_MAX - trace->gap_samples;
+            trace->gap_samples += n_samples < room ? n_samples : room;
+        }
+        trace->dropped++;
+        slide_core_report_diagnostic(&plugin->core, DIAG_TRACE_FULL, 0);
         return;
     }
 
-    plugin->note_stack[stack_size] = (MidiNote){
-        .active = true,
-        .key = key,
-        .velocity = velocity,
-    };
-    plugin->key_to_stack_pos[key] = stack_size;
-    plugin->note_stack_size++;
+    if (trace->gap) {
+        TraceRecord gap = {
+            .type = TRACE_GAP,
+            .n_samples = trace->gap_samples,
+        };
+        append_trace(trace, &gap, sizeof(gap));
+        trace->gap = false;
+        trace->gap_samples = 0;
+    }
+    static const uint8_t padding[8];
+    append_trace(trace, &record, sizeof(record));
+    append_trace(trace, values, values_size);
+    append_trace(
+        trace, lv2_atom_sequence_begin(&plugin->input->body),
+        record.events_size
+    );
+    append_trace(trace, padding, events_size - record.events_size);
+    for (uint32_t port = 0; port < PORT_COUNT; port++) {
+        if (record.changed_controls >> port & 1) {
+            trace->values[port] = *trace->controls[port];
+        }
+    }
+    // A buffer arriving doesn't change which controls the next run record
+    // must include.
+    if (type != TRACE_BUFFER) trace->all_controls = type == TRACE_ACTIVATE;
+}
+
+// Hands new trace records to the worker, which writes them to the file.
+static inline void send_trace(MidiSlide *plugin) {
+    TraceState *trace = &plugin->trace;
+    if (trace->file == NULL) return;
+    TraceChunk chunk;
+    chunk.kind = WORK_TRACE;
+    while (trace->read != trace->write) {
+        // A chunk ends at the end of the buffer, so it is copied in one
+        // piece.
+        uint32_t offset = trace->read % TRACE_BUFFER_SIZE;
+        chunk.size = trace->write - trace->read;
+        if (chunk.size > TRACE_BUFFER_SIZE - offset) {
+            chunk.size = TRACE_BUFFER_SIZE - offset;
+        }
+        if (chunk.size > TRACE_CHUNK_SIZE) chunk.size = TRACE_CHUNK_SIZE;
+        memcpy(chunk.data, trace->data + offset, chunk.size);
+        LV2_Worker_Status status = plugin->schedule->schedule_work(
+            plugin->schedule->handle,
+            offsetof(TraceChunk, data) + chunk.size, &chunk
+        );
+        // If the worker's queue is full, try again after the next block.
+        if (status != LV2_WORKER_SUCCESS) return;
+        trace->read += chunk.size;
+    }
 }
 
-static inline void remove_from_stack(MidiSlide *plugin, uint8_t key) {
-    uint8_t stack_pos = plugin->key_to_stack_pos[key];
-    uint8_t stack_size = plugin->note_stack_size;
+static void write_trace(
+        MidiSlide *plugin, const uint8_t *data, uint32_t size) {
+    TraceState *trace = &plugin->trace;
+    if (trace->write_failed) return;
+    if (fwrite(data, 1, size, trace->file) == size) return;
+    trace->write_failed = true;
+    log_message(
+        plugin, plugin->uris.log_Error,
+        "Error: Could not write trace; recording stopped.\n"
+    );
+}
 
-    if (stack_pos >= stack_size) {
-        fprintf(stderr, "Error: Note is not in stack.\n");
-        return;
+// Writes the records not yet sent to the worker and closes the trace.
+static void close_trace(MidiSlide *plugin) {
+    TraceState *trace = &plugin->trace;
+    if (trace->file == NULL) return;
+    uint32_t offset = trace->read % TRACE_BUFFER_SIZE;
+    uint32_t size = trace->write - trace->read;
+    uint32_t first = TRACE_BUFFER_SIZE - offset;
+    if (first > size) first = size;
+    write_trace(plugin, trace->data + offset, first);
+    write_trace(plugin, trace->data, size - first);
+    if (trace->gap) {
+        TraceRecord gap = {
+            .type = TRACE_GAP,
+            .n_samples = trace->gap_samples,
+        };
+        write_trace(plugin, (const uint8_t *)&gap, sizeof(gap));
     }
-
-    if (plugin->note_stack[stack_pos].key != key) {
-        fprintf(stderr, "Error: Note is not in stack.\n");
-        return;
+    if (trace->dropped > 0) {
+        log_message(
+            plugin, plugin->uris.log_Warning, "Warning: %" PRIu32 " trace "
+            "records were dropped because the trace buffer was full.\n",
+            trace->dropped
+        );
     }
-
-    plugin->note_stack[stack_pos].active = false;
+    fclose(trace->file);
+    free(trace->data);
+    trace->file = NULL;
+    trace->data = NULL;
 }
 
-static inline void clear_stack(MidiSlide *plugin) {
-    plugin->note_stack_size = 0;
-}
+static LV2_Worker_Status work(
+        LV2_Handle instance, LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle handle, uint32_t size, const void *data) {
+    MidiSlide *plugin = (MidiSlide *)instance;
+    uint32_t kind;
+    if (size < sizeof(kind)) return LV2_WORKER_ERR_UNKNOWN;
+    memcpy(&kind, data, sizeof(kind));
+    if (kind == WORK_BUFFER) {
+        BufferMessage message;
+        if (size != sizeof(message)) return LV2_WORKER_ERR_UNKNOWN;
+        memcpy(&message, data, size);
+        message.buffer = slide_core_new_buffer(
+            message.buffer_kind, plugin->core.sample_rate
+        );
+        if (message.buffer == NULL) {
+            log_message(
+                plugin, plugin->uris.log_Error,
+                "Error: Not enough memory to turn on %s.\n",
+                message.buffer_kind == SLIDE_BUFFER_LOOKAHEAD ?
+                    "lookahead" : "controller coalescing"
+            );
+        }
+        return respond(handle, sizeof(message), &message);
+    }
 
-static inline void compact_stack(MidiSlide *plugin) {
-    MidiNote *stack = plugin->note_stack;
-    uint8_t *key_to_stack_pos = plugin->key_to_stack_pos;
-    uint8_t stack_size = plugin->note_stack_size;
-    uint8_t offset = 0;
-    for (uint8_t i = 0; i + offset < stack_size; i++) {
-        while (i + offset < stack_size && !stack[i + offset].active) {
-            offset++;
+    if (kind == WORK_TRACE) {
+        TraceChunk chunk;
+        if (size > sizeof(chunk)) return LV2_WORKER_ERR_UNKNOWN;
+        memcpy(&chunk, data, size);
+        if (chunk.size > size - offsetof(TraceChunk, data)) {
+            return LV2_WORKER_ERR_UNKNOWN;
         }
-        if (offset > 0 && i + offset < stack_size) {
-            stack[i] = stack[i + offset];
-            key_to_stack_pos[stack[i].key] = i;
+        if (plugin->trace.file != NULL) {
+            write_trace(plugin, chunk.data, chunk.size);
         }
+        return LV2_WORKER_SUCCESS;
     }
-    plugin->note_stack_size -= offset;
+
+    DiagReport report;
+    if (size > sizeof(report)) return LV2_WORKER_ERR_UNKNOWN;
+    memset(&report, 0, sizeof(report));
+    memcpy(&report, data, size);
+    log_diagnostics(plugin, &report);
+    return LV2_WORKER_SUCCESS;
 }
 
-static inline void handle_atom_object(
-        MidiSlide *plugin, const LV2_Atom_Object *object) {
-    if (object->body.otype != plugin->uris.time_Position) return;
-    LV2_Atom *bpm = NULL;
-    lv2_atom_object_get(object, plugin->uris.time_beatsPerMinute, &bpm, NULL);
-    if (bpm == NULL) return;
-    float bpm_float = ((LV2_Atom_Float *)bpm)->body;
-    plugin->samples_per_beat = 60.0 / bpm_float * plugin->sample_rate;
+static LV2_Worker_Status work_response(
+        LV2_Handle instance, uint32_t size, const void *body) {
+    MidiSlide *plugin = (MidiSlide *)instance;
+    BufferMessage message;
+    if (size != sizeof(message)) return LV2_WORKER_ERR_UNKNOWN;
+    memcpy(&message, body, size);
+    if (message.kind != WORK_BUFFER) return LV2_WORKER_ERR_UNKNOWN;
+
+    plugin->buffers_pending &= ~message.buffer_kind;
+    if (message.buffer == NULL) {
+        plugin->buffers_failed |= message.buffer_kind;
+        return LV2_WORKER_SUCCESS;
+    }
+    slide_core_set_buffer(&plugin->core, message.buffer_kind, message.buffer);
+    record_trace(plugin, TRACE_BUFFER, 0, 0, message.buffer_kind);
+    return LV2_WORKER_SUCCESS;
 }
 
 static void deactivate(LV2_Handle instance) {
+    MidiSlide *plugin = (MidiSlide *)instance;
+    // Not in the audio thread, so anything not yet sent to the worker can
+    // be logged directly.
+    SlideCore *core = &plugin->core;
+    log_diagnostics(plugin, &core->diagnostics);
+    memset(&core->diagnostics, 0, sizeof(core->diagnostics));
+    slide_core_log_output_stats(&core->output_stats, log_line, plugin);
 }
 
 static void cleanup(LV2_Handle instance) {
     MidiSlide *plugin = (MidiSlide *)instance;
+    close_trace(plugin);
+    slide_core_destroy(&plugin->core);
+    release_shared_uris(plugin->shared_uris);
     free(plugin);
 }
 
 static const void *extension_data(const char *uri) {
+    static const LV2_Worker_Interface worker = {
+        work,
+        work_response,
+        NULL,
+    };
+
+    if (strcmp(uri, LV2_WORKER__interface) == 0) return &worker;
     return NULL;
 }
 
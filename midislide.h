@@ -20,65 +20,111 @@
 #ifndef MIDISLIDE_H
 #define MIDISLIDE_H
 
-#include "ports.h"
+#include "core.h"
+#include "trace.h"
 #include <lv2/lv2plug.in/ns/lv2core/lv2.h>
-#include <lv2/lv2plug.in/ns/ext/atom/util.h>
-#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/log/log.h>
 #include <lv2/lv2plug.in/ns/ext/time/time.h>
 #include <lv2/lv2plug.in/ns/ext/urid/urid.h>
-#include <inttypes.h>
-#include <stdbool.h>
-#include <stdlib.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+#include <stdio.h>
 
 typedef struct {
-    LV2_URID midi_Event;
-    LV2_URID atom_Float;
-    LV2_URID time_Position;
-    LV2_URID time_beatsPerMinute;
-    LV2_URID atom_Object;
-    LV2_URID atom_Blank;
-    LV2_URID atom_Resource;
+    SlideURIs core;
+    LV2_URID log_Error;
+    LV2_URID log_Warning;
 } MidiSlideURIs;
 
-typedef struct {
-    bool active;
-    uint8_t key;
-    uint8_t velocity;
-} MidiNote;
+// URIDs mapped by one host's URID map, shared by all instances that use it.
+// Entries are kept in a process-wide list (see acquire_shared_uris()).
+typedef struct SharedURIs {
+    struct SharedURIs *next;
+    LV2_URID_Map_Handle handle;
+    LV2_URID (*map)(LV2_URID_Map_Handle, const char *);
+    // Number of instances using the entry.
+    size_t references;
+    MidiSlideURIs uris;
+} SharedURIs;
 
+// Kinds of messages sent to the worker. Each message starts with its kind.
 typedef enum {
-    ACTION_UNKNOWN,
-    ACTION_NOTE_ON,
-    ACTION_NOTE_OFF,
-    ACTION_ALL_NOTES_OFF,
-} MidiAction;
+    WORK_DIAGNOSTICS,
+    WORK_TRACE,
+    WORK_BUFFER,
+} WorkKind;
 
+// Asks the worker to allocate a buffer the core is missing (see
+// SlideBufferKind). The worker sends it back with `buffer` set, or null if
+// memory couldn't be allocated.
 typedef struct {
-    LV2_Atom_Event event;
-    uint8_t message[3];
-} MidiEvent;
+    uint32_t kind;
+    uint32_t buffer_kind;
+    void *buffer;
+} BufferMessage;
+
+// Size of the ring buffer in which the audio thread collects trace records.
+// Must be a power of two.
+#define TRACE_BUFFER_SIZE (1 << 20)
 
+// Maximum amount of trace data sent to the worker in one message. Records
+// larger than this are split across messages. Hosts' worker queues can be
+// small (4096 bytes in Jalv), so a chunk leaves room for other messages.
+#define TRACE_CHUNK_SIZE 2048
+
+// Message sent to the worker with the next part of the trace.
 typedef struct {
-    const float *beat_divisor;
-    const float *bend_semitone_distance;
-    const float *forced_velocity;
+    uint32_t kind;
+    uint32_t size;
+    uint8_t data[TRACE_CHUNK_SIZE];
+} TraceChunk;
+
+// State for recording an input trace (see trace.h). Records are collected in
+// the audio thread and written to the file by the worker.
+typedef struct {
+    // Null if no trace is being recorded.
+    FILE *file;
+    // Whether writing to the file failed. Only used by the worker.
+    bool write_failed;
+    // Ring buffer of TRACE_BUFFER_SIZE bytes. `write` and `read` count the
+    // bytes added and sent to the worker since recording started; the bytes
+    // not yet sent are at [read, write), modulo TRACE_BUFFER_SIZE.
+    uint8_t *data;
+    uint32_t write;
+    uint32_t read;
+    // Set when a record didn't fit in the buffer and was dropped. The next
+    // record that fits is preceded by a TRACE_GAP record covering the
+    // `gap_samples` samples of the dropped run records.
+    bool gap;
+    uint32_t gap_samples;
+    // Number of records dropped since recording started.
+    uint32_t dropped;
+    // Whether the next record must include every control.
+    bool all_controls;
+    // Input control ports, by index, and their values in the last record.
+    const float *controls[PORT_COUNT];
+    float values[PORT_COUNT];
+} TraceState;
+
+// The LV2 plugin: the slide core (see core.h), plus what it needs to talk to
+// the host.
+typedef struct {
+    SlideCore core;
 
     LV2_URID_Map *map;
+    LV2_Log_Log *log;
+    LV2_Worker_Schedule *schedule;
     const LV2_Atom_Sequence *input;
     LV2_Atom_Sequence *output;
     MidiSlideURIs uris;
+    SharedURIs *shared_uris;
 
-    uint32_t sample_rate;
-    uint32_t samples_per_beat;
-    uint32_t samples_passed;
-    uint32_t samples_since_sent;
-    uint32_t message_interval;
-    uint8_t key_playing;
-    bool is_sliding;
-
-    MidiNote note_stack[128];
-    uint8_t note_stack_size;
-    uint8_t key_to_stack_pos[128];
+    uint32_t samples_since_report;
+    // SlideBufferKinds requested from the worker and not yet received, and
+    // those the worker couldn't allocate, which aren't requested again until
+    // the plugin is reactivated.
+    uint32_t buffers_pending;
+    uint32_t buffers_failed;
+    TraceState trace;
 } MidiSlide;
 
 LV2_SYMBOL_EXPORT
@@ -28,6 +28,34 @@ enum {
     PORT_BEAT_DIVISOR = 2,
     PORT_BEND_SEMITONE_DISTANCE = 3,
     PORT_FORCED_VELOCITY = 4,
+    PORT_BEND_MODE = 5,
+    PORT_BEND_RATE = 6,
+    PORT_MIN_BEND_STEP = 7,
+    PORT_BENDS_MERGED = 8,
+    PORT_BENDS_DROPPED = 9,
+    PORT_PASSTHROUGH_DROPPED = 10,
+    PORT_NOTES_DELAYED = 11,
+    PORT_NOTES_DROPPED = 12,
+    PORT_SLIDE_CURVE = 13,
+    PORT_VOICE_MODE = 14,
+    PORT_MPE_CHANNELS = 15,
+    PORT_LOOKAHEAD = 16,
+    PORT_LATENCY = 17,
+    PORT_EVENTS_IN = 18,
+    PORT_EVENTS_OUT = 19,
+    PORT_BENDS_OUT = 20,
+    PORT_EVENTS_DROPPED = 21,
+    PORT_STACK_HIGH_WATER = 22,
+    PORT_SLIDES_OUT_OF_RANGE = 23,
+    PORT_RUN_CYCLES_MAX = 24,
+    PORT_RUN_CYCLES_AVG = 25,
+    PORT_OUTPUT_FORMAT = 26,
+    PORT_PITCH_CV = 27,
+    PORT_COALESCE_CONTROLLERS = 28,
+    PORT_COUNT = 29,
 };
 
+// Bit i is set if port i is an input control port.
+#define PORT_CONTROL_INPUTS 0x1401e0fcu
+
 #endif
@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Renders a Standard MIDI File through Midislide offline.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+#include "midislide.h"
+#include "smf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_BLOCK_SIZE 1024
+
+static void usage(const char *name) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] <input.mid> <output.mid> "
+        "[<input.mid> <output.mid> ...]\n"
+        "\n"
+        "Options:\n"
+        "  -r <rate>      Sample rate (default: %d)\n"
+        "  -b <frames>    Block size (default: %d)\n"
+        "  -d <value>     Beat divisor (default: 4)\n"
+        "  -s <value>     Pitch bend semitone distance (default: 12)\n"
+        "  -v <value>     Fixed velocity (default: 0)\n"
+        "  -m <mode>      Pitch bend mode: 0 = fixed rate, 1 = on change\n"
+        "                 (default: 0)\n"
+        "  -p <rate>      Pitch bend rate in Hz (default: 500)\n"
+        "  -t <step>      Minimum pitch bend step (default: 1)\n"
+        "  -c <curve>     Slide curve: 0 = linear, 1 = exponential,\n"
+        "                 2 = logarithmic, 3 = S-curve (default: 0)\n"
+        "  -M <mode>      Voice mode: 0 = monophonic, 1 = MPE,\n"
+        "                 2 = per channel (default: 0)\n"
+        "  -n <count>     MPE member channels (default: 15)\n"
+        "  -l <ms>        Lookahead in milliseconds (default: 0)\n"
+        "  -j <threads>   Threads used to render several files\n"
+        "                 (default: one per processor)\n"
+        "\n"
+        "All tracks are merged into one. The output file uses one tick per\n"
+        "sample, so event times match the plugin's output exactly. The\n"
+        "latency caused by lookahead is compensated for. Meta events other\n"
+        "than tempo changes, such as track names, time signatures and\n"
+        "markers, are copied to the output at the same times. Each pair of\n"
+        "files is rendered independently.\n",
+        name, DEFAULT_SAMPLE_RATE, DEFAULT_BLOCK_SIZE
+    );
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Chooses a division and tempo for which one tick is exactly one sample.
+static bool sample_division(
+        uint32_t sample_rate, uint16_t *division, uint32_t *tempo) {
+    uint32_t divisor = gcd(sample_rate, 1000000);
+    uint32_t ticks_step = sample_rate / divisor;
+    uint32_t tempo_step = 1000000 / divisor;
+    uint32_t max_factor = 0x7FFF / ticks_step;
+    if (0xFFFFFF / tempo_step < max_factor) {
+        max_factor = 0xFFFFFF / tempo_step;
+    }
+    if (max_factor == 0) return false;
+
+    // Prefer a tempo close to 120 BPM.
+    uint32_t factor = SMF_DEFAULT_TEMPO / tempo_step;
+    if (factor == 0) factor = 1;
+    if (factor > max_factor) factor = max_factor;
+    *division = ticks_step * factor;
+    *tempo = tempo_step * factor;
+    return true;
+}
+
+// A meta event from the input, such as a track name, time signature or
+// marker, waiting to be written to the output.
+typedef struct {
+    uint64_t time;
+    uint8_t type;
+    // Points into the input file, which stays mapped until it is closed.
+    const uint8_t *data;
+    uint32_t size;
+} PendingMeta;
+
+// A pair of files being rendered. The files are opened when the first event
+// is read and closed once the output is complete, so only the files of the
+// streams currently being rendered are open.
+typedef struct {
+    const char *input_path;
+    const char *output_path;
+    uint32_t sample_rate;
+    uint16_t division;
+    uint32_t tempo;
+    bool open;
+    SmfReader reader;
+    SmfTempoMap tempo_map;
+    // The event last read, which holds the data of the last input event.
+    SmfEvent event;
+    SmfWriter writer;
+    // Meta events don't go through the engine, so each is held here until the
+    // output reaches its time. The pending ones are
+    // metas[metas_start..n_metas).
+    PendingMeta *metas;
+    size_t metas_start;
+    size_t n_metas;
+    size_t metas_capacity;
+} FileStream;
+
+static bool open_files(FileStream *file) {
+    if (!smf_open(&file->reader, file->input_path)) return false;
+    if (!smf_writer_open(&file->writer, file->output_path, file->division)) {
+        smf_close(&file->reader);
+        return false;
+    }
+    smf_tempo_map_init(
+        &file->tempo_map, file->reader.division, file->sample_rate
+    );
+    smf_write_tempo(&file->writer, 0, file->tempo);
+    file->open = true;
+    return true;
+}
+
+static bool add_meta(FileStream *file, const SmfEvent *event) {
+    if (file->metas_start == file->n_metas) {
+        file->metas_start = 0;
+        file->n_metas = 0;
+    }
+    if (file->n_metas == file->metas_capacity) {
+        size_t capacity = file->metas_capacity * 2;
+        if (capacity == 0) capacity = 16;
+        PendingMeta *metas = realloc(
+            file->metas, capacity * sizeof(*metas)
+        );
+        if (metas == NULL) {
+            fprintf(stderr, "Error: Not enough memory for meta events.\n");
+            return false;
+        }
+        file->metas = metas;
+        file->metas_capacity = capacity;
+    }
+
+    PendingMeta *meta = &file->metas[file->n_metas++];
+    meta->time = smf_tempo_map_samples(&file->tempo_map, event->tick);
+    meta->type = event->meta_type;
+    meta->data = event->data;
+    meta->size = event->size;
+    return true;
+}
+
+// Writes the pending meta events up to and including `time`.
+static void write_metas(FileStream *file, uint64_t time) {
+    while (file->metas_start < file->n_metas) {
+        const PendingMeta *meta = &file->metas[file->metas_start];
+        if (meta->time > time) break;
+        smf_write_meta(
+            &file->writer, meta->time, meta->type, meta->data, meta->size
+        );
+        file->metas_start++;
+    }
+}
+
+static bool close_files(FileStream *file) {
+    if (!file->open) return true;
+    file->open = false;
+    write_metas(file, UINT64_MAX);
+    free(file->metas);
+    file->metas = NULL;
+    smf_close(&file->reader);
+    if (!smf_writer_close(&file->writer)) {
+        fprintf(stderr, "Error: Could not write %s.\n", file->output_path);
+        return false;
+    }
+    return true;
+}
+
+// Reads the next event of a MIDI file, with its time converted to samples.
+static MidislideReadResult read_event(void *handle, MidislideEvent *event) {
+    FileStream *file = handle;
+    if (!file->open && !open_files(file)) return MIDISLIDE_READ_ERROR;
+
+    SmfEvent *smf_event = &file->event;
+    while (smf_next_event(&file->reader, smf_event)) {
+        bool is_tempo = (
+            smf_event->type == SMF_EVENT_META &&
+            smf_event->meta_type == SMF_META_TEMPO
+        );
+        if (smf_event->type == SMF_EVENT_META && !is_tempo) {
+            // The output has its own end of track.
+            if (smf_event->meta_type == SMF_META_END_OF_TRACK) continue;
+            if (!add_meta(file, smf_event)) return MIDISLIDE_READ_ERROR;
+            continue;
+        }
+
+        uint32_t tempo = 0;
+        if (is_tempo) {
+            tempo = smf_event_tempo(smf_event);
+            if (tempo == 0) continue;
+            smf_tempo_map_set_tempo(&file->tempo_map, smf_event->tick, tempo);
+        }
+
+        event->time = smf_tempo_map_samples(
+            &file->tempo_map, smf_event->tick
+        );
+        event->ump = false;
+        if (is_tempo) {
+            event->size = 0;
+            event->bpm = 60000000.0 / tempo;
+            event->data = NULL;
+        } else {
+            event->size = smf_event->size;
+            event->bpm = 0;
+            event->data = smf_event->data;
+        }
+        return MIDISLIDE_READ_EVENT;
+    }
+    return file->reader.error ? MIDISLIDE_READ_ERROR : MIDISLIDE_READ_END;
+}
+
+static bool write_event(void *handle, const MidislideEvent *event) {
+    FileStream *file = handle;
+    if (event == NULL) return close_files(file);
+    write_metas(file, event->time);
+    smf_write_message(&file->writer, event->time, event->data, event->size);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t sample_rate = DEFAULT_SAMPLE_RATE;
+    uint32_t block_size = DEFAULT_BLOCK_SIZE;
+    float beat_divisor = 4;
+    float bend_semitone_distance = 12;
+    float forced_velocity = 0;
+    float bend_mode = BEND_MODE_FIXED;
+    float bend_rate = 500;
+    float min_bend_step = 1;
+    float slide_curve = SLIDE_CURVE_LINEAR;
+    float voice_mode = VOICE_MODE_MONO;
+    float mpe_channels = MAX_MPE_CHANNELS;
+    float lookahead = 0;
+    unsigned n_threads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:d:s:v:m:p:t:c:M:n:l:j:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                sample_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                beat_divisor = strtof(optarg, NULL);
+                break;
+            case 's':
+                bend_semitone_distance = strtof(optarg, NULL);
+                break;
+            case 'v':
+                forced_velocity = strtof(optarg, NULL);
+                break;
+            case 'm':
+                bend_mode = strtof(optarg, NULL);
+                break;
+            case 'p':
+                bend_rate = strtof(optarg, NULL);
+                break;
+            case 't':
+                min_bend_step = strtof(optarg, NULL);
+                break;
+            case 'c':
+                slide_curve = strtof(optarg, NULL);
+                break;
+            case 'M':
+                voice_mode = strtof(optarg, NULL);
+                break;
+            case 'n':
+                mpe_channels = strtof(optarg, NULL);
+                break;
+            case 'l':
+                lookahead = strtof(optarg, NULL);
+                break;
+            case 'j':
+                n_threads = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    size_t n_files = argc - optind;
+    if (
+        n_files == 0 || n_files % 2 != 0 || sample_rate == 0 ||
+        block_size == 0
+    ) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint16_t division;
+    uint32_t tempo;
+    if (!sample_division(sample_rate, &division, &tempo)) {
+        fprintf(
+            stderr, "Error: A sample rate of %" PRIu32 " Hz cannot be "
+            "represented exactly in a MIDI file.\n", sample_rate
+        );
+        return EXIT_FAILURE;
+    }
+
+    size_t n_streams = n_files / 2;
+    MidislideStream *streams = calloc(n_streams, sizeof(*streams));
+    FileStream *files = calloc(n_streams, sizeof(*files));
+    if (streams == NULL || files == NULL) {
+        fprintf(stderr, "Error: Not enough memory.\n");
+        free(streams);
+        free(files);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < n_streams; i++) {
+        FileStream *file = &files[i];
+        file->input_path = argv[optind + i * 2];
+        file->output_path = argv[optind + i * 2 + 1];
+        file->sample_rate = sample_rate;
+        file->division = division;
+        file->tempo = tempo;
+
+        MidislideStream *stream = &streams[i];
+        midislide_stream_init(stream, sample_rate);
+        stream->read = read_event;
+        stream->write = write_event;
+        stream->handle = file;
+        stream->block_size = block_size;
+        float *controls = stream->controls;
+        controls[PORT_BEAT_DIVISOR] = beat_divisor;
+        controls[PORT_BEND_SEMITONE_DISTANCE] = bend_semitone_distance;
+        controls[PORT_FORCED_VELOCITY] = forced_velocity;
+        controls[PORT_BEND_MODE] = bend_mode;
+        controls[PORT_BEND_RATE] = bend_rate;
+        controls[PORT_MIN_BEND_STEP] = min_bend_step;
+        controls[PORT_SLIDE_CURVE] = slide_curve;
+        controls[PORT_VOICE_MODE] = voice_mode;
+        controls[PORT_MPE_CHANNELS] = mpe_channels;
+        controls[PORT_LOOKAHEAD] = lookahead;
+    }
+
+    bool success = midislide_render_batch(streams, n_streams, n_threads);
+    for (size_t i = 0; i < n_streams; i++) {
+        // The files of streams that failed are still open.
+        close_files(&files[i]);
+        if (streams[i].success) continue;
+        fprintf(stderr, "Error: Could not render %s.\n", files[i].input_path);
+    }
+
+    free(streams);
+    free(files);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
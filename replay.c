@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Replays an input trace (see trace.h) through the plugin, repeating the
+// recorded calls to activate() and run() with the recorded block sizes,
+// controls, and input events. The output is summarized by a checksum, so runs
+// of different builds can be compared.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "host.h"
+#include "midislide.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+typedef struct {
+    // The whole file. Records are used in place.
+    uint8_t *data;
+    size_t size;
+    const TraceHeader *header;
+    // Offset of the first record.
+    size_t records_start;
+    // Offset of the end of the last complete record.
+    size_t records_end;
+    // Host URIDs for the recorded URIDs in the URI table, indexed by recorded
+    // URID (zero if not in the table).
+    LV2_URID *urids;
+    uint32_t n_urids;
+    // Number of TRACE_GAP records.
+    uint32_t n_gaps;
+} Trace;
+
+typedef struct {
+    uint64_t blocks;
+    uint64_t samples;
+    uint64_t events_out;
+    uint64_t checksum;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    // The plugin's counters after the first replay.
+    float counters[PORT_COUNT];
+} ReplayStats;
+
+static void usage(const char *name) {
+    fprintf(
+        stderr,
+        "Usage: %s [options] <trace>\n"
+        "\n"
+        "Options:\n"
+        "  -n <count>     Replay the trace this many times (default: 1)\n"
+        "  -d             Print each output event\n"
+        "\n"
+        "Traces are recorded by setting the " TRACE_ENV_VAR " environment\n"
+        "variable before starting the host. The output is the same for\n"
+        "every replay, and for builds that process events identically.\n",
+        name
+    );
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static inline uint64_t hash_bytes(
+        uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static bool read_file(Trace *trace, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open %s.\n", path);
+        return false;
+    }
+
+    size_t capacity = 0;
+    while (true) {
+        if (trace->size >= capacity) {
+            capacity = capacity * 2 + 65536;
+            uint8_t *data = realloc(trace->data, capacity);
+            if (data == NULL) {
+                fprintf(stderr, "Error: Not enough memory for trace.\n");
+                fclose(file);
+                return false;
+            }
+            trace->data = data;
+        }
+        size_t n_read = fread(
+            trace->data + trace->size, 1, capacity - trace->size, file
+        );
+        trace->size += n_read;
+        if (n_read == 0) break;
+    }
+
+    bool error = ferror(file);
+    fclose(file);
+    if (error) fprintf(stderr, "Error: Could not read %s.\n", path);
+    return !error;
+}
+
+// Returns the host URID for a recorded URID. URIDs that aren't in the trace's
+// URI table are mapped to URIs of their own, so they stay distinct.
+static LV2_URID translate_urid(Trace *trace, Host *host, LV2_URID urid) {
+    if (urid < trace->n_urids && trace->urids[urid] != 0) {
+        return trace->urids[urid];
+    }
+    char uri[64];
+    snprintf(uri, sizeof(uri), "urn:midislide:trace:urid:%" PRIu32, urid);
+    return host->map.map(host->map.handle, uri);
+}
+
+// Replaces the recorded URIDs in a record's events with the host's URIDs.
+// The types, object types, and property keys of objects are translated.
+static void translate_events(
+        Trace *trace, Host *host, uint8_t *events, uint32_t size) {
+    LV2_URID object_types[] = {
+        host->map.map(host->map.handle, LV2_ATOM__Object),
+        host->map.map(host->map.handle, LV2_ATOM__Blank),
+        host->map.map(host->map.handle, LV2_ATOM__Resource),
+    };
+
+    uint32_t offset = 0;
+    while (size - offset >= sizeof(LV2_Atom_Event)) {
+        LV2_Atom_Event *event = (LV2_Atom_Event *)(events + offset);
+        event->body.type = translate_urid(trace, host, event->body.type);
+        bool is_object = false;
+        for (size_t i = 0; i < sizeof(object_types) / sizeof(LV2_URID); i++) {
+            is_object = is_object || event->body.type == object_types[i];
+        }
+
+        if (is_object && event->body.size >= sizeof(LV2_Atom_Object_Body)) {
+            LV2_Atom_Object_Body *body = (LV2_Atom_Object_Body *)(event + 1);
+            body->otype = translate_urid(trace, host, body->otype);
+            LV2_ATOM_OBJECT_BODY_FOREACH(body, event->body.size, property) {
+                property->key = translate_urid(trace, host, property->key);
+                property->value.type = translate_urid(
+                    trace, host, property->value.type
+                );
+            }
+        }
+        offset += lv2_atom_pad_size(sizeof(*event) + event->body.size);
+    }
+}
+
+static uint32_t count_bits(uint32_t bits) {
+    uint32_t count = 0;
+    for (; bits != 0; bits &= bits - 1) count++;
+    return count;
+}
+
+static bool check_header(Trace *trace) {
+    const TraceHeader *header = (const TraceHeader *)trace->data;
+    if (trace->size < sizeof(TraceHeader) ||
+        memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Error: File is not a Midislide trace.\n");
+        return false;
+    }
+    if (header->version != TRACE_VERSION ||
+        header->port_count != PORT_COUNT) {
+        fprintf(
+            stderr, "Error: Trace was recorded by an incompatible version "
+            "of Midislide.\n"
+        );
+        return false;
+    }
+    trace->header = header;
+    return true;
+}
+
+// Maps the recorded URIDs and translates the records' events. Records after
+// the first incomplete or invalid one are ignored.
+static bool load_trace(Trace *trace, Host *host) {
+    const TraceHeader *header = trace->header;
+    size_t offset = sizeof(TraceHeader);
+    for (uint32_t i = 0; i < header->n_uris; i++) {
+        const TraceURI *uri = (const TraceURI *)(trace->data + offset);
+        if (trace->size - offset < sizeof(*uri) ||
+            trace->size - offset - sizeof(*uri) < TRACE_PAD_SIZE(uri->size)) {
+            fprintf(stderr, "Error: Trace is truncated.\n");
+            return false;
+        }
+        offset += sizeof(*uri);
+
+        if (uri->urid >= trace->n_urids) {
+            uint32_t n_urids = uri->urid + 1;
+            LV2_URID *urids = realloc(
+                trace->urids, n_urids * sizeof(LV2_URID)
+            );
+            if (urids == NULL) {
+                fprintf(stderr, "Error: Not enough memory for trace.\n");
+                return false;
+            }
+            memset(
+                urids + trace->n_urids, 0,
+                (n_urids - trace->n_urids) * sizeof(LV2_URID)
+            );
+            trace->urids = urids;
+            trace->n_urids = n_urids;
+        }
+
+        char *string = strndup((const char *)trace->data + offset, uri->size);
+        if (string == NULL) {
+            fprintf(stderr, "Error: Not enough memory for trace.\n");
+            return false;
+        }
+        trace->urids[uri->urid] = host->map.map(host->map.handle, string);
+        free(string);
+        offset += TRACE_PAD_SIZE(uri->size);
+    }
+
+    trace->records_start = offset;
+    while (trace->size - offset >= sizeof(TraceRecord)) {
+        TraceRecord *record = (TraceRecord *)(trace->data + offset);
+        if (record->type != TRACE_ACTIVATE && record->type != TRACE_RUN &&
+            record->type != TRACE_BUFFER && record->type != TRACE_GAP) {
+            break;
+        }
+        if (record->changed_controls & ~PORT_CONTROL_INPUTS) break;
+        uint64_t values_size = TRACE_PAD_SIZE(
+            count_bits(record->changed_controls) * sizeof(float)
+        );
+        uint64_t size = (
+            sizeof(*record) + values_size +
+            TRACE_PAD_SIZE(record->events_size)
+        );
+        if (trace->size - offset < size) break;
+        if (record->type == TRACE_GAP) trace->n_gaps++;
+        translate_events(
+            trace, host, (uint8_t *)record + sizeof(*record) + values_size,
+            record->events_size
+        );
+        offset += size;
+    }
+
+    trace->records_end = offset;
+    if (trace->n_gaps > 0) {
+        fprintf(
+            stderr, "Warning: Records were dropped while recording the "
+            "trace (%" PRIu32 " gaps); the output after the first gap may "
+            "differ from the recorded session.\n", trace->n_gaps
+        );
+    }
+    if (offset < trace->size) {
+        fprintf(
+            stderr, "Warning: Trace is truncated; replaying the first %zu "
+            "bytes.\n", offset
+        );
+    }
+    return true;
+}
+
+static bool is_message(Host *host, const LV2_Atom_Event *event) {
+    return (
+        event->body.type == host->uris.midi_Event ||
+        event->body.type == host->uris.ump_Event
+    );
+}
+
+// MIDI messages are printed as bytes, and Universal MIDI Packets as words.
+static void print_output(Host *host, uint64_t block_start) {
+    LV2_ATOM_SEQUENCE_FOREACH(host->output, event) {
+        if (!is_message(host, event)) continue;
+        printf("%" PRIu64, block_start + event->time.frames);
+        if (event->body.type == host->uris.ump_Event) {
+            const uint32_t *words = (const uint32_t *)(event + 1);
+            for (uint32_t i = 0; i < event->body.size / 4; i++) {
+                printf(" %08" PRIx32, words[i]);
+            }
+        } else {
+            const uint8_t *message = (const uint8_t *)(event + 1);
+            for (uint32_t i = 0; i < event->body.size; i++) {
+                printf(" %02x", message[i]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void hash_output(Host *host, uint64_t block_start, ReplayStats *stats) {
+    LV2_ATOM_SEQUENCE_FOREACH(host->output, event) {
+        if (!is_message(host, event)) continue;
+        uint64_t time = block_start + event->time.frames;
+        stats->checksum = hash_bytes(stats->checksum, &time, sizeof(time));
+        stats->checksum = hash_bytes(
+            stats->checksum, event + 1, event->body.size
+        );
+        stats->events_out++;
+    }
+}
+
+// Runs the plugin once for each record. Only the calls to run() are timed.
+static bool replay(
+        Trace *trace, Host *host, bool print, ReplayStats *stats) {
+    uint64_t block_start = 0;
+    size_t offset = trace->records_start;
+    while (offset < trace->records_end) {
+        const TraceRecord *record = (const TraceRecord *)(
+            trace->data + offset
+        );
+        const float *values = (const float *)(record + 1);
+        uint64_t values_size = TRACE_PAD_SIZE(
+            count_bits(record->changed_controls) * sizeof(float)
+        );
+        const uint8_t *events = (const uint8_t *)values + values_size;
+        offset += (
+            sizeof(*record) + values_size +
+            TRACE_PAD_SIZE(record->events_size)
+        );
+
+        // The work was done after the run that scheduled it, so the response
+        // is waiting.
+        if (record->type == TRACE_BUFFER) {
+            host_deliver_responses(host);
+            continue;
+        }
+
+        // The dropped blocks are skipped, keeping later events at their
+        // recorded times.
+        if (record->type == TRACE_GAP) {
+            block_start += record->n_samples;
+            continue;
+        }
+
+        for (uint32_t port = 0; port < PORT_COUNT; port++) {
+            if (record->changed_controls >> port & 1) {
+                host_set_control(host, port, *values++);
+            }
+        }
+
+        // host_init() already activated the plugin, but with the default
+        // control values.
+        if (record->type == TRACE_ACTIVATE) {
+            host_reactivate(host);
+            block_start = 0;
+            continue;
+        }
+
+        host_begin_block(host);
+        uint32_t events_offset = 0;
+        while (record->events_size - events_offset >= sizeof(LV2_Atom_Event)) {
+            const LV2_Atom_Event *event = (const LV2_Atom_Event *)(
+                events + events_offset
+            );
+            if (!host_add_event(host, event)) return false;
+            events_offset += lv2_atom_pad_size(
+                sizeof(*event) + event->body.size
+            );
+        }
+
+        host->output_limit = record->output_capacity;
+        uint64_t start = now_ns();
+        if (!host_run(host, record->n_samples)) return false;
+        uint64_t elapsed = now_ns() - start;
+        stats->total_ns += elapsed;
+        if (elapsed > stats->max_ns) stats->max_ns = elapsed;
+        host_run_worker(host);
+
+        if (print) print_output(host, block_start);
+        hash_output(host, block_start, stats);
+        stats->blocks++;
+        stats->samples += record->n_samples;
+        block_start += record->n_samples;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    unsigned long repetitions = 1;
+    bool print = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:dh")) != -1) {
+        switch (opt) {
+            case 'n':
+                repetitions = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                print = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1 || repetitions == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Trace trace = {0};
+    if (!read_file(&trace, argv[optind]) || !check_header(&trace)) {
+        free(trace.data);
+        return EXIT_FAILURE;
+    }
+
+    // Each repetition uses a new instance, so every replay starts from the
+    // same state. The trace is translated for the first host's URIDs, which
+    // later hosts map identically.
+    bool success = true;
+    ReplayStats stats = {0};
+    uint64_t first_checksum = 0;
+    for (unsigned long rep = 0; success && rep < repetitions; rep++) {
+        Host host;
+        if (!host_init(&host, trace.header->sample_rate)) {
+            fprintf(stderr, "Error: Could not instantiate plugin.\n");
+            success = false;
+            break;
+        }
+        if (rep == 0) success = load_trace(&trace, &host);
+
+        stats.checksum = FNV_OFFSET_BASIS;
+        success = success && replay(&trace, &host, print && rep == 0, &stats);
+        if (rep == 0) {
+            first_checksum = stats.checksum;
+            memcpy(stats.counters, host.controls, sizeof(stats.counters));
+        }
+        if (success && stats.checksum != first_checksum) {
+            fprintf(stderr, "Error: Replay %lu differs.\n", rep + 1);
+            success = false;
+        }
+        host_destroy(&host);
+    }
+
+    if (success) {
+        fprintf(
+            stderr, "blocks\t%" PRIu64 "\nsamples\t%" PRIu64 "\n"
+            "events_out\t%" PRIu64 "\nchecksum\t%016" PRIx64 "\n"
+            "ns_per_block\t%.1f\nmax_ns_per_block\t%" PRIu64 "\n",
+            stats.blocks / repetitions, stats.samples / repetitions,
+            stats.events_out / repetitions, first_checksum,
+            stats.blocks > 0 ? (double)stats.total_ns / stats.blocks : 0,
+            stats.max_ns
+        );
+        fprintf(
+            stderr, "events_dropped\t%.0f\nstack_high_water\t%.0f\n"
+            "slides_out_of_range\t%.0f\n",
+            stats.counters[PORT_EVENTS_DROPPED],
+            stats.counters[PORT_STACK_HIGH_WATER],
+            stats.counters[PORT_SLIDES_OUT_OF_RANGE]
+        );
+    }
+    free(trace.urids);
+    free(trace.data);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
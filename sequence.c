@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sequence.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SEQUENCE_SIZE 65536
+
+// Size of an atom event containing a 3-byte MIDI message, after padding.
+#define MIDI_EVENT_SIZE 24
+
+bool sequence_reserve(
+        LV2_Atom_Sequence **sequence, uint32_t *capacity, uint32_t size) {
+    if (*sequence != NULL && size <= *capacity) return true;
+    uint32_t new_capacity = *capacity > 0 ? *capacity : INITIAL_SEQUENCE_SIZE;
+    while (new_capacity < size) new_capacity *= 2;
+
+    // Atom sequences must be 64-bit aligned, which realloc() guarantees.
+    LV2_Atom_Sequence *new_sequence = realloc(*sequence, new_capacity);
+    if (new_sequence == NULL) {
+        fprintf(stderr, "Error: Not enough memory for atom sequence.\n");
+        return false;
+    }
+    *sequence = new_sequence;
+    *capacity = new_capacity;
+    return true;
+}
+
+bool sequence_add_event(
+        LV2_Atom_Sequence **sequence, uint32_t *capacity,
+        const LV2_Atom_Event *event) {
+    uint32_t size = (
+        sizeof(LV2_Atom) + (*sequence)->atom.size +
+        lv2_atom_pad_size(sizeof(LV2_Atom_Event) + event->body.size)
+    );
+    if (!sequence_reserve(sequence, capacity, size)) return false;
+    return lv2_atom_sequence_append_event(
+        *sequence, *capacity - sizeof(LV2_Atom), event
+    ) != NULL;
+}
+
+bool sequence_add_midi(
+        LV2_Atom_Sequence **sequence, uint32_t *capacity, LV2_URID midi_Event,
+        uint32_t frames, const uint8_t *message, uint32_t size) {
+    uint64_t buffer[(sizeof(LV2_Atom_Event) + 64) / sizeof(uint64_t)];
+    LV2_Atom_Event *event = (LV2_Atom_Event *)buffer;
+    if (size > sizeof(buffer) - sizeof(LV2_Atom_Event)) {
+        // Large messages (e.g., long system exclusive messages) are copied
+        // into a temporary allocation.
+        event = malloc(sizeof(LV2_Atom_Event) + size);
+        if (event == NULL) return false;
+    }
+
+    event->time.frames = frames;
+    event->body.type = midi_Event;
+    event->body.size = size;
+    memcpy(event + 1, message, size);
+    bool result = sequence_add_event(sequence, capacity, event);
+    if ((uint64_t *)event != buffer) free(event);
+    return result;
+}
+
+bool sequence_add_tempo(
+        LV2_Atom_Sequence **sequence, uint32_t *capacity,
+        const SequenceURIs *uris, uint32_t frames, float bpm) {
+    struct {
+        LV2_Atom_Event event;
+        LV2_Atom_Object_Body object;
+        LV2_Atom_Property_Body property;
+        float value;
+    } position;
+
+    memset(&position, 0, sizeof(position));
+    position.event.time.frames = frames;
+    position.event.body.type = uris->atom_Object;
+    position.event.body.size = (
+        sizeof(position.object) + sizeof(position.property) +
+        sizeof(position.value)
+    );
+    position.object.otype = uris->time_Position;
+    position.property.key = uris->time_beatsPerMinute;
+    position.property.value.type = uris->atom_Float;
+    position.property.value.size = sizeof(float);
+    position.value = bpm;
+    return sequence_add_event(sequence, capacity, &position.event);
+}
+
+bool sequence_prepare_output(
+        LV2_Atom_Sequence **output, uint32_t *capacity,
+        const LV2_Atom_Sequence *input, uint32_t n_samples, uint32_t limit) {
+    // Leave enough room for every passthrough event plus one generated
+    // event per sample. System exclusive messages can grow to about four
+    // times their size when sent as Universal MIDI Packets.
+    uint32_t size = (
+        sizeof(LV2_Atom) + input->atom.size * 4 +
+        (n_samples + 2) * MIDI_EVENT_SIZE
+    );
+    if (limit > 0) size = sizeof(LV2_Atom) + limit;
+    if (!sequence_reserve(output, capacity, size)) return false;
+
+    (*output)->atom.type = 0;
+    (*output)->atom.size = *capacity - sizeof(LV2_Atom);
+    if (limit > 0) (*output)->atom.size = limit;
+    return true;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Growable atom sequences, used by the in-process host (see host.h) and the
+// engine (see engine.h) to build the sequences they pass to the plugin and
+// the core. A sequence and its capacity, in bytes, are passed separately, and
+// the sequence may move whenever it grows.
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <lv2/lv2plug.in/ns/ext/atom/util.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+// URIDs of the types in a time:Position object made by sequence_add_tempo().
+typedef struct {
+    LV2_URID atom_Float;
+    LV2_URID atom_Object;
+    LV2_URID time_Position;
+    LV2_URID time_beatsPerMinute;
+} SequenceURIs;
+
+// Grows the allocation of a sequence to at least `size` bytes. If `*sequence`
+// is null, it is allocated.
+bool sequence_reserve(
+    LV2_Atom_Sequence **sequence, uint32_t *capacity, uint32_t size);
+
+// Appends a copy of an event. Events must be added in order.
+bool sequence_add_event(
+    LV2_Atom_Sequence **sequence, uint32_t *capacity,
+    const LV2_Atom_Event *event);
+
+// Appends a MIDI message as an event of type `midi_Event`.
+bool sequence_add_midi(
+    LV2_Atom_Sequence **sequence, uint32_t *capacity, LV2_URID midi_Event,
+    uint32_t frames, const uint8_t *message, uint32_t size);
+
+// Appends a time:Position object containing only time:beatsPerMinute, as a
+// host would send.
+bool sequence_add_tempo(
+    LV2_Atom_Sequence **sequence, uint32_t *capacity,
+    const SequenceURIs *uris, uint32_t frames, float bpm);
+
+// Prepares an output sequence for a block of `n_samples` samples with the
+// events in `input`. If `limit` is nonzero, the output is given `limit` bytes
+// of room; otherwise, it has room for every event the block can produce.
+bool sequence_prepare_output(
+    LV2_Atom_Sequence **output, uint32_t *capacity,
+    const LV2_Atom_Sequence *input, uint32_t n_samples, uint32_t limit);
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "smf.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline uint32_t read_u32(const uint8_t *data) {
+    return (
+        (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+        (uint32_t)data[2] << 8 | data[3]
+    );
+}
+
+static inline uint16_t read_u16(const uint8_t *data) {
+    return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+static inline bool read_varlen(
+        const uint8_t **pos, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++) {
+        if (*pos >= end) return false;
+        uint8_t byte = *(*pos)++;
+        result = (result << 7) | (byte & 0x7F);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint32_t midi_data_length(uint8_t status) {
+    switch (status & 0xF0) {
+        case 0xC0:
+        case 0xD0:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+// Decodes the next event in the track into `track->event`. Returns false if
+// the track is malformed.
+static bool advance_track(SmfTrack *track) {
+    track->has_event = false;
+    if (track->pos >= track->end) return true;
+
+    uint32_t delta;
+    if (!read_varlen(&track->pos, track->end, &delta)) return false;
+    track->tick += delta;
+    if (track->pos >= track->end) return false;
+
+    SmfEvent *event = &track->event;
+    event->tick = track->tick;
+    uint8_t status = *track->pos;
+
+    if (status == 0xFF) {
+        track->pos++;
+        if (track->pos >= track->end) return false;
+        event->type = SMF_EVENT_META;
+        event->meta_type = *track->pos++;
+    } else if (status == 0xF0 || status == 0xF7) {
+        track->pos++;
+        event->type = SMF_EVENT_SYSEX;
+        event->meta_type = status;
+    } else {
+        event->type = SMF_EVENT_MIDI;
+        if (status & 0x80) {
+            track->pos++;
+            track->running_status = status;
+        } else if (track->running_status == 0) {
+            return false;
+        }
+
+        status = track->running_status;
+        uint32_t length = midi_data_length(status);
+        if ((size_t)(track->end - track->pos) < length) return false;
+        event->buffer[0] = status;
+        memcpy(&event->buffer[1], track->pos, length);
+        track->pos += length;
+        event->data = event->buffer;
+        event->size = length + 1;
+        track->has_event = true;
+        return true;
+    }
+
+    // System exclusive and meta events cancel running status.
+    track->running_status = 0;
+    uint32_t length;
+    if (!read_varlen(&track->pos, track->end, &length)) return false;
+    if ((size_t)(track->end - track->pos) < length) return false;
+    event->data = track->pos;
+    event->size = length;
+    track->pos += length;
+
+    if (event->type == SMF_EVENT_META &&
+        event->meta_type == SMF_META_END_OF_TRACK) {
+        track->pos = track->end;
+    }
+    track->has_event = true;
+    return true;
+}
+
+bool smf_open(SmfReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 14) {
+        fprintf(stderr, "%s: Not a Standard MIDI File.\n", path);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+
+    posix_madvise(data, info.st_size, POSIX_MADV_SEQUENTIAL);
+    reader->data = data;
+    reader->size = info.st_size;
+
+    const uint8_t *pos = reader->data;
+    const uint8_t *end = reader->data + reader->size;
+    uint32_t header_size = read_u32(pos + 4);
+    if (memcmp(pos, "MThd", 4) != 0 || header_size < 6 ||
+        (size_t)(end - pos - 8) < header_size) {
+        fprintf(stderr, "%s: Not a Standard MIDI File.\n", path);
+        smf_close(reader);
+        return false;
+    }
+
+    reader->format = read_u16(pos + 8);
+    reader->n_tracks = read_u16(pos + 10);
+    reader->division = (int16_t)read_u16(pos + 12);
+    pos += 8 + header_size;
+
+    reader->tracks = calloc(reader->n_tracks, sizeof(SmfTrack));
+    if (reader->tracks == NULL && reader->n_tracks > 0) {
+        fprintf(stderr, "Error: Not enough memory to read tracks.\n");
+        smf_close(reader);
+        return false;
+    }
+
+    uint16_t n_found = 0;
+    while (n_found < reader->n_tracks && end - pos >= 8) {
+        uint32_t chunk_size = read_u32(pos + 4);
+        bool is_track = memcmp(pos, "MTrk", 4) == 0;
+        pos += 8;
+        if ((size_t)(end - pos) < chunk_size) {
+            // Some files have incorrect lengths for the last track.
+            chunk_size = end - pos;
+        }
+
+        if (is_track) {
+            SmfTrack *track = &reader->tracks[n_found++];
+            track->pos = pos;
+            track->end = pos + chunk_size;
+            if (!advance_track(track)) {
+                fprintf(stderr, "%s: Malformed track.\n", path);
+                smf_close(reader);
+                return false;
+            }
+        }
+        pos += chunk_size;
+    }
+
+    reader->n_tracks = n_found;
+    return true;
+}
+
+void smf_close(SmfReader *reader) {
+    if (reader->data != NULL) {
+        munmap((void *)reader->data, reader->size);
+    }
+    if (reader->tracks != NULL) {
+        for (uint16_t i = 0; i < reader->n_tracks; i++) {
+            free(reader->tracks[i].sysex);
+        }
+    }
+    free(reader->tracks);
+    memset(reader, 0, sizeof(*reader));
+}
+
+static inline bool append_sysex(
+        SmfReader *reader, SmfTrack *track, const uint8_t *data,
+        uint32_t size) {
+    if (size > track->sysex_capacity - track->sysex_size) {
+        uint32_t capacity = track->sysex_size + size;
+        if (capacity < track->sysex_capacity * 2) {
+            capacity = track->sysex_capacity * 2;
+        }
+        uint8_t *sysex = realloc(track->sysex, capacity);
+        if (sysex == NULL) {
+            fprintf(stderr, "Error: Not enough memory for sysex message.\n");
+            reader->error = true;
+            return false;
+        }
+        track->sysex = sysex;
+        track->sysex_capacity = capacity;
+    }
+    memcpy(&track->sysex[track->sysex_size], data, size);
+    track->sysex_size += size;
+    return true;
+}
+
+// Handles a system exclusive or escaped event read from `track`. Returns true
+// if `event` is now a complete system exclusive message. Otherwise, the event
+// either was part of a divided message or was an escaped event, whose data is
+// returned by the following calls to smf_next_event(), or an error occurred
+// (in which case `reader->error` is set).
+static bool read_sysex(SmfReader *reader, SmfTrack *track, SmfEvent *event) {
+    if (event->meta_type == 0xF0) {
+        // A new message replaces one that was never finished.
+        static const uint8_t start = 0xF0;
+        track->sysex_size = 0;
+        if (!append_sysex(reader, track, &start, 1)) return false;
+    } else if (track->sysex_size == 0) {
+        reader->escape_pos = event->data;
+        reader->escape_end = event->data + event->size;
+        reader->escape_tick = event->tick;
+        return false;
+    }
+
+    // Otherwise, the escaped event continues the current message.
+    if (!append_sysex(reader, track, event->data, event->size)) {
+        return false;
+    }
+    if (track->sysex[track->sysex_size - 1] != 0xF7) return false;
+    event->meta_type = 0xF0;
+    event->data = track->sysex;
+    event->size = track->sysex_size;
+    track->sysex_size = 0;
+    return true;
+}
+
+// Returns the length of the MIDI message at the start of `data`, or 0 if it
+// doesn't start with a complete message.
+static inline uint32_t message_length(const uint8_t *data, size_t size) {
+    uint8_t status = data[0];
+    uint32_t length = 1;
+    if (status < 0x80) return 0;
+    if (status < 0xF0) {
+        length += midi_data_length(status);
+    } else if (status == 0xF0) {
+        const uint8_t *end = memchr(data, 0xF7, size);
+        return end == NULL ? 0 : end - data + 1;
+    } else if (status == 0xF1 || status == 0xF3) {
+        length = 2;
+    } else if (status == 0xF2) {
+        length = 3;
+    } else if (status == 0xF7) {
+        return 0;
+    }
+
+    if (length > size) return 0;
+    for (uint32_t i = 1; i < length; i++) {
+        if (data[i] & 0x80) return 0;
+    }
+    return length;
+}
+
+// Returns the next message in the current escaped event. Returns false if
+// bytes that don't form a complete message were skipped instead.
+static bool read_escaped(SmfReader *reader, SmfEvent *event) {
+    const uint8_t *pos = reader->escape_pos;
+    uint32_t length = message_length(pos, reader->escape_end - pos);
+    if (length == 0) {
+        // Skip to the next status byte.
+        do {
+            pos++;
+        } while (pos < reader->escape_end && !(*pos & 0x80));
+        reader->escape_pos = pos;
+        reader->escape_skipped = true;
+        return false;
+    }
+
+    event->tick = reader->escape_tick;
+    event->type = pos[0] == 0xF0 ? SMF_EVENT_SYSEX : SMF_EVENT_MIDI;
+    event->meta_type = pos[0] == 0xF0 ? 0xF0 : 0;
+    event->data = pos;
+    event->size = length;
+    reader->escape_pos = pos + length;
+    return true;
+}
+
+bool smf_next_event(SmfReader *reader, SmfEvent *event) {
+    while (true) {
+        if (reader->escape_pos < reader->escape_end) {
+            if (read_escaped(reader, event)) return true;
+            continue;
+        }
+
+        SmfTrack *next = NULL;
+        for (uint16_t i = 0; i < reader->n_tracks; i++) {
+            SmfTrack *track = &reader->tracks[i];
+            if (!track->has_event) continue;
+            if (next == NULL || track->event.tick < next->event.tick) {
+                next = track;
+            }
+        }
+
+        if (next == NULL) {
+            if (reader->escape_skipped) {
+                fprintf(
+                    stderr, "Warning: Escaped data that wasn't a complete "
+                    "MIDI message was skipped.\n"
+                );
+                reader->escape_skipped = false;
+            }
+            return false;
+        }
+
+        *event = next->event;
+        if (event->data == next->event.buffer) event->data = event->buffer;
+        if (!advance_track(next)) {
+            fprintf(stderr, "Error: Malformed track.\n");
+            reader->error = true;
+            return false;
+        }
+
+        if (event->type != SMF_EVENT_SYSEX) return true;
+        if (read_sysex(reader, next, event)) return true;
+        if (reader->error) return false;
+    }
+}
+
+void smf_tempo_map_init(
+        SmfTempoMap *map, int16_t division, double sample_rate) {
+    map->sample_rate = sample_rate;
+    map->division = division;
+    map->tick = 0;
+    map->samples = 0;
+    map->tempo = SMF_DEFAULT_TEMPO;
+}
+
+double smf_tempo_map_samples(const SmfTempoMap *map, uint64_t tick) {
+    if (map->division < 0) {
+        // SMPTE time: the upper byte is the negated frame rate, and the lower
+        // byte is the number of ticks per frame.
+        int fps = -(int8_t)(map->division >> 8);
+        double frame_rate = fps == 29 ? 30000.0 / 1001 : fps;
+        double ticks_per_second = frame_rate * (map->division & 0xFF);
+        return tick * map->sample_rate / ticks_per_second;
+    }
+
+    double ticks = tick - map->tick;
+    double seconds = ticks * map->tempo / (map->division * 1000000.0);
+    return map->samples + seconds * map->sample_rate;
+}
+
+void smf_tempo_map_set_tempo(
+        SmfTempoMap *map, uint64_t tick, uint32_t tempo) {
+    map->samples = smf_tempo_map_samples(map, tick);
+    map->tick = tick;
+    map->tempo = tempo;
+}
+
+uint32_t smf_event_tempo(const SmfEvent *event) {
+    if (event->size != 3) return 0;
+    const uint8_t *data = event->data;
+    return (uint32_t)data[0] << 16 | (uint32_t)data[1] << 8 | data[2];
+}
+
+static inline void write_bytes(
+        SmfWriter *writer, const void *data, size_t size) {
+    if (fwrite(data, 1, size, writer->file) != size) writer->error = true;
+}
+
+static inline void write_u32(SmfWriter *writer, uint32_t value) {
+    uint8_t data[] = {value >> 24, value >> 16, value >> 8, value};
+    write_bytes(writer, data, sizeof(data));
+}
+
+static inline void write_varlen(SmfWriter *writer, uint32_t value) {
+    uint8_t data[5];
+    int start = sizeof(data) - 1;
+    data[start] = value & 0x7F;
+    while ((value >>= 7) > 0) {
+        data[--start] = (value & 0x7F) | 0x80;
+    }
+    write_bytes(writer, &data[start], sizeof(data) - start);
+}
+
+static inline void write_delta(SmfWriter *writer, uint64_t tick) {
+    uint64_t delta = tick > writer->tick ? tick - writer->tick : 0;
+    // Deltas are limited to 28 bits; longer gaps are split using empty text
+    // events.
+    while (delta > 0x0FFFFFFF) {
+        write_varlen(writer, 0x0FFFFFFF);
+        write_bytes(writer, "\xFF\x01\x00", 3);
+        delta -= 0x0FFFFFFF;
+    }
+    write_varlen(writer, delta);
+    if (tick > writer->tick) writer->tick = tick;
+}
+
+bool smf_writer_open(SmfWriter *writer, const char *path, uint16_t division) {
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    write_bytes(writer, "MThd", 4);
+    write_u32(writer, 6);
+    uint8_t header[] = {0, 0, 0, 1, division >> 8, division & 0xFF};
+    write_bytes(writer, header, sizeof(header));
+    write_bytes(writer, "MTrk", 4);
+    writer->track_start = ftell(writer->file);
+    // The track length is filled in by smf_writer_close().
+    write_u32(writer, 0);
+    return !writer->error;
+}
+
+void smf_write_message(
+        SmfWriter *writer, uint64_t tick, const uint8_t *message,
+        uint32_t size) {
+    if (size == 0) return;
+    write_delta(writer, tick);
+    if (message[0] == 0xF0) {
+        write_bytes(writer, message, 1);
+        write_varlen(writer, size - 1);
+        write_bytes(writer, message + 1, size - 1);
+        return;
+    }
+
+    // Only channel messages can be written as they are.
+    if (message[0] < 0x80 || message[0] >= 0xF0) {
+        write_bytes(writer, "\xF7", 1);
+        write_varlen(writer, size);
+    }
+    write_bytes(writer, message, size);
+}
+
+void smf_write_tempo(SmfWriter *writer, uint64_t tick, uint32_t tempo) {
+    write_delta(writer, tick);
+    uint8_t data[] = {0xFF, SMF_META_TEMPO, 3, tempo >> 16, tempo >> 8, tempo};
+    write_bytes(writer, data, sizeof(data));
+}
+
+void smf_write_meta(
+        SmfWriter *writer, uint64_t tick, uint8_t type, const uint8_t *data,
+        uint32_t size) {
+    write_delta(writer, tick);
+    uint8_t header[] = {0xFF, type};
+    write_bytes(writer, header, sizeof(header));
+    write_varlen(writer, size);
+    write_bytes(writer, data, size);
+}
+
+bool smf_writer_close(SmfWriter *writer) {
+    write_bytes(writer, "\x00\xFF\x2F\x00", 4);
+    long end = ftell(writer->file);
+    if (end < 0 || fseek(writer->file, writer->track_start, SEEK_SET) != 0) {
+        writer->error = true;
+    } else {
+        write_u32(writer, end - writer->track_start - 4);
+    }
+
+    if (fclose(writer->file) != 0) writer->error = true;
+    writer->file = NULL;
+    return !writer->error;
+}
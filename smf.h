@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reading and writing of Standard MIDI Files. Input files are memory-mapped
+// and read one event at a time, so they are never loaded into memory whole.
+
+#ifndef SMF_H
+#define SMF_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define SMF_META_END_OF_TRACK 0x2F
+#define SMF_META_TEMPO 0x51
+#define SMF_DEFAULT_TEMPO 500000
+
+typedef enum {
+    SMF_EVENT_MIDI,
+    SMF_EVENT_SYSEX,
+    SMF_EVENT_META,
+} SmfEventType;
+
+typedef struct {
+    uint64_t tick;
+    SmfEventType type;
+    uint8_t meta_type;
+    // For MIDI events, the complete message, including the status byte. For
+    // system exclusive events, the message including the leading 0xF0. For
+    // meta events, the event data.
+    const uint8_t *data;
+    uint32_t size;
+    // Storage for messages that must be reconstructed (e.g., due to running
+    // status being used).
+    uint8_t buffer[3];
+} SmfEvent;
+
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    uint64_t tick;
+    uint8_t running_status;
+    bool has_event;
+    SmfEvent event;
+    // The system exclusive message being read, with the leading 0xF0. Messages
+    // may be divided into several events, so the parts are collected here
+    // until the final 0xF7. Empty if no message has been started.
+    uint8_t *sysex;
+    uint32_t sysex_size;
+    uint32_t sysex_capacity;
+} SmfTrack;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    uint16_t format;
+    uint16_t n_tracks;
+    // Ticks per quarter note if positive; SMPTE format otherwise.
+    int16_t division;
+    SmfTrack *tracks;
+    bool error;
+    // The part of an escaped (0xF7) event not yet returned. Escaped events
+    // hold raw MIDI data, which is returned as the messages it contains.
+    const uint8_t *escape_pos;
+    const uint8_t *escape_end;
+    uint64_t escape_tick;
+    // Whether escaped data that isn't a complete message has been skipped.
+    bool escape_skipped;
+} SmfReader;
+
+// Converts tick times to sample times. Tempo changes must be applied in
+// order, and times may only be requested for ticks at or after the last
+// tempo change.
+typedef struct {
+    double sample_rate;
+    int16_t division;
+    uint64_t tick;
+    double samples;
+    uint32_t tempo;
+} SmfTempoMap;
+
+typedef struct {
+    FILE *file;
+    long track_start;
+    uint64_t tick;
+    bool error;
+} SmfWriter;
+
+bool smf_open(SmfReader *reader, const char *path);
+
+void smf_close(SmfReader *reader);
+
+// Reads the next event from all tracks, merged in tick order. System
+// exclusive messages divided into several events are returned whole, at the
+// time of their last part, and escaped events are split into the MIDI
+// messages they contain. Returns false at the end of the file or if an error
+// occurred (in which case `reader->error` is set).
+bool smf_next_event(SmfReader *reader, SmfEvent *event);
+
+void smf_tempo_map_init(
+    SmfTempoMap *map, int16_t division, double sample_rate);
+
+void smf_tempo_map_set_tempo(SmfTempoMap *map, uint64_t tick, uint32_t tempo);
+
+double smf_tempo_map_samples(const SmfTempoMap *map, uint64_t tick);
+
+// Parses the tempo from a tempo meta event. Returns 0 if the event is
+// malformed.
+uint32_t smf_event_tempo(const SmfEvent *event);
+
+// Creates a format 0 file with the given division.
+bool smf_writer_open(SmfWriter *writer, const char *path, uint16_t division);
+
+// Writes a MIDI or system exclusive message. System exclusive messages must
+// include the leading 0xF0. Other system messages, which a file can only hold
+// as escaped events, are written as such.
+void smf_write_message(
+    SmfWriter *writer, uint64_t tick, const uint8_t *message, uint32_t size);
+
+void smf_write_tempo(SmfWriter *writer, uint64_t tick, uint32_t tempo);
+
+// Writes a meta event with the given type and data.
+void smf_write_meta(
+    SmfWriter *writer, uint64_t tick, uint8_t type, const uint8_t *data,
+    uint32_t size);
+
+// Ends the track and closes the file. Returns false if any write failed.
+bool smf_writer_close(SmfWriter *writer);
+
+#endif
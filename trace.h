@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Format of the input traces recorded when the MIDISLIDE_TRACE environment
+// variable is set, and replayed by midislide-replay. Values are stored in the
+// byte order of the machine that recorded the trace.
+//
+// A trace is a TraceHeader, followed by `n_uris` URIs, followed by records
+// until the end of the file. Every part is padded to a multiple of 8 bytes,
+// so a trace loaded into memory can be used in place.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+#define TRACE_MAGIC "MSLTRACE"
+#define TRACE_VERSION 3
+
+// Name of the environment variable that enables recording. Its value is the
+// path of the trace, to which ".<n>.trace" is appended, where n counts the
+// instances created by the process.
+#define TRACE_ENV_VAR "MIDISLIDE_TRACE"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t port_count;
+    double sample_rate;
+    uint32_t n_uris;
+    uint32_t reserved;
+} TraceHeader;
+
+// A URID the plugin mapped when it was recorded. Followed by `size` bytes of
+// the URI (without a terminating null byte), padded with null bytes.
+typedef struct {
+    uint32_t urid;
+    uint32_t size;
+} TraceURI;
+
+typedef enum {
+    // The plugin was activated, with the recorded control values. All state
+    // except the tempo is reset.
+    TRACE_ACTIVATE = 1,
+    // One call to run().
+    TRACE_RUN = 2,
+    // The worker handed the plugin a buffer it had asked for (see
+    // SlideBufferKind in core.h), between two calls to run().
+    TRACE_BUFFER = 3,
+    // Records were dropped here because the recording buffer was full.
+    // `n_samples` is the number of samples in the dropped run records.
+    TRACE_GAP = 4,
+} TraceRecordType;
+
+// Followed by a float for each bit set in `changed_controls`, then
+// `events_size` bytes of input events, laid out as in the body of an atom
+// sequence. Both are padded.
+typedef struct {
+    uint32_t type;
+    uint32_t n_samples;
+    // Capacity of the output sequence, in bytes.
+    uint32_t output_capacity;
+    // Bit i is set if the value of control port i changed since the last
+    // record. Activation records include every control connected at the
+    // time, and the first run record after them includes every control.
+    uint32_t changed_controls;
+    uint32_t events_size;
+    // The SlideBufferKind of a TRACE_BUFFER record.
+    uint32_t buffer_kind;
+} TraceRecord;
+
+#define TRACE_PAD_SIZE(size) (((size) + 7) & ~(uint64_t)7)
+
+#endif
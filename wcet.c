@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2018 taylor.fish <contact@taylor.fish>
+ *
+ * This file is part of Midislide.
+ *
+ * Midislide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Midislide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Midislide.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures the worst-case time of the plugin's run() function on adversarial
+// input. Each block is timed on its own, and a summary of the distribution is
+// printed as tab-separated values.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "host.h"
+#include "midislide.h"
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+#define SAMPLE_RATE 48000
+#define DEFAULT_BLOCKS 2048
+#define DEFAULT_REPETITIONS 3
+#define DEFAULT_HISTOGRAM_PATH "wcet.tsv"
+
+// Histogram buckets per doubling of the cycle count.
+#define BUCKETS_PER_OCTAVE 4
+#define MAX_BUCKETS (64 * BUCKETS_PER_OCTAVE)
+
+typedef struct {
+    const char *name;
+    // Adds the input events for the block starting at `start`.
+    void (*generate)(Host *host, uint64_t start, uint32_t block_size);
+    float voice_mode;
+    // If nonzero, the output capacity in bytes per sample of the block.
+    uint32_t output_bytes_per_sample;
+} WcetCase;
+
+typedef struct {
+    uint64_t median;
+    uint64_t p999;
+    uint64_t max;
+} WcetResult;
+
+static const uint32_t block_sizes[] = {32, 256, 2048};
+
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    // No cycle counter; nanoseconds are used instead.
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+static void add_midi(
+        Host *host, uint32_t frames, uint8_t status, uint8_t data1,
+        uint8_t data2) {
+    const uint8_t message[3] = {status, data1, data2};
+    if (!host_add_midi(host, frames, message, sizeof(message))) {
+        fprintf(stderr, "Error: Not enough memory for input events.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 128 "note on" messages in a single frame at the start of every block, all
+// released halfway through it. In monophonic mode, every note is scanned to
+// find the one with the lowest velocity.
+static void generate_chord_128(
+        Host *host, uint64_t start, uint32_t block_size) {
+    for (uint32_t key = 0; key < 128; key++) {
+        uint8_t velocity = 1 + (key * 37 + start) % 127;
+        add_midi(host, 0, LV2_MIDI_MSG_NOTE_ON | key % 16, key, velocity);
+    }
+    for (uint32_t key = 0; key < 128; key++) {
+        add_midi(
+            host, block_size / 2, LV2_MIDI_MSG_NOTE_OFF | key % 16, key, 0
+        );
+    }
+}
+
+// A "note off" or "note on" message in every frame, alternating, for notes
+// throughout a stack of about 120 held notes. Each event changes the notes
+// being slid between, so each restarts the slide.
+static void generate_note_storm(
+        Host *host, uint64_t start, uint32_t block_size) {
+    uint32_t frames = 0;
+    if (start == 0) {
+        for (uint32_t key = 4; key < 124; key++) {
+            add_midi(host, 0, LV2_MIDI_MSG_NOTE_ON, key, 1 + key % 127);
+        }
+        frames = 1;
+    }
+    for (; frames < block_size; frames++) {
+        uint64_t time = start + frames;
+        uint8_t key = 4 + (time / 2 * 53) % 120;
+        if (time % 2 == 0) {
+            add_midi(host, frames, LV2_MIDI_MSG_NOTE_OFF, key, 0);
+        } else {
+            add_midi(host, frames, LV2_MIDI_MSG_NOTE_ON, key, 1 + time % 127);
+        }
+    }
+}
+
+// Sixteen notes, one per channel, pressed in every even frame and turned off
+// with an "all notes off" message on every channel in every odd frame.
+static void generate_all_notes_off(
+        Host *host, uint64_t start, uint32_t block_size) {
+    for (uint32_t frames = 0; frames < block_size; frames++) {
+        uint64_t time = start + frames;
+        for (uint8_t channel = 0; channel < 16; channel++) {
+            if (time % 2 == 0) {
+                uint8_t key = 40 + channel * 3 + time % 3;
+                add_midi(
+                    host, frames, LV2_MIDI_MSG_NOTE_ON | channel, key, 64
+                );
+            } else {
+                add_midi(
+                    host, frames, LV2_MIDI_MSG_CONTROLLER | channel,
+                    LV2_MIDI_CTL_ALL_NOTES_OFF, 0
+                );
+            }
+        }
+    }
+}
+
+// A slide in every voice, with a tempo change in every frame.
+static void generate_tempo(Host *host, uint64_t start, uint32_t block_size) {
+    if (start == 0) {
+        for (uint8_t channel = 0; channel < 15; channel++) {
+            uint8_t key = 30 + channel * 6;
+            uint8_t status = LV2_MIDI_MSG_NOTE_ON | channel;
+            add_midi(host, 0, status, key, 64);
+            add_midi(host, 0, status, key + 2, 127);
+        }
+    }
+    for (uint32_t frames = 0; frames < block_size; frames++) {
+        uint64_t time = start + frames;
+        if (!host_add_tempo(host, frames, 60 + time % 121)) {
+            fprintf(stderr, "Error: Not enough memory for input events.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// A controller message in every frame and a new slide every 16 frames, with
+// an output buffer that only fits part of the output, so that messages are
+// constantly dropped or deferred.
+static void generate_output_full(
+        Host *host, uint64_t start, uint32_t block_size) {
+    for (uint32_t frames = 0; frames < block_size; frames++) {
+        uint64_t time = start + frames;
+        if (time % 16 == 0) {
+            uint8_t key = 60 + time / 16 % 7;
+            add_midi(host, frames, LV2_MIDI_MSG_NOTE_ON, key, 1 + time % 8);
+        } else if (time % 16 == 15) {
+            uint8_t key = 60 + time / 16 % 7;
+            add_midi(host, frames, LV2_MIDI_MSG_NOTE_OFF, key, 0);
+        }
+        add_midi(host, frames, LV2_MIDI_MSG_CONTROLLER, 1, time & 0x7F);
+    }
+}
+
+static const WcetCase cases[] = {
+    {"chord_128", generate_chord_128, VOICE_MODE_MONO, 0},
+    {"chord_128", generate_chord_128, VOICE_MODE_MPE, 0},
+    {"chord_128", generate_chord_128, VOICE_MODE_CHANNEL, 0},
+    {"note_storm", generate_note_storm, VOICE_MODE_MONO, 0},
+    {"note_storm", generate_note_storm, VOICE_MODE_MPE, 0},
+    {"all_notes_off", generate_all_notes_off, VOICE_MODE_MONO, 0},
+    {"all_notes_off", generate_all_notes_off, VOICE_MODE_CHANNEL, 0},
+    {"tempo", generate_tempo, VOICE_MODE_MONO, 0},
+    {"tempo", generate_tempo, VOICE_MODE_CHANNEL, 0},
+    {"output_full", generate_output_full, VOICE_MODE_MONO, 12},
+    {"output_full", generate_output_full, VOICE_MODE_MPE, 12},
+};
+
+static const char *voice_mode_name(float voice_mode) {
+    switch ((int)voice_mode) {
+        case VOICE_MODE_MPE:
+            return "mpe";
+        case VOICE_MODE_CHANNEL:
+            return "channel";
+        default:
+            return "mono";
+    }
+}
+
+static int compare_cycles(const void *a, const void *b) {
+    uint64_t cycles_a = *(const uint64_t *)a;
+    uint64_t cycles_b = *(const uint64_t *)b;
+    if (cycles_a == cycles_b) return 0;
+    return cycles_a < cycles_b ? -1 : 1;
+}
+
+// The smallest cycle count in a histogram bucket.
+static uint64_t bucket_start(uint32_t bucket) {
+    return ceil(pow(2, (double)bucket / BUCKETS_PER_OCTAVE));
+}
+
+static uint32_t cycles_bucket(uint64_t cycles) {
+    if (cycles == 0) return 0;
+    uint32_t bucket = floor(log2((double)cycles) * BUCKETS_PER_OCTAVE);
+    // Correct for rounding in log2().
+    while (bucket > 0 && bucket_start(bucket) > cycles) bucket--;
+    while (bucket + 1 < MAX_BUCKETS && bucket_start(bucket + 1) <= cycles) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Writes the nonempty buckets of the histogram of `cycles` (which must be
+// sorted).
+static void write_histogram(
+        FILE *file, const WcetCase *wcet, uint32_t block_size,
+        const uint64_t *cycles, uint32_t n_blocks) {
+    uint32_t i = 0;
+    while (i < n_blocks) {
+        uint32_t bucket = cycles_bucket(cycles[i]);
+        uint32_t count = 0;
+        for (; i < n_blocks && cycles_bucket(cycles[i]) == bucket; i++) {
+            count++;
+        }
+        fprintf(
+            file, "%s\t%s\t%" PRIu32 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu32
+            "\n", wcet->name, voice_mode_name(wcet->voice_mode), block_size,
+            bucket_start(bucket), bucket_start(bucket + 1) - 1, count
+        );
+    }
+}
+
+// Runs a case in a new instance of the plugin, and lowers each block's
+// entry in `cycles` to the time it took, if that is lower.
+static bool time_blocks(
+        const WcetCase *wcet, uint32_t block_size, uint32_t n_blocks,
+        uint64_t *cycles) {
+    Host host;
+    if (!host_init(&host, SAMPLE_RATE)) {
+        fprintf(stderr, "Error: Could not instantiate plugin.\n");
+        return false;
+    }
+    host_set_control(&host, PORT_VOICE_MODE, wcet->voice_mode);
+    host.output_limit = wcet->output_bytes_per_sample * block_size;
+
+    // Each block's input is built just before it is run, so only run() is
+    // timed.
+    bool success = true;
+    const LV2_Descriptor *descriptor = host.descriptor;
+    for (uint32_t i = 0; success && i < n_blocks; i++) {
+        host_begin_block(&host);
+        wcet->generate(&host, (uint64_t)i * block_size, block_size);
+        success = host_prepare_output(&host, block_size);
+        uint64_t start = read_cycles();
+        descriptor->run(host.instance, block_size);
+        uint64_t elapsed = read_cycles() - start;
+        if (elapsed < cycles[i]) cycles[i] = elapsed;
+    }
+    host_destroy(&host);
+    return success;
+}
+
+// The input is the same in every repetition, so each block's fastest time
+// excludes interruptions by the operating system but not slow input.
+static bool run_case(
+        const WcetCase *wcet, uint32_t block_size, uint32_t n_blocks,
+        uint32_t repetitions, FILE *histogram, WcetResult *result) {
+    uint64_t *cycles = malloc(n_blocks * sizeof(*cycles));
+    if (cycles == NULL) {
+        fprintf(stderr, "Error: Not enough memory for timings.\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < n_blocks; i++) cycles[i] = UINT64_MAX;
+    for (uint32_t i = 0; i < repetitions; i++) {
+        if (!time_blocks(wcet, block_size, n_blocks, cycles)) {
+            free(cycles);
+            return false;
+        }
+    }
+
+    qsort(cycles, n_blocks, sizeof(*cycles), compare_cycles);
+    result->median = cycles[n_blocks / 2];
+    result->p999 = cycles[(uint32_t)ceil(n_blocks * 0.999) - 1];
+    result->max = cycles[n_blocks - 1];
+    if (histogram != NULL) {
+        write_histogram(histogram, wcet, block_size, cycles, n_blocks);
+    }
+    free(cycles);
+    return true;
+}
+
+static void usage(const char *name) {
+    fprintf(
+        stderr,
+        "Usage: %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  -b <frames>    Only use this block size (default: 32, 256 and\n"
+        "                 2048)\n"
+        "  -n <blocks>    Blocks timed per case (default: %d)\n"
+        "  -r <count>     Times each case is run; each block's time is the\n"
+        "                 fastest of these (default: %d)\n"
+        "  -o <path>      Histogram file (default: %s)\n"
+        "  -m <cycles>    Fail if any block takes longer than this\n"
+        "  -p <cycles>    Fail if the 99.9th percentile of any case is\n"
+        "                 higher than this\n"
+        "\n"
+        "Times are in CPU cycles (or timer ticks, depending on the\n"
+        "processor). The histogram file has one row per nonempty bucket of\n"
+        "each case, with the range of cycles it covers and the number of\n"
+        "blocks in it.\n",
+        name, DEFAULT_BLOCKS, DEFAULT_REPETITIONS, DEFAULT_HISTOGRAM_PATH
+    );
+}
+
+int main(int argc, char **argv) {
+    uint32_t block_size = 0;
+    uint32_t n_blocks = DEFAULT_BLOCKS;
+    uint32_t repetitions = DEFAULT_REPETITIONS;
+    const char *histogram_path = DEFAULT_HISTOGRAM_PATH;
+    uint64_t max_budget = 0;
+    uint64_t p999_budget = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:r:o:m:p:h")) != -1) {
+        switch (opt) {
+            case 'b':
+                block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                n_blocks = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                repetitions = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                histogram_path = optarg;
+                break;
+            case 'm':
+                max_budget = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                p999_budget = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || n_blocks == 0 || repetitions == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *histogram = fopen(histogram_path, "w");
+    if (histogram == NULL) {
+        fprintf(stderr, "Error: Could not open %s.\n", histogram_path);
+        return EXIT_FAILURE;
+    }
+    fprintf(
+        histogram,
+        "case\tvoice_mode\tblock_size\tcycles_min\tcycles_max\tblocks\n"
+    );
+    printf(
+        "case\tvoice_mode\tblock_size\tblocks\tmedian\tp99.9\tmax\n"
+    );
+
+    const uint32_t *sizes = block_sizes;
+    size_t n_sizes = sizeof(block_sizes) / sizeof(*block_sizes);
+    if (block_size > 0) {
+        sizes = &block_size;
+        n_sizes = 1;
+    }
+
+    bool within_budget = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        for (size_t j = 0; j < n_sizes; j++) {
+            const WcetCase *wcet = &cases[i];
+            WcetResult result;
+            bool success = run_case(
+                wcet, sizes[j], n_blocks, repetitions, histogram, &result
+            );
+            if (!success) {
+                fclose(histogram);
+                return EXIT_FAILURE;
+            }
+            printf(
+                "%s\t%s\t%" PRIu32 "\t%" PRIu32 "\t%" PRIu64 "\t%" PRIu64
+                "\t%" PRIu64 "\n", wcet->name,
+                voice_mode_name(wcet->voice_mode), sizes[j], n_blocks,
+                result.median, result.p999, result.max
+            );
+            fflush(stdout);
+
+            if ((max_budget > 0 && result.max > max_budget) ||
+                (p999_budget > 0 && result.p999 > p999_budget)) {
+                fprintf(
+                    stderr, "Over budget: %s (%s, block size %" PRIu32
+                    ")\n", wcet->name, voice_mode_name(wcet->voice_mode),
+                    sizes[j]
+                );
+                within_budget = false;
+            }
+        }
+    }
+
+    if (fclose(histogram) != 0) {
+        fprintf(stderr, "Error: Could not write %s.\n", histogram_path);
+        return EXIT_FAILURE;
+    }
+    return within_budget ? EXIT_SUCCESS : EXIT_FAILURE;
+}